@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+#
+# Stand-in AXFR server for the -a tests.  Serves the zone in a zone file
+# (one RR per line: owner ttl class type rdata, for the types used in
+# these tests) over TCP, one RR per message, so that the client sees a
+# transfer that arrives in pieces.  With "reverse" the RRs after the
+# SOA are sent in reverse order, which is not canonical.
+#
+# The server listens on a port of the kernel's choosing and runs the
+# command after "--", with @PORT@ replaced by that port, as its client.
+# It serves one transfer, and exits with the command's status once both
+# are done, so nothing is left running when the client fails.
+#
+# usage: axfr-server.py zonefile [reverse] -- command [args ...]
+
+import socket
+import struct
+import subprocess
+import sys
+import threading
+
+TYPES = {'A': 1, 'NS': 2, 'SOA': 6, 'AAAA': 28, 'ZONEMD': 63}
+
+
+def name(n):
+    out = b''
+    for label in n.rstrip('.').split('.'):
+        if label:
+            out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def rdata(rtype, args):
+    if rtype == 'A':
+        return socket.inet_pton(socket.AF_INET, args[0])
+    if rtype == 'AAAA':
+        return socket.inet_pton(socket.AF_INET6, args[0])
+    if rtype == 'NS':
+        return name(args[0])
+    if rtype == 'SOA':
+        return name(args[0]) + name(args[1]) + struct.pack('!5I', *[int(x) for x in args[2:7]])
+    if rtype == 'ZONEMD':
+        return struct.pack('!IBB', int(args[0]), int(args[1]), int(args[2])) + bytes.fromhex(''.join(args[3:]))
+    raise ValueError(rtype)
+
+
+def load(path):
+    rrs = []
+    for line in open(path):
+        f = line.split()
+        if not f or f[0].startswith(';'):
+            continue
+        owner, ttl, cls, rtype = f[0], int(f[1]), f[2], f[3]
+        assert cls == 'IN'
+        rd = rdata(rtype, f[4:])
+        wire = name(owner) + struct.pack('!HHIH', TYPES[rtype], 1, ttl, len(rd)) + rd
+        rrs.append((rtype, wire))
+    soa = [w for t, w in rrs if t == 'SOA']
+    rest = [w for t, w in rrs if t != 'SOA']
+    return soa[0], rest
+
+
+def message(qid, question, rr):
+    hdr = struct.pack('!HHHHHH', qid, 0x8400, 1, 1, 0, 0)
+    msg = hdr + question + rr
+    return struct.pack('!H', len(msg)) + msg
+
+
+def readn(conn, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = conn.recv(n - len(buf))
+        if not chunk:
+            raise EOFError
+        buf += chunk
+    return buf
+
+
+def serve(s, soa, rest):
+    try:
+        conn, _ = s.accept()
+    except OSError:
+        return
+    try:
+        (qlen,) = struct.unpack('!H', readn(conn, 2))
+        query = readn(conn, qlen)
+        (qid,) = struct.unpack('!H', query[:2])
+        question = query[12:]
+        question = question[:question.index(b'\0') + 5]
+        for rr in [soa] + rest + [soa]:
+            conn.sendall(message(qid, question, rr))
+    except (EOFError, OSError):
+        pass
+    conn.close()
+
+
+def main():
+    sep = sys.argv.index('--')
+    args = sys.argv[1:sep]
+    soa, rest = load(args[0])
+    if len(args) > 1 and args[1] == 'reverse':
+        rest.reverse()
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.bind(('127.0.0.1', 0))
+    s.listen(1)
+    port = str(s.getsockname()[1])
+    server = threading.Thread(target=serve, args=(s, soa, rest))
+    server.start()
+    rc = subprocess.call([a.replace('@PORT@', port) for a in sys.argv[sep + 1:]])
+    try:
+        s.shutdown(socket.SHUT_RDWR)
+    except OSError:
+        pass
+    s.close()
+    server.join()
+    sys.exit(rc)
+
+
+main()
@@ -0,0 +1,98 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <assert.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "axfr.h"
+
+/*
+ * A minimal AXFR client on top of ldns_axfr_start() and ldns_axfr_next().
+ * Every RR is handed to the callback as soon as the message it came in
+ * has been read, so the caller can load and hash the start of the zone
+ * while the rest of it is still on the wire.
+ */
+
+#define AXFR_DEFAULT_PORT "53"
+
+/*
+ * axfr_nameserver()
+ *
+ * Point 'res' at 'server', given as host[#port].
+ */
+static void
+axfr_nameserver(ldns_resolver *res, const char *server)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai = 0;
+	struct sockaddr_storage ss;
+	ldns_rdf *ns;
+	uint16_t port = 0;
+	char *host;
+	char *p;
+	int rc;
+
+	host = strdup(server);
+	assert(host);
+	p = strchr(host, '#');
+	if (p)
+		*p++ = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(host, p ? p : AXFR_DEFAULT_PORT, &hints, &ai);
+	if (rc != 0)
+		errx(1, "%s(%d): %s: %s", __FILE__, __LINE__, server, gai_strerror(rc));
+	memset(&ss, 0, sizeof(ss));
+	assert(ai->ai_addrlen <= sizeof(ss));
+	memcpy(&ss, ai->ai_addr, ai->ai_addrlen);
+	ns = ldns_sockaddr_storage2rdf(&ss, &port);
+	if (ns == 0)
+		errx(1, "%s(%d): %s: unusable address", __FILE__, __LINE__, server);
+	if (ldns_resolver_push_nameserver(res, ns) != LDNS_STATUS_OK)
+		errx(1, "%s(%d): ldns_resolver_push_nameserver() failed", __FILE__, __LINE__);
+	ldns_resolver_set_port(res, port);
+	ldns_rdf_deep_free(ns);
+	freeaddrinfo(ai);
+	free(host);
+}
+
+/*
+ * axfr_transfer()
+ *
+ * Transfer 'zone' from 'server' and hand each RR (which is taken over)
+ * to 'cb', in the order they arrive.  The SOA that ends the transfer is
+ * not passed on.  Any failure is fatal.
+ */
+void
+axfr_transfer(const char *server, const ldns_rdf *zone, ldns_rr_class class, axfr_rr_cb *cb, void *cb_data)
+{
+	ldns_resolver *res;
+	ldns_status status;
+	ldns_rr *rr;
+
+	res = ldns_resolver_new();
+	assert(res);
+	axfr_nameserver(res, server);
+	status = ldns_axfr_start(res, (ldns_rdf *) zone, class);
+	if (status != LDNS_STATUS_OK)
+		errx(1, "%s(%d): ldns_axfr_start: %s: %s", __FILE__, __LINE__, server, ldns_get_errorstr_by_id(status));
+	while ((rr = ldns_axfr_next(res)) != 0) {
+		if (ldns_axfr_complete(res)) {
+			ldns_rr_free(rr);
+			break;
+		}
+		cb(rr, cb_data);
+	}
+	if (!ldns_axfr_complete(res)) {
+		const ldns_pkt *pkt = ldns_axfr_last_pkt(res);
+		if (pkt && ldns_pkt_get_rcode(pkt) != 0)
+			errx(1, "%s(%d): AXFR from %s failed with rcode %u", __FILE__, __LINE__, server, (unsigned int) ldns_pkt_get_rcode(pkt));
+		errx(1, "%s(%d): AXFR from %s ended early", __FILE__, __LINE__, server);
+	}
+	ldns_resolver_deep_free(res);
+}
@@ -0,0 +1,3 @@
+typedef void (axfr_rr_cb)(ldns_rr *, void *axfr_rr_data);
+
+void axfr_transfer(const char *server, const ldns_rdf *zone, ldns_rr_class, axfr_rr_cb *, void *axfr_rr_data);
@@ -0,0 +1,216 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <assert.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "rrhash.h"
+#include "batch.h"
+
+/*
+ * An update batch collects the add and del lines of an update file
+ * before any of them touch the zone.  Lines for the same RR (TTL not
+ * compared) are gathered by sorting on their rrhash keys, then played
+ * against whether the zone holds that RR to find their net effect:
+ * an add that a later del takes back, or an add of an RR that is
+ * already there, never reaches the scheme, so its leaf is neither
+ * dirtied nor rehashed.
+ *
+ * The outcome is the same as applying the lines one at a time,
+ * warnings included:  they are collected while the keys are played and
+ * printed in line order afterwards.
+ * Since no key is a prefix of another, sorting also keeps all RRs of
+ * one owner name, and hence of one leaf, next to each other.
+ */
+
+typedef struct _update_op {
+	ldns_rr *rr;
+	uint8_t *key;
+	size_t len;
+	size_t seq;
+	unsigned int line;
+	bool add;
+} update_op;
+
+typedef struct _update_warning {
+	unsigned int line;
+	const char *what;
+} update_warning;
+
+struct _update_batch {
+	update_op *ops;
+	size_t count;
+	size_t size;
+	rrhash *present;
+	const char *file;
+	update_warning *warnings;
+	size_t nwarnings;
+	size_t warnings_size;
+};
+
+update_batch *
+update_batch_new(rrhash *present, const char *file)
+{
+	update_batch *b = calloc(1, sizeof(*b));
+	assert(b);
+	assert(present);
+	b->present = present;
+	b->file = file;
+	return b;
+}
+
+/*
+ * update_batch_stage()
+ *
+ * Note an add or del of 'rr' (which is taken over) from line 'line'.
+ */
+void
+update_batch_stage(update_batch *b, bool add, ldns_rr *rr, unsigned int line)
+{
+	update_op *op;
+	if (b->count == b->size) {
+		b->size = b->size ? b->size * 2 : 1024;
+		b->ops = realloc(b->ops, b->size * sizeof(*b->ops));
+		assert(b->ops);
+	}
+	op = &b->ops[b->count];
+	op->rr = rr;
+	op->key = rrhash_key_copy(b->present, rr, &op->len);
+	op->seq = b->count;
+	op->line = line;
+	op->add = add;
+	b->count++;
+}
+
+/*
+ * update_batch_warn()
+ *
+ * Note a warning for line 'line', to be printed by update_batch_net()
+ * along with those found there, in line order.
+ */
+void
+update_batch_warn(update_batch *b, unsigned int line, const char *what)
+{
+	if (b->nwarnings == b->warnings_size) {
+		b->warnings_size = b->warnings_size ? b->warnings_size * 2 : 64;
+		b->warnings = realloc(b->warnings, b->warnings_size * sizeof(*b->warnings));
+		assert(b->warnings);
+	}
+	b->warnings[b->nwarnings].line = line;
+	b->warnings[b->nwarnings].what = what;
+	b->nwarnings++;
+}
+
+static int
+update_warning_compare(const void *A, const void *B)
+{
+	const update_warning *a = A;
+	const update_warning *b = B;
+	return a->line < b->line ? -1 : a->line > b->line;
+}
+
+static int
+update_op_compare(const void *A, const void *B)
+{
+	const update_op *a = A;
+	const update_op *b = B;
+	int r = memcmp(a->key, b->key, a->len < b->len ? a->len : b->len);
+	if (r)
+		return r;
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/*
+ * update_batch_net_sub()
+ *
+ * Play the 'n' ops on one RR, in input order.  'keep' is the RR this
+ * batch leaves in the zone and 'gone' the del that removes the one
+ * there before; whatever else was staged is freed.  Returns the number
+ * of adds taken back by a later del.
+ */
+static size_t
+update_batch_net_sub(update_batch *b, update_op *ops, size_t n, ldns_rr_list *dels, ldns_rr_list *adds)
+{
+	bool there = rrhash_contains(b->present, ops[0].rr);
+	ldns_rr *keep = 0;
+	ldns_rr *gone = 0;
+	size_t cancelled = 0;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		update_op *op = &ops[i];
+		if (op->add && there) {
+			update_batch_warn(b, op->line, "ignoring duplicate RR");
+			ldns_rr_free(op->rr);
+		} else if (op->add) {
+			keep = op->rr;
+			there = true;
+		} else if (!there) {
+			update_batch_warn(b, op->line, "RR to delete not found");
+			ldns_rr_free(op->rr);
+		} else if (keep) {
+			ldns_rr_free(keep);
+			ldns_rr_free(op->rr);
+			keep = 0;
+			there = false;
+			cancelled++;
+		} else {
+			assert(gone == 0);
+			gone = op->rr;
+			there = false;
+		}
+		op->rr = 0;
+	}
+	if (gone)
+		ldns_rr_list_push_rr(dels, gone);
+	if (keep)
+		ldns_rr_list_push_rr(adds, keep);
+	return cancelled;
+}
+
+/*
+ * update_batch_net()
+ *
+ * Reduce the batch to the RRs to delete from the zone and the RRs to
+ * add to it, deletions first.  Both lists are grouped by owner name.
+ * The RRs in them are handed over to the caller.  Returns the number
+ * of add/del pairs that cancelled out.
+ */
+size_t
+update_batch_net(update_batch *b, ldns_rr_list *dels, ldns_rr_list *adds)
+{
+	size_t cancelled = 0;
+	size_t i;
+	size_t j;
+	qsort(b->ops, b->count, sizeof(*b->ops), update_op_compare);
+	for (i = 0; i < b->count; i = j) {
+		for (j = i + 1; j < b->count; j++)
+			if (b->ops[j].len != b->ops[i].len || memcmp(b->ops[j].key, b->ops[i].key, b->ops[i].len) != 0)
+				break;
+		cancelled += update_batch_net_sub(b, &b->ops[i], j - i, dels, adds);
+	}
+	for (i = 0; i < b->count; i++)
+		free(b->ops[i].key);
+	b->count = 0;
+	qsort(b->warnings, b->nwarnings, sizeof(*b->warnings), update_warning_compare);
+	for (i = 0; i < b->nwarnings; i++)
+		warnx("%s(%d): zonemd_zone_update: %s line %u %s", __FILE__, __LINE__, b->file, b->warnings[i].line, b->warnings[i].what);
+	b->nwarnings = 0;
+	return cancelled;
+}
+
+void
+update_batch_free(update_batch *b)
+{
+	size_t i;
+	for (i = 0; i < b->count; i++) {
+		ldns_rr_free(b->ops[i].rr);
+		free(b->ops[i].key);
+	}
+	free(b->ops);
+	free(b->warnings);
+	free(b);
+}
@@ -0,0 +1,7 @@
+typedef struct _update_batch update_batch;
+
+update_batch *update_batch_new(struct _rrhash *present, const char *file);
+void update_batch_stage(update_batch *, bool add, ldns_rr *, unsigned int line);
+void update_batch_warn(update_batch *, unsigned int line, const char *what);
+size_t update_batch_net(update_batch *, ldns_rr_list *dels, ldns_rr_list *adds);
+void update_batch_free(update_batch *);
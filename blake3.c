@@ -0,0 +1,378 @@
+#define OPENSSL_SUPPRESS_DEPRECATED 1
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#include "blake3.h"
+
+/*
+ * BLAKE3, for the private-use ZONEMD hash algorithm ZONEMD_HASHALG_BLAKE3.
+ *
+ * The rest of the program only knows about EVP_MD, so the hash is
+ * wrapped as a (legacy) OpenSSL message digest.  It can then be used
+ * everywhere SHA-384 and SHA-512 are, including the tree schemes.
+ *
+ * Input is buffered BLAKE3_LANES chunks at a time.  Full batches are
+ * compressed side by side, one chunk per lane of a GCC vector, which
+ * the compiler turns into SSE/AVX/NEON code as the target allows.
+ * Chunk chaining values are merged into the tree as in the reference
+ * implementation.  Digests are 32 octets.
+ */
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_LANES 8
+#define BLAKE3_MAX_DEPTH 54
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+typedef uint32_t u32xN __attribute__ ((vector_size(4 * BLAKE3_LANES)));
+
+typedef struct {
+	uint8_t buf[BLAKE3_LANES * BLAKE3_CHUNK_LEN];
+	size_t buf_len;
+	uint64_t chunk_counter;		/* of the first chunk in buf */
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+	unsigned int cv_stack_len;
+} blake3_hasher;
+
+static const uint32_t IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+	{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+	{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+	{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+	{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+	{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+/*
+ * The quarter-round and rounds are written once as a macro so that the
+ * same text serves both the scalar and the vector compression.
+ */
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define G(v, a, b, c, d, x, y) do { \
+	v[a] = v[a] + v[b] + (x); v[d] = ROTR(v[d] ^ v[a], 16); \
+	v[c] = v[c] + v[d]; v[b] = ROTR(v[b] ^ v[c], 12); \
+	v[a] = v[a] + v[b] + (y); v[d] = ROTR(v[d] ^ v[a], 8); \
+	v[c] = v[c] + v[d]; v[b] = ROTR(v[b] ^ v[c], 7); \
+} while (0)
+#define ROUNDS(v, m) do { \
+	unsigned int r; \
+	for (r = 0; r < 7; r++) { \
+		const uint8_t *s = MSG_SCHEDULE[r]; \
+		G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]); \
+		G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]); \
+		G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]); \
+		G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]); \
+		G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]); \
+		G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+		G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]); \
+		G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]); \
+	} \
+} while (0)
+
+static uint32_t
+load32(const uint8_t *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void
+store32(uint8_t *p, uint32_t w)
+{
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
+
+/*
+ * blake3_compress()
+ *
+ * One compression.  The new chaining value is left in out[0..7], the
+ * full 16-word output in out[0..15].
+ */
+static void
+blake3_compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len, uint64_t counter, uint8_t flags, uint32_t out[16])
+{
+	uint32_t m[16];
+	uint32_t v[16];
+	unsigned int i;
+	for (i = 0; i < 16; i++)
+		m[i] = load32(block + 4 * i);
+	for (i = 0; i < 8; i++)
+		v[i] = cv[i];
+	for (i = 0; i < 4; i++)
+		v[8 + i] = IV[i];
+	v[12] = (uint32_t) counter;
+	v[13] = (uint32_t) (counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+	ROUNDS(v, m);
+	for (i = 0; i < 8; i++) {
+		out[i] = v[i] ^ v[i + 8];
+		out[i + 8] = v[i + 8] ^ cv[i];
+	}
+}
+
+/*
+ * blake3_hash_lanes()
+ *
+ * Chaining values of BLAKE3_LANES full, non-root chunks at once.
+ */
+static void
+blake3_hash_lanes(const uint8_t *input, uint64_t counter, uint32_t out[BLAKE3_LANES][8])
+{
+	u32xN cv[8];
+	u32xN m[16];
+	u32xN v[16];
+	u32xN ctr_lo;
+	u32xN ctr_hi;
+	unsigned int b;
+	unsigned int i;
+	unsigned int l;
+	for (l = 0; l < BLAKE3_LANES; l++) {
+		ctr_lo[l] = (uint32_t) (counter + l);
+		ctr_hi[l] = (uint32_t) ((counter + l) >> 32);
+	}
+	for (i = 0; i < 8; i++)
+		cv[i] = (u32xN) {0} + IV[i];
+	for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+		uint32_t flags = 0;
+		if (b == 0)
+			flags |= CHUNK_START;
+		if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+			flags |= CHUNK_END;
+		for (i = 0; i < 16; i++)
+			for (l = 0; l < BLAKE3_LANES; l++)
+				m[i][l] = load32(input + l * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN + 4 * i);
+		for (i = 0; i < 8; i++)
+			v[i] = cv[i];
+		for (i = 0; i < 4; i++)
+			v[8 + i] = (u32xN) {0} + IV[i];
+		v[12] = ctr_lo;
+		v[13] = ctr_hi;
+		v[14] = (u32xN) {0} + BLAKE3_BLOCK_LEN;
+		v[15] = (u32xN) {0} + flags;
+		ROUNDS(v, m);
+		for (i = 0; i < 8; i++)
+			cv[i] = v[i] ^ v[i + 8];
+	}
+	for (l = 0; l < BLAKE3_LANES; l++)
+		for (i = 0; i < 8; i++)
+			out[l][i] = cv[i][l];
+}
+
+/*
+ * blake3_push_cv()
+ *
+ * Add the chaining value of chunk number 'total_chunks' - 1, merging
+ * completed subtrees.  Merging is lazy, so that the last chunk is never
+ * merged before it is known whether it is the root.
+ */
+static void
+blake3_push_cv(blake3_hasher *h, const uint32_t cv[8], uint64_t total_chunks)
+{
+	uint32_t new_cv[8];
+	memcpy(new_cv, cv, sizeof(new_cv));
+	while ((total_chunks & 1) == 0) {
+		uint8_t block[BLAKE3_BLOCK_LEN];
+		uint32_t out[16];
+		unsigned int i;
+		assert(h->cv_stack_len > 0);
+		h->cv_stack_len--;
+		for (i = 0; i < 8; i++) {
+			store32(block + 4 * i, h->cv_stack[h->cv_stack_len][i]);
+			store32(block + 32 + 4 * i, new_cv[i]);
+		}
+		blake3_compress(IV, block, BLAKE3_BLOCK_LEN, 0, PARENT, out);
+		memcpy(new_cv, out, sizeof(new_cv));
+		total_chunks >>= 1;
+	}
+	assert(h->cv_stack_len < BLAKE3_MAX_DEPTH);
+	memcpy(h->cv_stack[h->cv_stack_len++], new_cv, sizeof(new_cv));
+}
+
+/*
+ * blake3_chunk_cv()
+ *
+ * Chaining value of one full, non-root chunk.
+ */
+static void
+blake3_chunk_cv(const uint8_t *chunk, uint64_t counter, uint32_t cv[8])
+{
+	uint32_t out[16];
+	unsigned int b;
+	memcpy(cv, IV, 8 * sizeof(*cv));
+	for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+		uint8_t flags = 0;
+		if (b == 0)
+			flags |= CHUNK_START;
+		if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+			flags |= CHUNK_END;
+		blake3_compress(cv, chunk + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter, flags, out);
+		memcpy(cv, out, 8 * sizeof(*cv));
+	}
+}
+
+static void
+blake3_init(blake3_hasher *h)
+{
+	h->buf_len = 0;
+	h->chunk_counter = 0;
+	h->cv_stack_len = 0;
+}
+
+static void
+blake3_update(blake3_hasher *h, const uint8_t *data, size_t len)
+{
+	while (len) {
+		size_t n;
+		if (h->buf_len == sizeof(h->buf)) {
+			/*
+			 * More input follows, so none of these is the root.
+			 */
+			uint32_t cvs[BLAKE3_LANES][8];
+			unsigned int l;
+			blake3_hash_lanes(h->buf, h->chunk_counter, cvs);
+			for (l = 0; l < BLAKE3_LANES; l++)
+				blake3_push_cv(h, cvs[l], h->chunk_counter + l + 1);
+			h->chunk_counter += BLAKE3_LANES;
+			h->buf_len = 0;
+		}
+		n = sizeof(h->buf) - h->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(h->buf + h->buf_len, data, n);
+		h->buf_len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+blake3_final(blake3_hasher *h, uint8_t *digest)
+{
+	uint32_t cv[8];
+	uint32_t out[16];
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	const uint8_t *last;
+	size_t last_len;
+	size_t nfull;
+	size_t i;
+	uint64_t counter;
+	uint8_t flags;
+	uint8_t block_len;
+
+	/*
+	 * Every buffered chunk except the last is complete and not the root.
+	 */
+	nfull = h->buf_len ? (h->buf_len - 1) / BLAKE3_CHUNK_LEN : 0;
+	for (i = 0; i < nfull; i++) {
+		blake3_chunk_cv(h->buf + i * BLAKE3_CHUNK_LEN, h->chunk_counter + i, cv);
+		blake3_push_cv(h, cv, h->chunk_counter + i + 1);
+	}
+	last = h->buf + nfull * BLAKE3_CHUNK_LEN;
+	last_len = h->buf_len - nfull * BLAKE3_CHUNK_LEN;
+	counter = h->chunk_counter + nfull;
+
+	/*
+	 * Compress all but the final block of the last chunk; the final
+	 * block is the output node unless there are parents above it.
+	 */
+	memcpy(cv, IV, sizeof(cv));
+	flags = CHUNK_START;
+	while (last_len > BLAKE3_BLOCK_LEN) {
+		blake3_compress(cv, last, BLAKE3_BLOCK_LEN, counter, flags, out);
+		memcpy(cv, out, sizeof(cv));
+		flags = 0;
+		last += BLAKE3_BLOCK_LEN;
+		last_len -= BLAKE3_BLOCK_LEN;
+	}
+	memset(block, 0, sizeof(block));
+	memcpy(block, last, last_len);
+	block_len = (uint8_t) last_len;
+	flags |= CHUNK_END;
+	while (h->cv_stack_len > 0) {
+		blake3_compress(cv, block, block_len, counter, flags, out);
+		h->cv_stack_len--;
+		for (i = 0; i < 8; i++) {
+			store32(block + 4 * i, h->cv_stack[h->cv_stack_len][i]);
+			store32(block + 32 + 4 * i, out[i]);
+		}
+		memcpy(cv, IV, sizeof(cv));
+		block_len = BLAKE3_BLOCK_LEN;
+		flags = PARENT;
+		counter = 0;
+	}
+	blake3_compress(cv, block, block_len, counter, flags | ROOT, out);
+	for (i = 0; i < BLAKE3_OUT_LEN / 4; i++)
+		store32(digest + 4 * i, out[i]);
+}
+
+/* ============================================================================== */
+
+static int
+blake3_md_init(EVP_MD_CTX *ctx)
+{
+	blake3_init(EVP_MD_CTX_md_data(ctx));
+	return 1;
+}
+
+static int
+blake3_md_update(EVP_MD_CTX *ctx, const void *data, size_t len)
+{
+	blake3_update(EVP_MD_CTX_md_data(ctx), data, len);
+	return 1;
+}
+
+static int
+blake3_md_final(EVP_MD_CTX *ctx, unsigned char *md)
+{
+	blake3_final(EVP_MD_CTX_md_data(ctx), md);
+	return 1;
+}
+
+static EVP_MD *blake3_md = 0;
+static pthread_once_t blake3_md_once = PTHREAD_ONCE_INIT;
+
+static void
+blake3_md_create(void)
+{
+	EVP_MD *md = EVP_MD_meth_new(NID_undef, NID_undef);
+	if (md == 0
+	    || !EVP_MD_meth_set_result_size(md, BLAKE3_OUT_LEN)
+	    || !EVP_MD_meth_set_input_blocksize(md, BLAKE3_BLOCK_LEN)
+	    || !EVP_MD_meth_set_app_datasize(md, sizeof(blake3_hasher))
+	    || !EVP_MD_meth_set_init(md, blake3_md_init)
+	    || !EVP_MD_meth_set_update(md, blake3_md_update)
+	    || !EVP_MD_meth_set_final(md, blake3_md_final))
+		errx(1, "%s(%d): Cannot create BLAKE3 message digest", __FILE__, __LINE__);
+	blake3_md = md;
+}
+
+/*
+ * zonemd_blake3()
+ *
+ * The BLAKE3 EVP_MD, created on first use.
+ */
+const EVP_MD *
+zonemd_blake3(void)
+{
+	pthread_once(&blake3_md_once, blake3_md_create);
+	return blake3_md;
+}
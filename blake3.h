@@ -0,0 +1,3 @@
+#define ZONEMD_HASHALG_BLAKE3 240
+
+const EVP_MD *zonemd_blake3(void);
@@ -0,0 +1,624 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <err.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "canon.h"
+#include "cow.h"
+#include "sha512.h"
+#include "digest.h"
+#include "btree.h"
+
+/*
+ * Private scheme 241:  a B+-tree over canonical RR order.
+ *
+ * Leaves hold the RRs of a run of consecutive owner names, in canonical
+ * order; an interior node's digest is taken over its children's digests.
+ * All RRs of one owner name are always in the same leaf.
+ *
+ * Node boundaries are picked by the names themselves, not by the order
+ * in which RRs were added, so the same zone always yields the same tree.
+ * Each owner name has a height:  the number of trailing zero digits,
+ * base BTREE_FANOUT, of a hash of its lowercased wire form.  A node at
+ * level k ends after every name of height greater than k (except the
+ * last name of the zone), which gives an expected fanout, and expected
+ * names per leaf, of BTREE_FANOUT.  Adding or removing one name splits
+ * or joins only the nodes on its path, so an update costs O(log n)
+ * digest recalculations.
+ *
+ * The leaf callback cannot know what the caller does with the list it
+ * returns, so structural changes are deferred:  leaves handed out are
+ * marked unsettled, and btree_settle() splits and joins them before the
+ * tree is digested, iterated, copied or compared.
+ */
+
+#define BTREE_FANOUT 16
+#define BTREE_MAX_HEIGHT 8
+
+typedef struct _btree_node {
+	unsigned int level;		/* 0 for leaves */
+	struct _btree_node *parent;
+	struct _btree_node **kids;
+	unsigned int nkids;
+	cow_rrlist *leaf;
+	ldns_rdf *bound;		/* last owner name, NULL for the rightmost node */
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	const EVP_MD *digest_md;	/* algorithm of the cached digest */
+	bool dirty;
+	bool unsettled;
+} btree_node;
+
+typedef struct {
+	btree_node *root;
+} btree;
+
+/*
+ * btree_height()
+ *
+ * The height of an owner name, from a 64-bit FNV-1a hash of the
+ * lowercased name with a final mix so that the low bits are usable.
+ */
+static unsigned int
+btree_height(const ldns_rdf *name)
+{
+	uint8_t buf[LDNS_MAX_DOMAINLEN + 1];
+	size_t len = ldns_rdf_size(name);
+	uint64_t h = 14695981039346656037ULL;
+	unsigned int height = 0;
+	size_t i;
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+	canon_lower(buf, ldns_rdf_data(name), len);
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	while (height < BTREE_MAX_HEIGHT && h % BTREE_FANOUT == 0) {
+		height++;
+		h /= BTREE_FANOUT;
+	}
+	return height;
+}
+
+static btree_node *
+btree_node_new(unsigned int level)
+{
+	btree_node *n = calloc(1, sizeof(*n));
+	assert(n);
+	n->level = level;
+	n->dirty = true;
+	if (level == 0)
+		n->leaf = cow_rrlist_new();
+	return n;
+}
+
+/*
+ * btree_node_free()
+ *
+ * Free one node, not its kids.
+ */
+static void
+btree_node_free(btree_node *n)
+{
+	if (n->leaf)
+		cow_rrlist_release(n->leaf);
+	if (n->bound)
+		ldns_rdf_deep_free(n->bound);
+	free(n->kids);
+	free(n);
+}
+
+static void
+btree_free_sub(btree_node *n)
+{
+	unsigned int i;
+	for (i = 0; i < n->nkids; i++)
+		btree_free_sub(n->kids[i]);
+	btree_node_free(n);
+}
+
+static unsigned int
+btree_kid_index(const btree_node *parent, const btree_node *kid)
+{
+	unsigned int i;
+	for (i = 0; i < parent->nkids; i++)
+		if (parent->kids[i] == kid)
+			return i;
+	errx(1, "%s(%d): btree node not found in its parent", __FILE__, __LINE__);
+}
+
+static void
+btree_insert_kid(btree_node *parent, unsigned int i, btree_node *kid)
+{
+	parent->kids = realloc(parent->kids, (parent->nkids + 1) * sizeof(*parent->kids));
+	assert(parent->kids);
+	memmove(&parent->kids[i + 1], &parent->kids[i], (parent->nkids - i) * sizeof(*parent->kids));
+	parent->kids[i] = kid;
+	parent->nkids++;
+	kid->parent = parent;
+	parent->dirty = true;
+}
+
+static void
+btree_remove_kid(btree_node *parent, unsigned int i)
+{
+	parent->nkids--;
+	memmove(&parent->kids[i], &parent->kids[i + 1], (parent->nkids - i) * sizeof(*parent->kids));
+	parent->dirty = true;
+}
+
+/*
+ * btree_route()
+ *
+ * Index of the kid whose range covers 'owner'.  Every kid but the last
+ * has a bound.
+ */
+static unsigned int
+btree_route(const btree_node *node, const ldns_rdf *owner)
+{
+	unsigned int i;
+	for (i = 0; i + 1 < node->nkids; i++)
+		if (ldns_dname_compare(owner, node->kids[i]->bound) <= 0)
+			break;
+	return i;
+}
+
+/*
+ * btree_split()
+ *
+ * Make 'node' end with 'name', moving RRs (or kids) from index 'at' on
+ * into a new right sibling, and repeat for the ancestors up to the
+ * name's height.  A new root is added when the old one splits.
+ */
+static void
+btree_split(btree *t, btree_node *node, unsigned int at, const ldns_rdf *name)
+{
+	unsigned int height = btree_height(name);
+	while (node->level < height) {
+		btree_node *right = btree_node_new(node->level);
+		unsigned int i;
+		if (node->level == 0) {
+			ldns_rr_list *list = cow_rrlist_write(&node->leaf);
+			ldns_rr_list *rlist = cow_rrlist_write(&right->leaf);
+			for (i = at; i < ldns_rr_list_rr_count(list); i++)
+				ldns_rr_list_push_rr(rlist, ldns_rr_list_rr(list, i));
+			ldns_rr_list_set_rr_count(list, at);
+			node->leaf->sorted = true;
+			right->leaf->sorted = true;
+			right->unsettled = true;
+		} else {
+			for (i = at; i < node->nkids; i++)
+				btree_insert_kid(right, right->nkids, node->kids[i]);
+			node->nkids = at;
+		}
+		right->bound = node->bound;
+		node->bound = ldns_rdf_clone(name);
+		assert(node->bound);
+		node->dirty = true;
+		if (node->parent == 0) {
+			btree_node *root = btree_node_new(node->level + 1);
+			btree_insert_kid(root, 0, node);
+			t->root = root;
+		}
+		btree_insert_kid(node->parent, btree_kid_index(node->parent, node) + 1, right);
+		at = btree_kid_index(node->parent, node) + 1;
+		node = node->parent;
+	}
+}
+
+/*
+ * btree_join()
+ *
+ * Undo the splits at the bound of 'leaf', whose name is gone or is now
+ * the last in the zone:  from the highest level down, join each
+ * ancestor that ends at that name with its right sibling.
+ */
+static void
+btree_join(btree *t, btree_node *leaf)
+{
+	unsigned int level;
+	assert(leaf && leaf->bound);
+	level = btree_height(leaf->bound);
+	while (level-- > 0) {
+		btree_node *node = leaf;
+		btree_node *right;
+		unsigned int i;
+		while (node->level < level)
+			node = node->parent;
+		assert(node->parent);
+		i = btree_kid_index(node->parent, node);
+		assert(i + 1 < node->parent->nkids);
+		right = node->parent->kids[i + 1];
+		if (level == 0) {
+			ldns_rr_list *list = cow_rrlist_write(&node->leaf);
+			ldns_rr_list *rlist = cow_rrlist_write(&right->leaf);
+			unsigned int j;
+			for (j = 0; j < ldns_rr_list_rr_count(rlist); j++)
+				ldns_rr_list_push_rr(list, ldns_rr_list_rr(rlist, j));
+			ldns_rr_list_set_rr_count(rlist, 0);
+			node->unsettled = true;
+		} else {
+			unsigned int j;
+			for (j = 0; j < right->nkids; j++)
+				btree_insert_kid(node, node->nkids, right->kids[j]);
+			right->nkids = 0;
+		}
+		ldns_rdf_deep_free(node->bound);
+		node->bound = right->bound;
+		right->bound = 0;
+		node->dirty = true;
+		btree_remove_kid(node->parent, i + 1);
+		btree_node_free(right);
+	}
+	while (t->root->level > 0 && t->root->nkids == 1) {
+		btree_node *kid = t->root->kids[0];
+		t->root->nkids = 0;
+		btree_node_free(t->root);
+		kid->parent = 0;
+		t->root = kid;
+	}
+}
+
+static btree_node *
+btree_prev_leaf(btree_node *node)
+{
+	while (node->parent) {
+		unsigned int i = btree_kid_index(node->parent, node);
+		if (i > 0) {
+			node = node->parent->kids[i - 1];
+			while (node->level > 0)
+				node = node->kids[node->nkids - 1];
+			return node;
+		}
+		node = node->parent;
+	}
+	return 0;
+}
+
+/*
+ * btree_settle_leaf()
+ *
+ * Bring one leaf back in line with the boundary rule.  Boundaries are
+ * split off from the right so that each RR moves only once.  Returns
+ * true if the tree changed shape, in which case the caller starts over.
+ */
+static bool
+btree_settle_leaf(btree *t, btree_node *leaf)
+{
+	const ldns_rr_list *list = cow_rrlist_read(leaf->leaf);
+	size_t n = ldns_rr_list_rr_count(list);
+	bool changed = false;
+	size_t i;
+	for (i = n - 1; i > 0 && n > 0; i--) {
+		const ldns_rdf *prev = ldns_rr_owner(ldns_rr_list_rr(list, i - 1));
+		if (canon_dname_equal(prev, ldns_rr_owner(ldns_rr_list_rr(list, i))))
+			continue;
+		if (btree_height(prev) == 0)
+			continue;
+		btree_split(t, leaf, i, prev);
+		changed = true;
+	}
+	if (changed)
+		return true;
+	if (leaf->bound) {
+		if (n == 0 || !canon_dname_equal(ldns_rr_owner(ldns_rr_list_rr(list, n - 1)), leaf->bound)) {
+			btree_join(t, leaf);
+			return true;
+		}
+	} else if (n == 0 && leaf->parent) {
+		btree_join(t, btree_prev_leaf(leaf));
+		return true;
+	}
+	leaf->unsettled = false;
+	return false;
+}
+
+static bool
+btree_settle_sub(btree *t, btree_node *node)
+{
+	unsigned int i;
+	if (!node->dirty)
+		return false;
+	if (node->level == 0)
+		return node->unsettled && btree_settle_leaf(t, node);
+	for (i = 0; i < node->nkids; i++)
+		if (btree_settle_sub(t, node->kids[i]))
+			return true;
+	return false;
+}
+
+/*
+ * btree_settle()
+ *
+ * Settle every leaf handed out since the last call.  Unsettled leaves
+ * are only found below dirty nodes.
+ */
+static void
+btree_settle(btree *t)
+{
+	while (btree_settle_sub(t, t->root))
+		(void) 0;
+}
+
+static void
+btree_iterate_sub(btree_node *node, const scheme_iterate_cb cb, const void *cb_data)
+{
+	const ldns_rr_list *rrlist;
+	unsigned int i;
+	if (node->level > 0) {
+		for (i = 0; i < node->nkids; i++)
+			btree_iterate_sub(node->kids[i], cb, cb_data);
+		return;
+	}
+	rrlist = cow_rrlist_read(node->leaf);
+	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++)
+		cb(ldns_rr_list_rr(rrlist, i), cb_data);
+}
+
+static void
+btree_span_sub(btree_node *node, const scheme_span_cb cb, const void *cb_data)
+{
+	unsigned int i;
+	if (node->level > 0) {
+		for (i = 0; i < node->nkids; i++)
+			btree_span_sub(node->kids[i], cb, cb_data);
+		return;
+	}
+	cow_rrlist_spans(node->leaf, 0, cb, cb_data);
+}
+
+static void
+btree_calc_digest_sub(btree_node *node, const EVP_MD * md, unsigned char *buf)
+{
+	digest_ctx ctx;
+	if (!node->dirty && node->digest_md == md) {
+		memcpy(buf, node->digest, EVP_MD_size(md));
+		return;
+	}
+	digest_init(&ctx, md);
+	if (node->level > 0) {
+		unsigned char kid_digest[EVP_MAX_MD_SIZE];
+		unsigned int i;
+		for (i = 0; i < node->nkids; i++) {
+			btree_calc_digest_sub(node->kids[i], md, kid_digest);
+			digest_update(&ctx, kid_digest, EVP_MD_size(md));
+		}
+	} else {
+		size_t len;
+		const uint8_t *wire = cow_rrlist_wire(node->leaf, &len);
+		digest_update(&ctx, wire, len);
+	}
+	digest_final(&ctx, node->digest);
+	memcpy(buf, node->digest, EVP_MD_size(md));
+	node->digest_md = md;
+	node->dirty = false;
+}
+
+/*
+ * BTREE_CALC_KERNEL()
+ *
+ * Define btree_calc_<name>(), btree_calc_digest_sub() specialized for
+ * one algorithm of the SHA-512 family:  the hash is called directly and
+ * the digest length is a constant.
+ */
+#define BTREE_CALC_KERNEL(name, LEN) \
+static void \
+btree_calc_##name(btree_node *node, const EVP_MD * md, unsigned char *buf) \
+{ \
+	sha512_ctx ctx; \
+	if (!node->dirty && node->digest_md == md) { \
+		memcpy(buf, node->digest, LEN); \
+		return; \
+	} \
+	sha512_init(&ctx, LEN); \
+	if (node->level > 0) { \
+		unsigned char kid_digest[LEN]; \
+		unsigned int i; \
+		for (i = 0; i < node->nkids; i++) { \
+			btree_calc_##name(node->kids[i], md, kid_digest); \
+			sha512_update(&ctx, kid_digest, LEN); \
+		} \
+	} else { \
+		size_t len; \
+		const uint8_t *wire = cow_rrlist_wire(node->leaf, &len); \
+		sha512_update(&ctx, wire, len); \
+	} \
+	sha512_final(&ctx, node->digest); \
+	memcpy(buf, node->digest, LEN); \
+	node->digest_md = md; \
+	node->dirty = false; \
+}
+
+BTREE_CALC_KERNEL(sha384, SHA384_DIGEST_LEN)
+BTREE_CALC_KERNEL(sha512, SHA512_DIGEST_LEN)
+
+static btree_node *
+btree_snapshot_sub(const btree_node *node, btree_node *parent)
+{
+	btree_node *copy = malloc(sizeof(*copy));
+	unsigned int i;
+	assert(copy);
+	memcpy(copy, node, sizeof(*copy));
+	copy->parent = parent;
+	if (node->bound)
+		copy->bound = ldns_rdf_clone(node->bound);
+	if (node->leaf)
+		copy->leaf = cow_rrlist_share(node->leaf);
+	if (node->nkids) {
+		copy->kids = calloc(node->nkids, sizeof(*copy->kids));
+		assert(copy->kids);
+		for (i = 0; i < node->nkids; i++)
+			copy->kids[i] = btree_snapshot_sub(node->kids[i], copy);
+	}
+	return copy;
+}
+
+static void
+btree_collect_leaves(btree_node *node, cow_rrlist ***leaves, size_t *n)
+{
+	unsigned int i;
+	if (node->level > 0) {
+		for (i = 0; i < node->nkids; i++)
+			btree_collect_leaves(node->kids[i], leaves, n);
+		return;
+	}
+	*leaves = realloc(*leaves, (*n + 1) * sizeof(**leaves));
+	assert(*leaves);
+	(*leaves)[(*n)++] = node->leaf;
+}
+
+/* ============================================================================== */
+
+scheme *
+scheme_btree_new(uint8_t opt_scheme)
+{
+	scheme *s;
+	btree *t;
+	assert(241 == opt_scheme);
+	fdebugf(stderr, "Creating B+-tree of scheme %u\n", opt_scheme);
+	s = calloc(1, sizeof(*s));
+	assert(s);
+	s->scheme = opt_scheme;
+	s->leaf = scheme_btree_get_leaf_rr_list;
+	s->leaf_ro = scheme_btree_get_leaf_ro;
+	s->calc = scheme_btree_calc_digest;
+	s->iter = scheme_btree_iterate;
+	s->span = scheme_btree_span;
+	s->snap = scheme_btree_snapshot;
+	s->diff = scheme_btree_diff;
+	s->free = scheme_btree_free;
+	t = calloc(1, sizeof(*t));
+	assert(t);
+	t->root = btree_node_new(0);
+	s->data = t;
+	return s;
+}
+
+/*
+ * Return the list of the leaf whose range covers the owner of 'rr'.
+ */
+ldns_rr_list *
+scheme_btree_get_leaf_rr_list(const scheme *s, const ldns_rr * rr)
+{
+	btree *t = s->data;
+	btree_node *node = t->root;
+	node->dirty = true;
+	while (node->level > 0) {
+		node = node->kids[btree_route(node, ldns_rr_owner(rr))];
+		node->dirty = true;
+	}
+	node->unsettled = true;
+	return cow_rrlist_write(&node->leaf);
+}
+
+/*
+ * Read-only version of the above.
+ */
+cow_rrlist *
+scheme_btree_get_leaf_ro(const scheme *s, const ldns_rr * rr)
+{
+	btree *t = s->data;
+	btree_node *node = t->root;
+	while (node->level > 0)
+		node = node->kids[btree_route(node, ldns_rr_owner(rr))];
+	cow_rrlist_read(node->leaf);
+	return node->leaf;
+}
+
+/*
+ * Iterate over ALL RRs in the zone, in canonical order.
+ */
+void
+scheme_btree_iterate(const scheme *s, const scheme_iterate_cb cb, const void *cb_data)
+{
+	btree *t = s->data;
+	btree_settle(t);
+	btree_iterate_sub(t->root, cb, cb_data);
+}
+
+/*
+ * Iterate over ALL RRs in the zone, a leaf at a time.
+ */
+void
+scheme_btree_span(const scheme *s, const scheme_span_cb cb, const void *cb_data)
+{
+	btree *t = s->data;
+	btree_settle(t);
+	btree_span_sub(t->root, cb, cb_data);
+}
+
+void
+scheme_btree_calc_digest(const scheme *s, const EVP_MD * md, unsigned char *buf)
+{
+	btree *t = s->data;
+	btree_settle(t);
+	switch (digest_kernel_for(md)) {
+	case DIGEST_KERNEL_SHA384:
+		btree_calc_sha384(t->root, md, buf);
+		break;
+	case DIGEST_KERNEL_SHA512:
+		btree_calc_sha512(t->root, md, buf);
+		break;
+	default:
+		btree_calc_digest_sub(t->root, md, buf);
+		break;
+	}
+}
+
+/*
+ * scheme_btree_snapshot()
+ *
+ * Copy the interior of the tree; leaves are shared copy-on-write.
+ */
+scheme *
+scheme_btree_snapshot(const scheme *s)
+{
+	btree *t = s->data;
+	btree *copy_t;
+	scheme *copy = calloc(1, sizeof(*copy));
+	assert(copy);
+	memcpy(copy, s, sizeof(*copy));
+	btree_settle(t);
+	copy_t = calloc(1, sizeof(*copy_t));
+	assert(copy_t);
+	copy_t->root = btree_snapshot_sub(t->root, 0);
+	copy->data = copy_t;
+	copy->dedup = 0;
+	return copy;
+}
+
+/*
+ * scheme_btree_diff()
+ *
+ * The two trees need not have the same shape; see cow_rrlist_diff_seq().
+ */
+void
+scheme_btree_diff(const scheme *a, const scheme *b, const scheme_diff_cb cb, const void *cb_data)
+{
+	cow_rrlist **la = 0;
+	cow_rrlist **lb = 0;
+	size_t na = 0;
+	size_t nb = 0;
+
+	btree_settle(a->data);
+	btree_settle(b->data);
+	btree_collect_leaves(((btree *) a->data)->root, &la, &na);
+	btree_collect_leaves(((btree *) b->data)->root, &lb, &nb);
+	cow_rrlist_diff_seq(la, na, lb, nb, cb, cb_data);
+	free(la);
+	free(lb);
+}
+
+void
+scheme_btree_free(scheme *s)
+{
+	btree *t = s->data;
+	assert(t);
+	btree_free_sub(t->root);
+	free(t);
+	free(s);
+}
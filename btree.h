@@ -0,0 +1,9 @@
+scheme_new scheme_btree_new;
+scheme_get_leaf_rr_list scheme_btree_get_leaf_rr_list;
+scheme_get_leaf_ro scheme_btree_get_leaf_ro;
+scheme_calc_digest scheme_btree_calc_digest;
+scheme_iterate scheme_btree_iterate;
+scheme_span scheme_btree_span;
+scheme_snapshot scheme_btree_snapshot;
+scheme_diff scheme_btree_diff;
+scheme_free scheme_btree_free;
@@ -0,0 +1,604 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <err.h>
+#include <pthread.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "canon.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CANON_X86 1
+#include <immintrin.h>
+#endif
+
+#define CANON_SORT_MIN_PER_THREAD 16384
+
+/*
+ * Canonical name handling (RFC 4034 section 6).
+ *
+ * Owner names are turned into keys that compare correctly with plain
+ * byte comparison:  labels in reverse order, each lowercased and
+ * followed by a zero octet.  The lowercasing and the search for the
+ * first differing byte have SSE2 and AVX2 versions, selected at run
+ * time, with a scalar fallback.
+ *
+ * A label that itself contains a zero octet cannot be represented
+ * this way; such names fall back to ldns_dname_compare().
+ */
+
+typedef void (canon_lower_fn)(uint8_t *, const uint8_t *, size_t);
+typedef size_t (canon_mismatch_fn)(const uint8_t *, const uint8_t *, size_t);
+
+static size_t canon_sort_min_per_thread;
+static canon_lower_fn *canon_lower_impl = 0;
+static canon_mismatch_fn *canon_mismatch_impl = 0;
+static pthread_once_t canon_once = PTHREAD_ONCE_INIT;
+
+static void
+canon_lower_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? src[i] | 0x20 : src[i];
+}
+
+static size_t
+canon_mismatch_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
+
+#if CANON_X86
+__attribute__((target("sse2")))
+static void
+canon_lower_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+	const __m128i before_a = _mm_set1_epi8('A' - 1);
+	const __m128i after_z = _mm_set1_epi8('Z' + 1);
+	const __m128i bit = _mm_set1_epi8(0x20);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmplt_epi8(v, after_z));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(v, _mm_and_si128(upper, bit)));
+	}
+	canon_lower_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void
+canon_lower_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+	const __m256i before_a = _mm256_set1_epi8('A' - 1);
+	const __m256i after_z = _mm256_set1_epi8('Z' + 1);
+	const __m256i bit = _mm256_set1_epi8(0x20);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a), _mm256_cmpgt_epi8(after_z, v));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(v, _mm256_and_si256(upper, bit)));
+	}
+	canon_lower_sse2(dst + i, src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t
+canon_mismatch_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		unsigned int mask = ~(unsigned int) _mm_movemask_epi8(eq) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + canon_mismatch_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+canon_mismatch_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i)));
+		unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(eq);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + canon_mismatch_sse2(a + i, b + i, len - i);
+}
+#endif
+
+static void
+canon_init(void)
+{
+	const char *min = getenv("ZONEMD_SORT_MIN_PER_THREAD");
+	canon_sort_min_per_thread = CANON_SORT_MIN_PER_THREAD;
+	if (min && strtoul(min, 0, 10) > 0)
+		canon_sort_min_per_thread = strtoul(min, 0, 10);
+	canon_lower_impl = canon_lower_scalar;
+	canon_mismatch_impl = canon_mismatch_scalar;
+#if CANON_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		canon_lower_impl = canon_lower_avx2;
+		canon_mismatch_impl = canon_mismatch_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		canon_lower_impl = canon_lower_sse2;
+		canon_mismatch_impl = canon_mismatch_sse2;
+	}
+#endif
+}
+
+/*
+ * canon_lower()
+ *
+ * ASCII lowercase 'len' bytes from 'src' to 'dst'.  The two may be the same.
+ */
+void
+canon_lower(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	pthread_once(&canon_once, canon_init);
+	canon_lower_impl(dst, src, len);
+}
+
+/*
+ * canon_key_compare()
+ *
+ * Compare two byte strings, memcmp() style, with the shorter sorting
+ * first when one is a prefix of the other.
+ */
+int
+canon_key_compare(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+	size_t n = alen < blen ? alen : blen;
+	size_t i;
+	pthread_once(&canon_once, canon_init);
+	i = canon_mismatch_impl(a, b, n);
+	if (i < n)
+		return a[i] < b[i] ? -1 : 1;
+	if (alen != blen)
+		return alen < blen ? -1 : 1;
+	return 0;
+}
+
+/*
+ * canon_dname_key()
+ *
+ * Build the comparison key for a wire format name into 'key', which must
+ * have room for ldns_rdf_size(dname) bytes.  Returns false if the name has
+ * a label containing a zero octet, in which case the key is not usable.
+ */
+bool
+canon_dname_key(const ldns_rdf *dname, uint8_t *key, size_t *ret_len)
+{
+	const uint8_t *data = ldns_rdf_data(dname);
+	size_t size = ldns_rdf_size(dname);
+	size_t label[LDNS_MAX_DOMAINLEN];
+	unsigned int nlabels = 0;
+	size_t pos = 0;
+	size_t len = 0;
+	while (pos < size && data[pos] != 0) {
+		label[nlabels++] = pos;
+		pos += data[pos] + 1;
+	}
+	if (pos >= size)
+		return false;
+	while (nlabels--) {
+		const uint8_t *l = &data[label[nlabels]];
+		if (memchr(l + 1, 0, l[0]))
+			return false;
+		canon_lower(key + len, l + 1, l[0]);
+		len += l[0];
+		key[len++] = 0;
+	}
+	*ret_len = len;
+	return true;
+}
+
+/*
+ * canon_dname_equal()
+ *
+ * Case-insensitive name equality; the same as ldns_dname_compare() == 0.
+ */
+bool
+canon_dname_equal(const ldns_rdf *a, const ldns_rdf *b)
+{
+	uint8_t abuf[LDNS_MAX_DOMAINLEN + 1];
+	uint8_t bbuf[LDNS_MAX_DOMAINLEN + 1];
+	size_t size = ldns_rdf_size(a);
+	if (a == b)
+		return true;
+	if (size != ldns_rdf_size(b))
+		return false;
+	if (size > sizeof(abuf))
+		return ldns_dname_compare(a, b) == 0;
+	canon_lower(abuf, ldns_rdf_data(a), size);
+	canon_lower(bbuf, ldns_rdf_data(b), size);
+	return canon_mismatch_impl(abuf, bbuf, size) == size;
+}
+
+typedef struct {
+	ldns_rr *rr;
+	const uint8_t *key;
+	size_t keylen;
+	bool key_ok;
+	uint8_t *rdata;
+	size_t rdlen;
+} canon_sortable;
+
+static int
+canon_compare_no_rdata(const void *pa, const void *pb)
+{
+	const canon_sortable *a = pa;
+	const canon_sortable *b = pb;
+	int c;
+	if (a->key_ok && b->key_ok)
+		c = canon_key_compare(a->key, a->keylen, b->key, b->keylen);
+	else
+		c = ldns_dname_compare(ldns_rr_owner(a->rr), ldns_rr_owner(b->rr));
+	if (c)
+		return c;
+	if (ldns_rr_get_class(a->rr) != ldns_rr_get_class(b->rr))
+		return (int) ldns_rr_get_class(a->rr) - (int) ldns_rr_get_class(b->rr);
+	if (ldns_rr_get_type(a->rr) != ldns_rr_get_type(b->rr))
+		return (int) ldns_rr_get_type(a->rr) - (int) ldns_rr_get_type(b->rr);
+	return 0;
+}
+
+static int
+canon_compare_rdata(const void *pa, const void *pb)
+{
+	const canon_sortable *a = pa;
+	const canon_sortable *b = pb;
+	return canon_key_compare(a->rdata, a->rdlen, b->rdata, b->rdlen);
+}
+
+/*
+ * canon_sort_keys()
+ *
+ * Fill in 's' for RRs [first, last) of 'rrlist', with the owner keys in
+ * a new arena that is returned.
+ */
+static uint8_t *
+canon_sort_keys(const ldns_rr_list *rrlist, canon_sortable *s, size_t first, size_t last)
+{
+	size_t arena_sz = 0;
+	size_t i;
+	uint8_t *arena;
+	for (i = first; i < last; i++)
+		arena_sz += ldns_rdf_size(ldns_rr_owner(ldns_rr_list_rr(rrlist, i)));
+	arena = malloc(arena_sz + 1);
+	assert(arena);
+	arena_sz = 0;
+	for (i = first; i < last; i++) {
+		s[i].rr = ldns_rr_list_rr(rrlist, i);
+		s[i].key = arena + arena_sz;
+		s[i].key_ok = canon_dname_key(ldns_rr_owner(s[i].rr), arena + arena_sz, &s[i].keylen);
+		if (s[i].key_ok)
+			arena_sz += s[i].keylen;
+	}
+	return arena;
+}
+
+/*
+ * canon_rdata_append()
+ *
+ * Append the canonical wire form of 'rr' to 'scratch' and return the
+ * offset of its RDATA there.  The RDATA runs to the buffer position.
+ */
+static size_t
+canon_rdata_append(ldns_buffer *scratch, const ldns_rr *rr)
+{
+	size_t offset = ldns_buffer_position(scratch) + ldns_rdf_size(ldns_rr_owner(rr)) + 10;
+	if (ldns_rr2buffer_wire_canonical(scratch, rr, LDNS_SECTION_ANY) != LDNS_STATUS_OK)
+		errx(1, "%s(%d): ldns_rr2buffer_wire_canonical() failed", __FILE__, __LINE__);
+	assert(ldns_buffer_position(scratch) >= offset);
+	return offset;
+}
+
+/*
+ * canon_sort_rdata()
+ *
+ * Render the canonical RDATA of an entry into a malloc'd buffer.
+ */
+static void
+canon_sort_rdata(ldns_buffer *scratch, canon_sortable *s)
+{
+	size_t offset;
+	ldns_buffer_clear(scratch);
+	offset = canon_rdata_append(scratch, s->rr);
+	s->rdlen = ldns_buffer_position(scratch) - offset;
+	s->rdata = malloc(s->rdlen + 1);
+	assert(s->rdata);
+	memcpy(s->rdata, ldns_buffer_at(scratch, offset), s->rdlen);
+}
+
+/*
+ * canon_sort_run()
+ *
+ * Sort 'n' entries by owner key, class and type.  Canonical RDATA is
+ * then rendered only for RRsets with more than one member, and each
+ * such RRset is sorted by it.
+ */
+static void
+canon_sort_run(canon_sortable *s, size_t n)
+{
+	ldns_buffer *scratch = 0;
+	size_t i;
+	size_t j;
+
+	qsort(s, n, sizeof(*s), canon_compare_no_rdata);
+	for (i = 0; i < n; i = j) {
+		size_t k;
+		for (j = i + 1; j < n; j++)
+			if (canon_compare_no_rdata(&s[i], &s[j]) != 0)
+				break;
+		if (j - i < 2)
+			continue;
+		if (scratch == 0) {
+			scratch = ldns_buffer_new(LDNS_MAX_PACKETLEN);
+			assert(scratch);
+		}
+		for (k = i; k < j; k++)
+			canon_sort_rdata(scratch, &s[k]);
+		qsort(&s[i], j - i, sizeof(*s), canon_compare_rdata);
+		for (k = i; k < j; k++)
+			free(s[k].rdata);
+	}
+	if (scratch)
+		ldns_buffer_free(scratch);
+}
+
+/*
+ * canon_rr_compare()
+ *
+ * Compare two RRs, memcmp() style, in the order that
+ * canon_rr_list_sort() puts them in.  'scratch' is a buffer of the
+ * caller's that is only used, and then cleared, when owner name, class
+ * and type are the same, so that a caller comparing many RRs does not
+ * allocate for each of them.
+ */
+int
+canon_rr_compare(const ldns_rr *a, const ldns_rr *b, ldns_buffer *scratch)
+{
+	uint8_t akey[LDNS_MAX_DOMAINLEN + 1];
+	uint8_t bkey[LDNS_MAX_DOMAINLEN + 1];
+	canon_sortable x;
+	canon_sortable y;
+	size_t aoff;
+	size_t boff;
+	size_t alen;
+	int c;
+	memset(&x, 0, sizeof(x));
+	memset(&y, 0, sizeof(y));
+	x.rr = (ldns_rr *) a;
+	y.rr = (ldns_rr *) b;
+	x.key = akey;
+	y.key = bkey;
+	x.key_ok = ldns_rdf_size(ldns_rr_owner(a)) <= sizeof(akey) && canon_dname_key(ldns_rr_owner(a), akey, &x.keylen);
+	y.key_ok = ldns_rdf_size(ldns_rr_owner(b)) <= sizeof(bkey) && canon_dname_key(ldns_rr_owner(b), bkey, &y.keylen);
+	c = canon_compare_no_rdata(&x, &y);
+	if (c)
+		return c;
+	ldns_buffer_clear(scratch);
+	aoff = canon_rdata_append(scratch, a);
+	alen = ldns_buffer_position(scratch) - aoff;
+	boff = canon_rdata_append(scratch, b);
+	c = canon_key_compare(ldns_buffer_at(scratch, aoff), alen, ldns_buffer_at(scratch, boff), ldns_buffer_position(scratch) - boff);
+	ldns_buffer_clear(scratch);
+	return c;
+}
+
+/*
+ * Sample sort, for lists of at least 2 * CANON_SORT_MIN_PER_THREAD RRs
+ * (ZONEMD_SORT_MIN_PER_THREAD in the environment overrides the latter,
+ * so that the tests can use small zones).
+ *
+ * Every thread builds the keys of its share of the input and counts how
+ * many of its RRs fall into each bucket, between splitters drawn from a
+ * sorted sample.  The RRs are then scattered into their buckets, and each
+ * thread sorts one bucket completely, RDATA included:  RRs that compare
+ * equal without RDATA always land in the same bucket, so no RRset is
+ * split.  The canonical order is a total order (duplicates are removed
+ * when RRs are added), so the result is the same as the serial sort's.
+ */
+#define CANON_SORT_MAX_THREADS 64
+#define CANON_SORT_OVERSAMPLE 64
+
+unsigned int canon_sort_threads = 0;
+
+typedef struct _canon_sort_job {
+	unsigned int phase;
+	ldns_rr_list *rrlist;
+	canon_sortable *in;
+	canon_sortable *out;
+	uint16_t *bucket;		/* of each input entry */
+	const canon_sortable *splitters;
+	unsigned int nthreads;
+	size_t first;			/* input range */
+	size_t last;
+	size_t counts[CANON_SORT_MAX_THREADS];	/* then scatter offsets */
+	size_t out_first;		/* this thread's bucket */
+	size_t out_last;
+	uint8_t *arena;
+	pthread_t thread;
+} canon_sort_job;
+
+static unsigned int
+canon_sort_bucket(const canon_sortable *splitters, unsigned int nsplitters, const canon_sortable *x)
+{
+	unsigned int lo = 0;
+	unsigned int hi = nsplitters;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (canon_compare_no_rdata(&splitters[mid], x) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void *
+canon_sort_worker(void *arg)
+{
+	canon_sort_job *job = arg;
+	size_t i;
+	switch (job->phase) {
+	case 0:
+		job->arena = canon_sort_keys(job->rrlist, job->in, job->first, job->last);
+		break;
+	case 1:
+		for (i = job->first; i < job->last; i++) {
+			job->bucket[i] = canon_sort_bucket(job->splitters, job->nthreads - 1, &job->in[i]);
+			job->counts[job->bucket[i]]++;
+		}
+		break;
+	case 2:
+		for (i = job->first; i < job->last; i++)
+			job->out[job->counts[job->bucket[i]]++] = job->in[i];
+		break;
+	case 3:
+		canon_sort_run(job->out + job->out_first, job->out_last - job->out_first);
+		for (i = job->out_first; i < job->out_last; i++)
+			ldns_rr_list_set_rr(job->rrlist, job->out[i].rr, i);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * canon_sort_phase()
+ *
+ * Run one phase of the sample sort on all jobs, the first on this thread.
+ */
+static void
+canon_sort_phase(canon_sort_job *jobs, unsigned int nthreads, unsigned int phase)
+{
+	unsigned int t;
+	for (t = 0; t < nthreads; t++)
+		jobs[t].phase = phase;
+	for (t = 1; t < nthreads; t++)
+		if (pthread_create(&jobs[t].thread, 0, canon_sort_worker, &jobs[t]) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	canon_sort_worker(&jobs[0]);
+	for (t = 1; t < nthreads; t++)
+		pthread_join(jobs[t].thread, 0);
+}
+
+static void
+canon_rr_list_sort_parallel(ldns_rr_list *rrlist, unsigned int nthreads)
+{
+	size_t n = ldns_rr_list_rr_count(rrlist);
+	size_t nsamples = (size_t) nthreads * CANON_SORT_OVERSAMPLE;
+	canon_sortable *in;
+	canon_sortable *out;
+	canon_sortable *samples;
+	canon_sortable *splitters;
+	canon_sort_job *jobs;
+	uint16_t *bucket;
+	size_t offset = 0;
+	size_t k;
+	unsigned int b;
+	unsigned int t;
+
+	in = calloc(n, sizeof(*in));
+	out = calloc(n, sizeof(*out));
+	samples = calloc(nsamples, sizeof(*samples));
+	splitters = calloc(nthreads, sizeof(*splitters));
+	jobs = calloc(nthreads, sizeof(*jobs));
+	bucket = calloc(n, sizeof(*bucket));
+	assert(in);
+	assert(out);
+	assert(samples);
+	assert(splitters);
+	assert(jobs);
+	assert(bucket);
+	for (t = 0; t < nthreads; t++) {
+		jobs[t].rrlist = rrlist;
+		jobs[t].in = in;
+		jobs[t].out = out;
+		jobs[t].bucket = bucket;
+		jobs[t].splitters = splitters;
+		jobs[t].nthreads = nthreads;
+		jobs[t].first = n * t / nthreads;
+		jobs[t].last = n * (t + 1) / nthreads;
+	}
+	canon_sort_phase(jobs, nthreads, 0);
+
+	for (k = 0; k < nsamples; k++)
+		samples[k] = in[k * n / nsamples];
+	qsort(samples, nsamples, sizeof(*samples), canon_compare_no_rdata);
+	for (b = 0; b + 1 < nthreads; b++)
+		splitters[b] = samples[(b + 1) * CANON_SORT_OVERSAMPLE];
+	canon_sort_phase(jobs, nthreads, 1);
+
+	for (b = 0; b < nthreads; b++) {
+		jobs[b].out_first = offset;
+		for (t = 0; t < nthreads; t++) {
+			size_t c = jobs[t].counts[b];
+			jobs[t].counts[b] = offset;
+			offset += c;
+		}
+		jobs[b].out_last = offset;
+	}
+	assert(offset == n);
+	canon_sort_phase(jobs, nthreads, 2);
+	canon_sort_phase(jobs, nthreads, 3);
+
+	for (t = 0; t < nthreads; t++)
+		free(jobs[t].arena);
+	free(bucket);
+	free(jobs);
+	free(splitters);
+	free(samples);
+	free(out);
+	free(in);
+}
+
+/*
+ * canon_rr_list_sort()
+ *
+ * Sort an RR list into the same order as ldns_rr_list_sort().  RRs are
+ * first sorted by precomputed owner keys, class and type, then by RDATA
+ * within RRsets (see canon_sort_run()).  Large lists are sorted with
+ * up to canon_sort_threads threads (0 means one per online CPU).
+ */
+void
+canon_rr_list_sort(ldns_rr_list *rrlist)
+{
+	size_t n = ldns_rr_list_rr_count(rrlist);
+	unsigned int nthreads = canon_sort_threads;
+	size_t i;
+	uint8_t *arena;
+	canon_sortable *s;
+
+	if (n < 2)
+		return;
+	pthread_once(&canon_once, canon_init);
+	if (nthreads == 0)
+		nthreads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > n / canon_sort_min_per_thread)
+		nthreads = n / canon_sort_min_per_thread;
+	if (nthreads > CANON_SORT_MAX_THREADS)
+		nthreads = CANON_SORT_MAX_THREADS;
+	if (nthreads >= 2) {
+		canon_rr_list_sort_parallel(rrlist, nthreads);
+		return;
+	}
+	s = calloc(n, sizeof(*s));
+	assert(s);
+	arena = canon_sort_keys(rrlist, s, 0, n);
+	canon_sort_run(s, n);
+	for (i = 0; i < n; i++)
+		ldns_rr_list_set_rr(rrlist, s[i].rr, i);
+	free(arena);
+	free(s);
+}
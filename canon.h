@@ -0,0 +1,7 @@
+void canon_lower(uint8_t *dst, const uint8_t *src, size_t len);
+int canon_key_compare(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen);
+bool canon_dname_key(const ldns_rdf *dname, uint8_t *key, size_t *ret_len);
+bool canon_dname_equal(const ldns_rdf *a, const ldns_rdf *b);
+void canon_rr_list_sort(ldns_rr_list *rrlist);
+int canon_rr_compare(const ldns_rr *, const ldns_rr *, ldns_buffer *scratch);
+extern unsigned int canon_sort_threads;
@@ -0,0 +1,347 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <err.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "canon.h"
+#include "cow.h"
+#include "meta.h"
+
+/*
+ * Copy-on-write RR lists, used for the leaves of the schemes (and the
+ * segments of scheme 1) so that a snapshot of the zone shares its leaves
+ * with the live version.
+ *
+ * A list with more than one reference is frozen:  it is sorted before
+ * it is shared and never modified afterwards.  A version that wants to
+ * modify it gets its own deep copy of that one list first; the leaves
+ * it does not touch stay shared.  Only the reference count and the
+ * cached wire form are touched by more than one thread, and only
+ * atomically.
+ *
+ * Each list also remembers the canonical wire form that is fed to the
+ * digest, once it has been produced, so that a second digest pass (more
+ * ZONEMD records, -v after -c, an update that leaves this list alone)
+ * only streams memory into the hash.  Handing the list out for writing
+ * drops it, so an update re-serializes only the leaves it touched;
+ * cow_wire_stats() counts how often the cached form was used.  The
+ * metadata columns (see meta.c) that the wire form is built from are
+ * kept, and dropped, the same way, for the apex lookups in between.
+ */
+
+static unsigned long cow_wire_built = 0;
+static unsigned long cow_wire_reused = 0;
+
+static void
+cow_wire_free(cow_wire *w)
+{
+	if (w == 0)
+		return;
+	free(w->data);
+	free(w);
+}
+
+cow_rrlist *
+cow_rrlist_new(void)
+{
+	cow_rrlist *c = calloc(1, sizeof(*c));
+	assert(c);
+	c->rrlist = ldns_rr_list_new();
+	assert(c->rrlist);
+	c->refs = 1;
+	return c;
+}
+
+/*
+ * cow_rrlist_share()
+ *
+ * Take another reference for a new version.  Must be called by the
+ * thread that owns the version being copied.
+ */
+cow_rrlist *
+cow_rrlist_share(cow_rrlist *c)
+{
+	cow_rrlist_read(c);
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+	return c;
+}
+
+/*
+ * cow_rrlist_write()
+ *
+ * Return the list for modification, copying it first if it is shared.
+ */
+ldns_rr_list *
+cow_rrlist_write(cow_rrlist **cp)
+{
+	cow_rrlist *c = *cp;
+	if (__atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 1) {
+		cow_rrlist *copy = calloc(1, sizeof(*copy));
+		assert(copy);
+		copy->rrlist = ldns_rr_list_clone(c->rrlist);
+		assert(copy->rrlist);
+		copy->refs = 1;
+		copy->sorted = c->sorted;
+		cow_rrlist_release(c);
+		*cp = c = copy;
+	}
+	c->sorted = false;
+	cow_wire_free(c->wire);
+	c->wire = 0;
+	if (c->meta)
+		rr_meta_free(c->meta);
+	c->meta = 0;
+	return c->rrlist;
+}
+
+/*
+ * cow_rrlist_read()
+ *
+ * Return the list in canonical order.
+ */
+ldns_rr_list *
+cow_rrlist_read(cow_rrlist *c)
+{
+	if (!c->sorted) {
+		canon_rr_list_sort(c->rrlist);
+		c->sorted = true;
+	}
+	return c->rrlist;
+}
+
+void
+cow_rrlist_release(cow_rrlist *c)
+{
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	ldns_rr_list_deep_free(c->rrlist);
+	cow_wire_free(c->wire);
+	if (c->meta)
+		rr_meta_free(c->meta);
+	free(c);
+}
+
+/*
+ * cow_rrlist_wire()
+ *
+ * Return the canonical wire form of the list, as digested, producing
+ * it on first use.  Shared lists may be read by several threads at
+ * once; if two of them race, one copy wins and the other is freed.
+ */
+const uint8_t *
+cow_rrlist_wire(cow_rrlist *c, size_t *ret_len)
+{
+	cow_wire *w = __atomic_load_n(&c->wire, __ATOMIC_ACQUIRE);
+	if (w == 0) {
+		cow_wire *expected = 0;
+		w = malloc(sizeof(*w));
+		assert(w);
+		w->data = zonemd_rrlist_wire(cow_rrlist_read(c), cow_rrlist_meta(c), &w->len);
+		if (!__atomic_compare_exchange_n(&c->wire, &expected, w, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			cow_wire_free(w);
+			w = expected;
+		} else {
+			__atomic_add_fetch(&cow_wire_built, 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_add_fetch(&cow_wire_reused, 1, __ATOMIC_RELAXED);
+	}
+	*ret_len = w->len;
+	return w->data;
+}
+
+/*
+ * cow_rrlist_meta()
+ *
+ * Return the metadata columns of the list in canonical order, as
+ * cow_rrlist_wire() does the wire form.
+ */
+const rr_meta *
+cow_rrlist_meta(cow_rrlist *c)
+{
+	rr_meta *m = __atomic_load_n(&c->meta, __ATOMIC_ACQUIRE);
+	if (m == 0) {
+		rr_meta *expected = 0;
+		m = zonemd_rrlist_meta(cow_rrlist_read(c));
+		if (!__atomic_compare_exchange_n(&c->meta, &expected, m, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			rr_meta_free(m);
+			m = expected;
+		}
+	}
+	return m;
+}
+
+/*
+ * cow_wire_stats()
+ *
+ * The number of wire forms cow_rrlist_wire() has produced, and the
+ * number of times it returned one that was already cached.
+ */
+void
+cow_wire_stats(unsigned long *built, unsigned long *reused)
+{
+	*built = __atomic_load_n(&cow_wire_built, __ATOMIC_RELAXED);
+	*reused = __atomic_load_n(&cow_wire_reused, __ATOMIC_RELAXED);
+}
+
+/*
+ * cow_rrlist_spans()
+ *
+ * Hand the RRs of the list, in canonical order, to 'cb' as arrays of
+ * 'window' RRs (the last one may be shorter).  'window' must not exceed
+ * SCHEME_SPAN_MAX; 0 means as many as fit, so that a leaf of a tree
+ * scheme normally comes in one span.
+ */
+void
+cow_rrlist_spans(cow_rrlist *c, size_t window, scheme_span_cb cb, const void *cb_data)
+{
+	const ldns_rr *span[SCHEME_SPAN_MAX];
+	const ldns_rr_list *rrlist = cow_rrlist_read(c);
+	size_t count = ldns_rr_list_rr_count(rrlist);
+	size_t i;
+	size_t n = 0;
+	if (window == 0 || window > SCHEME_SPAN_MAX)
+		window = SCHEME_SPAN_MAX;
+	for (i = 0; i < count; i++) {
+		span[n++] = ldns_rr_list_rr(rrlist, i);
+		if (n == window) {
+			cb(span, n, cb_data);
+			n = 0;
+		}
+	}
+	if (n)
+		cb(span, n, cb_data);
+}
+
+/*
+ * cow_rr_list_diff()
+ *
+ * Report the RRs that are in 'a' but not in 'b' as removed, and those
+ * in 'b' but not in 'a' as added.  Both lists must be in canonical
+ * order.  An RR whose TTL changed is reported as removed and added.
+ */
+void
+cow_rr_list_diff(const ldns_rr_list *a, const ldns_rr_list *b, scheme_diff_cb cb, const void *cb_data)
+{
+	size_t an = a ? ldns_rr_list_rr_count(a) : 0;
+	size_t bn = b ? ldns_rr_list_rr_count(b) : 0;
+	size_t i = 0;
+	size_t j = 0;
+	while (i < an || j < bn) {
+		ldns_rr *ra = i < an ? ldns_rr_list_rr(a, i) : 0;
+		ldns_rr *rb = j < bn ? ldns_rr_list_rr(b, j) : 0;
+		int c = ra == 0 ? 1 : rb == 0 ? -1 : ldns_rr_compare(ra, rb);
+		if (c == 0 && ldns_rr_ttl(ra) == ldns_rr_ttl(rb)) {
+			i++;
+			j++;
+			continue;
+		}
+		if (c <= 0) {
+			cb(ra, false, cb_data);
+			i++;
+		}
+		if (c >= 0) {
+			cb(rb, true, cb_data);
+			j++;
+		}
+	}
+}
+
+/*
+ * cow_rrlist_diff()
+ *
+ * As cow_rr_list_diff(), for two leaves (either may be NULL).  A list
+ * shared by both versions is skipped without looking at it.  Both must
+ * be frozen or private to the caller.
+ */
+void
+cow_rrlist_diff(cow_rrlist *a, cow_rrlist *b, scheme_diff_cb cb, const void *cb_data)
+{
+	if (a == b)
+		return;
+	cow_rr_list_diff(a ? cow_rrlist_read(a) : 0, b ? cow_rrlist_read(b) : 0, cb, cb_data);
+}
+
+typedef struct {
+	const cow_rrlist *leaf;
+	size_t pos;
+} cow_leaf_pos;
+
+static int
+cow_leaf_pos_compare(const void *pa, const void *pb)
+{
+	const cow_leaf_pos *a = pa;
+	const cow_leaf_pos *b = pb;
+	if (a->leaf == b->leaf)
+		return 0;
+	return (uintptr_t) a->leaf < (uintptr_t) b->leaf ? -1 : 1;
+}
+
+static void
+cow_push_leaves(ldns_rr_list *dst, cow_rrlist **leaves, size_t from, size_t to)
+{
+	size_t i;
+	size_t j;
+	for (i = from; i < to; i++) {
+		const ldns_rr_list *rrlist = cow_rrlist_read(leaves[i]);
+		for (j = 0; j < ldns_rr_list_rr_count(rrlist); j++)
+			ldns_rr_list_push_rr(dst, ldns_rr_list_rr(rrlist, j));
+	}
+}
+
+/*
+ * cow_rrlist_diff_seq()
+ *
+ * As cow_rr_list_diff(), for two versions of a zone held as sequences
+ * of leaves in canonical order.  The sequences need not be cut in the
+ * same places, so walk them in order and compare only the stretches
+ * between leaves they share.
+ */
+void
+cow_rrlist_diff_seq(cow_rrlist **la, size_t na, cow_rrlist **lb, size_t nb, scheme_diff_cb cb, const void *cb_data)
+{
+	size_t i = 0;
+	size_t j = 0;
+	cow_leaf_pos *index;
+
+	index = calloc(nb + 1, sizeof(*index));
+	assert(index);
+	for (j = 0; j < nb; j++) {
+		index[j].leaf = lb[j];
+		index[j].pos = j;
+	}
+	qsort(index, nb, sizeof(*index), cow_leaf_pos_compare);
+	j = 0;
+	while (i < na || j < nb) {
+		size_t i2 = i;
+		size_t j2 = nb;
+		ldns_rr_list *ra;
+		ldns_rr_list *rb;
+		if (i < na && j < nb && la[i] == lb[j]) {
+			i++;
+			j++;
+			continue;
+		}
+		for (; i2 < na; i2++) {
+			cow_leaf_pos key = { la[i2], 0 };
+			cow_leaf_pos *found = bsearch(&key, index, nb, sizeof(*index), cow_leaf_pos_compare);
+			if (found && found->pos >= j) {
+				j2 = found->pos;
+				break;
+			}
+		}
+		ra = ldns_rr_list_new();
+		rb = ldns_rr_list_new();
+		assert(ra);
+		assert(rb);
+		cow_push_leaves(ra, la, i, i2);
+		cow_push_leaves(rb, lb, j, j2);
+		cow_rr_list_diff(ra, rb, cb, cb_data);
+		ldns_rr_list_free(ra);
+		ldns_rr_list_free(rb);
+		i = i2;
+		j = j2;
+	}
+	free(index);
+}
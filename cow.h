@@ -0,0 +1,25 @@
+typedef struct {
+	size_t len;
+	uint8_t *data;
+} cow_wire;
+
+typedef struct _cow_rrlist {
+	ldns_rr_list *rrlist;
+	unsigned int refs;
+	bool sorted;
+	cow_wire *wire;			/* digest input, NULL until needed */
+	struct _rr_meta *meta;		/* columns of the sorted list, NULL until needed */
+} cow_rrlist;
+
+cow_rrlist *cow_rrlist_new(void);
+cow_rrlist *cow_rrlist_share(cow_rrlist *);
+ldns_rr_list *cow_rrlist_write(cow_rrlist **);
+ldns_rr_list *cow_rrlist_read(cow_rrlist *);
+const uint8_t *cow_rrlist_wire(cow_rrlist *, size_t *ret_len);
+const struct _rr_meta *cow_rrlist_meta(cow_rrlist *);
+void cow_wire_stats(unsigned long *built, unsigned long *reused);
+void cow_rrlist_release(cow_rrlist *);
+void cow_rrlist_spans(cow_rrlist *, size_t window, scheme_span_cb, const void *cb_data);
+void cow_rrlist_diff(cow_rrlist *a, cow_rrlist *b, scheme_diff_cb, const void *cb_data);
+void cow_rr_list_diff(const ldns_rr_list *a, const ldns_rr_list *b, scheme_diff_cb, const void *cb_data);
+void cow_rrlist_diff_seq(cow_rrlist **a, size_t na, cow_rrlist **b, size_t nb, scheme_diff_cb, const void *cb_data);
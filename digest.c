@@ -0,0 +1,345 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#include "sha512.h"
+#include "digest.h"
+
+/*
+ * Digest backends.
+ *
+ * "evp" runs every algorithm through OpenSSL's EVP interface, which
+ * costs a heap-allocated context and a provider lookup per message.
+ * "direct" runs SHA-384 and SHA-512 with the context on the stack (see
+ * sha512.c), which matters for the many small messages of the tree
+ * schemes.  Unless one is chosen with digest_use_backend(), each
+ * algorithm goes to the first backend in the list that handles it.
+ */
+
+/*
+ * EVP handles any algorithm that OpenSSL handed out.
+ */
+static bool
+digest_evp_handles(const EVP_MD *md)
+{
+	return md != 0;
+}
+
+static void
+digest_evp_init(digest_ctx *ctx, const EVP_MD *md)
+{
+	ctx->u.evp = EVP_MD_CTX_create();
+	assert(ctx->u.evp);
+	if (!EVP_DigestInit(ctx->u.evp, md))
+		errx(1, "%s(%d): Digest init failed", __FILE__, __LINE__);
+}
+
+static void
+digest_evp_update(digest_ctx *ctx, const void *data, size_t len)
+{
+	if (!EVP_DigestUpdate(ctx->u.evp, data, len))
+		errx(1, "%s(%d): Digest update failed", __FILE__, __LINE__);
+}
+
+static void
+digest_evp_final(digest_ctx *ctx, unsigned char *out)
+{
+	if (!EVP_DigestFinal_ex(ctx->u.evp, out, 0))
+		errx(1, "%s(%d): Digest final failed", __FILE__, __LINE__);
+	EVP_MD_CTX_destroy(ctx->u.evp);
+	ctx->u.evp = 0;
+}
+
+static bool
+digest_direct_handles(const EVP_MD *md)
+{
+	return EVP_MD_type(md) == NID_sha384 || EVP_MD_type(md) == NID_sha512;
+}
+
+static void
+digest_direct_init(digest_ctx *ctx, const EVP_MD *md)
+{
+	sha512_init(&ctx->u.sha512, EVP_MD_type(md) == NID_sha384 ? SHA384_DIGEST_LEN : SHA512_DIGEST_LEN);
+}
+
+static void
+digest_direct_update(digest_ctx *ctx, const void *data, size_t len)
+{
+	sha512_update(&ctx->u.sha512, data, len);
+}
+
+static void
+digest_direct_final(digest_ctx *ctx, unsigned char *out)
+{
+	sha512_final(&ctx->u.sha512, out);
+}
+
+static const digest_backend digest_direct = {
+	"direct",
+	digest_direct_handles,
+	digest_direct_init,
+	digest_direct_update,
+	digest_direct_final,
+};
+
+static const digest_backend digest_evp = {
+	"evp",
+	digest_evp_handles,
+	digest_evp_init,
+	digest_evp_update,
+	digest_evp_final,
+};
+
+static const digest_backend *digest_backends[] = {
+	&digest_direct,
+	&digest_evp,
+	0
+};
+
+static const digest_backend *digest_forced = 0;
+
+/*
+ * digest_use_backend()
+ *
+ * Run every algorithm the named backend handles through it, and the
+ * rest through EVP.  Must be called before any digest is started.
+ */
+void
+digest_use_backend(const char *name)
+{
+	unsigned int i;
+	for (i = 0; digest_backends[i]; i++) {
+		if (!strcmp(digest_backends[i]->name, name)) {
+			digest_forced = digest_backends[i];
+			return;
+		}
+	}
+	errx(1, "%s(%d): Unknown digest backend '%s'", __FILE__, __LINE__, name);
+}
+
+static const digest_backend *
+digest_backend_for(const EVP_MD *md)
+{
+	unsigned int i;
+	if (digest_forced)
+		return digest_forced->handles(md) ? digest_forced : &digest_evp;
+	for (i = 0; !digest_backends[i]->handles(md); i++)
+		(void) 0;
+	return digest_backends[i];
+}
+
+/*
+ * digest_kernel_for()
+ *
+ * Which specialized kernel, if any, may run 'md'.  Only algorithms that
+ * would go to the direct backend have one, so forcing "evp" also
+ * forces the generic path.
+ */
+digest_kernel
+digest_kernel_for(const EVP_MD *md)
+{
+	if (digest_backend_for(md) != &digest_direct)
+		return DIGEST_KERNEL_GENERIC;
+	return EVP_MD_type(md) == NID_sha384 ? DIGEST_KERNEL_SHA384 : DIGEST_KERNEL_SHA512;
+}
+
+void
+digest_init(digest_ctx *ctx, const EVP_MD *md)
+{
+	ctx->backend = digest_backend_for(md);
+	ctx->backend->init(ctx, md);
+}
+
+void
+digest_update(digest_ctx *ctx, const void *data, size_t len)
+{
+	ctx->backend->update(ctx, data, len);
+}
+
+void
+digest_final(digest_ctx *ctx, unsigned char *out)
+{
+	ctx->backend->final(ctx, out);
+}
+
+/* ============================================================================== */
+
+/*
+ * The tee backend feeds one byte stream to several algorithms at once,
+ * each on its own thread.  The writer fills fixed-size chunks and
+ * appends them to a list; every hasher walks the list at its own pace,
+ * and the last one to finish with a chunk frees it.  The writer stalls
+ * if more than DIGEST_TEE_MAX_CHUNKS are waiting.
+ */
+
+#define DIGEST_TEE_CHUNK (256 * 1024)
+#define DIGEST_TEE_MAX_CHUNKS 64
+
+typedef struct _digest_chunk {
+	struct _digest_chunk *next;
+	size_t len;
+	unsigned int refs;
+	unsigned char data[DIGEST_TEE_CHUNK];
+} digest_chunk;
+
+typedef struct {
+	struct _digest_tee *tee;
+	const EVP_MD *md;
+	unsigned char out[EVP_MAX_MD_SIZE];
+	pthread_t thread;
+} digest_hasher;
+
+typedef struct _digest_tee {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	digest_chunk *first;
+	digest_chunk *tail;
+	digest_chunk *fill;
+	unsigned int live;
+	bool finished;
+	unsigned int n;
+	digest_hasher *hashers;
+} digest_tee;
+
+static void *
+digest_hasher_run(void *arg)
+{
+	digest_hasher *h = arg;
+	digest_tee *t = h->tee;
+	digest_chunk *c = 0;
+	digest_chunk *next;
+	digest_ctx ctx;
+	digest_init(&ctx, h->md);
+	for (;;) {
+		pthread_mutex_lock(&t->lock);
+		while ((next = c ? c->next : t->first) == 0 && !t->finished)
+			pthread_cond_wait(&t->cond, &t->lock);
+		if (c && --c->refs == 0) {
+			free(c);
+			t->live--;
+			pthread_cond_broadcast(&t->cond);
+		}
+		pthread_mutex_unlock(&t->lock);
+		if (next == 0)
+			break;
+		digest_update(&ctx, next->data, next->len);
+		c = next;
+	}
+	digest_final(&ctx, h->out);
+	return 0;
+}
+
+static void
+digest_tee_publish(digest_tee *t)
+{
+	digest_chunk *c = t->fill;
+	t->fill = 0;
+	if (c == 0 || c->len == 0) {
+		free(c);
+		return;
+	}
+	c->refs = t->n;
+	pthread_mutex_lock(&t->lock);
+	while (t->live >= DIGEST_TEE_MAX_CHUNKS)
+		pthread_cond_wait(&t->cond, &t->lock);
+	if (t->tail)
+		t->tail->next = c;
+	else
+		t->first = c;
+	t->tail = c;
+	t->live++;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void
+digest_tee_update(digest_ctx *ctx, const void *data, size_t len)
+{
+	digest_tee *t = ctx->u.tee;
+	const unsigned char *p = data;
+	while (len) {
+		size_t n;
+		if (t->fill == 0) {
+			t->fill = malloc(sizeof(*t->fill));
+			assert(t->fill);
+			t->fill->next = 0;
+			t->fill->len = 0;
+		}
+		n = DIGEST_TEE_CHUNK - t->fill->len;
+		if (n > len)
+			n = len;
+		memcpy(t->fill->data + t->fill->len, p, n);
+		t->fill->len += n;
+		p += n;
+		len -= n;
+		if (t->fill->len == DIGEST_TEE_CHUNK)
+			digest_tee_publish(t);
+	}
+}
+
+static const digest_backend digest_tee_backend = {
+	"tee",
+	0,
+	0,
+	digest_tee_update,
+	0,
+};
+
+/*
+ * digest_tee_init()
+ *
+ * Start one hashing thread for each of the 'n' algorithms.  Data given
+ * to digest_update() is copied once and read by all of them.
+ */
+void
+digest_tee_init(digest_ctx *ctx, unsigned int n, const EVP_MD *const *mds)
+{
+	digest_tee *t = calloc(1, sizeof(*t));
+	unsigned int i;
+	assert(t);
+	pthread_mutex_init(&t->lock, 0);
+	pthread_cond_init(&t->cond, 0);
+	t->n = n;
+	t->hashers = calloc(n, sizeof(*t->hashers));
+	assert(t->hashers);
+	for (i = 0; i < n; i++) {
+		t->hashers[i].tee = t;
+		t->hashers[i].md = mds[i];
+		if (pthread_create(&t->hashers[i].thread, 0, digest_hasher_run, &t->hashers[i]) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	}
+	ctx->backend = &digest_tee_backend;
+	ctx->u.tee = t;
+}
+
+/*
+ * digest_tee_final()
+ *
+ * Wait for the hashing threads and store each digest in outs[i].
+ */
+void
+digest_tee_final(digest_ctx *ctx, unsigned char *const *outs)
+{
+	digest_tee *t = ctx->u.tee;
+	unsigned int i;
+	digest_tee_publish(t);
+	pthread_mutex_lock(&t->lock);
+	t->finished = true;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	for (i = 0; i < t->n; i++) {
+		pthread_join(t->hashers[i].thread, 0);
+		memcpy(outs[i], t->hashers[i].out, EVP_MD_size(t->hashers[i].md));
+	}
+	assert(t->live == 0);
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t->hashers);
+	free(t);
+	ctx->u.tee = 0;
+}
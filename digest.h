@@ -0,0 +1,42 @@
+typedef struct _digest_ctx digest_ctx;
+
+/*
+ * A digest backend computes some of the algorithms named by EVP_MD.
+ * The algorithm is still identified by its EVP_MD everywhere; only the
+ * code that runs it is pluggable.
+ */
+typedef struct {
+	const char *name;
+	bool (*handles)(const EVP_MD *);
+	void (*init)(digest_ctx *, const EVP_MD *);
+	void (*update)(digest_ctx *, const void *, size_t);
+	void (*final)(digest_ctx *, unsigned char *);
+} digest_backend;
+
+struct _digest_ctx {
+	const digest_backend *backend;
+	union {
+		EVP_MD_CTX *evp;
+		sha512_ctx sha512;
+		struct _digest_tee *tee;
+	} u;
+};
+
+/*
+ * Algorithms that scheme code has kernels for, specialized at compile
+ * time to call the hash directly with a constant digest length.
+ * DIGEST_KERNEL_GENERIC means going through digest_init() and friends.
+ */
+typedef enum {
+	DIGEST_KERNEL_GENERIC,
+	DIGEST_KERNEL_SHA384,
+	DIGEST_KERNEL_SHA512,
+} digest_kernel;
+
+void digest_use_backend(const char *name);
+digest_kernel digest_kernel_for(const EVP_MD *);
+void digest_init(digest_ctx *, const EVP_MD *);
+void digest_update(digest_ctx *, const void *, size_t);
+void digest_final(digest_ctx *, unsigned char *);
+void digest_tee_init(digest_ctx *, unsigned int n, const EVP_MD *const *mds);
+void digest_tee_final(digest_ctx *, unsigned char *const *outs);
@@ -0,0 +1,339 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include <err.h>
+#include <arpa/inet.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "zscan.h"
+#include "fastrr.h"
+
+/*
+ * Text to wire parsers for the RR types that make up nearly all of a
+ * TLD or root zone:  A, AAAA, NS, DS, RRSIG, NSEC and NSEC3.  These
+ * skip the descriptor-driven tokenizing of ldns_rr_new_frm_str() and
+ * build the rdata fields directly.  They produce the same rdf types
+ * as ldns does, so output and wire format are unchanged.
+ *
+ * Anything unusual (other types, escapes, quotes, a class before the
+ * TTL, a field ldns would reject) is left to ldns_rr_new_frm_str().
+ */
+
+#define FASTRR_TOKEN_MAX 512
+
+/*
+ * fastrr_tok()
+ *
+ * Copy a token into 'buf' as a C string.  Returns 0 if it doesn't fit.
+ */
+static const char *
+fastrr_tok(const zscan_token *t, char *buf)
+{
+	if (t->len >= FASTRR_TOKEN_MAX)
+		return 0;
+	memcpy(buf, t->str, t->len);
+	buf[t->len] = '\0';
+	return buf;
+}
+
+/*
+ * fastrr_join()
+ *
+ * Concatenate tokens [first, n) into a newly allocated string, separated
+ * by 'sep' (or nothing if sep is '\0').
+ */
+static char *
+fastrr_join(const zscan_token *t, size_t first, size_t n, char sep)
+{
+	size_t i;
+	size_t len = 1;
+	char *s;
+	char *p;
+	for (i = first; i < n; i++)
+		len += t[i].len + 1;
+	p = s = malloc(len);
+	assert(s);
+	for (i = first; i < n; i++) {
+		if (sep && i > first)
+			*p++ = sep;
+		memcpy(p, t[i].str, t[i].len);
+		p += t[i].len;
+	}
+	*p = '\0';
+	return s;
+}
+
+/*
+ * fastrr_dname()
+ *
+ * Convert a name token as ldns_rr_new_frm_str() does:  '@' is the origin
+ * and relative names are made absolute with the origin.
+ */
+static ldns_rdf *
+fastrr_dname(const zscan_token *t, const ldns_rdf *origin)
+{
+	char buf[FASTRR_TOKEN_MAX];
+	const char *s = fastrr_tok(t, buf);
+	ldns_rdf *rdf;
+	if (s == 0)
+		return 0;
+	if (strcmp(s, "@") == 0)
+		return origin ? ldns_rdf_clone(origin) : 0;
+	rdf = ldns_dname_new_frm_str(s);
+	if (rdf == 0)
+		return 0;
+	if (!ldns_dname_str_absolute(s) && origin) {
+		if (ldns_dname_cat(rdf, origin) != LDNS_STATUS_OK) {
+			ldns_rdf_deep_free(rdf);
+			return 0;
+		}
+	}
+	return rdf;
+}
+
+static ldns_rdf *
+fastrr_rdf(ldns_rdf_type type, const zscan_token *t)
+{
+	char buf[FASTRR_TOKEN_MAX];
+	const char *s = fastrr_tok(t, buf);
+	if (s == 0)
+		return 0;
+	return ldns_rdf_new_frm_str(type, s);
+}
+
+static ldns_rdf *
+fastrr_rdf_join(ldns_rdf_type type, const zscan_token *t, size_t first, size_t n, char sep)
+{
+	ldns_rdf *rdf;
+	char *s;
+	if (first >= n)
+		return 0;
+	s = fastrr_join(t, first, n, sep);
+	rdf = ldns_rdf_new_frm_str(type, s);
+	free(s);
+	return rdf;
+}
+
+static ldns_rdf *
+fastrr_addr(int af, const zscan_token *t)
+{
+	char buf[FASTRR_TOKEN_MAX];
+	unsigned char addr[16];
+	const char *s = fastrr_tok(t, buf);
+	if (s == 0)
+		return 0;
+	if (inet_pton(af, s, addr) != 1)
+		return 0;
+	if (af == AF_INET)
+		return ldns_rdf_new_frm_data(LDNS_RDF_TYPE_A, 4, addr);
+	return ldns_rdf_new_frm_data(LDNS_RDF_TYPE_AAAA, 16, addr);
+}
+
+static bool
+fastrr_type_supported(ldns_rr_type type)
+{
+	switch (type) {
+	case LDNS_RR_TYPE_A:
+	case LDNS_RR_TYPE_AAAA:
+	case LDNS_RR_TYPE_NS:
+	case LDNS_RR_TYPE_DS:
+	case LDNS_RR_TYPE_RRSIG:
+	case LDNS_RR_TYPE_NSEC:
+	case LDNS_RR_TYPE_NSEC3:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * fastrr_rdata()
+ *
+ * Parse the rdata tokens [i, n) for 'type' and push the fields onto 'rr'.
+ * Returns false if any field could not be parsed here.
+ */
+static bool
+fastrr_rdata(ldns_rr *rr, ldns_rr_type type, const zscan_token *t, size_t i, size_t n, const ldns_rdf *origin)
+{
+	ldns_rdf *rdf[9];
+	unsigned int nrdf = 0;
+	unsigned int k;
+
+	memset(rdf, 0, sizeof(rdf));
+	switch (type) {
+	case LDNS_RR_TYPE_A:
+		if (n - i != 1)
+			return false;
+		rdf[nrdf++] = fastrr_addr(AF_INET, &t[i]);
+		break;
+	case LDNS_RR_TYPE_AAAA:
+		if (n - i != 1)
+			return false;
+		rdf[nrdf++] = fastrr_addr(AF_INET6, &t[i]);
+		break;
+	case LDNS_RR_TYPE_NS:
+		if (n - i != 1)
+			return false;
+		rdf[nrdf++] = fastrr_dname(&t[i], origin);
+		break;
+	case LDNS_RR_TYPE_DS:
+		if (n - i < 4)
+			return false;
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT16, &t[i]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_ALG, &t[i + 1]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT8, &t[i + 2]);
+		rdf[nrdf++] = fastrr_rdf_join(LDNS_RDF_TYPE_HEX, t, i + 3, n, '\0');
+		break;
+	case LDNS_RR_TYPE_RRSIG:
+		if (n - i < 9)
+			return false;
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_TYPE, &t[i]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_ALG, &t[i + 1]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT8, &t[i + 2]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT32, &t[i + 3]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_TIME, &t[i + 4]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_TIME, &t[i + 5]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT16, &t[i + 6]);
+		rdf[nrdf++] = fastrr_dname(&t[i + 7], origin);
+		rdf[nrdf++] = fastrr_rdf_join(LDNS_RDF_TYPE_B64, t, i + 8, n, '\0');
+		break;
+	case LDNS_RR_TYPE_NSEC:
+		if (n - i < 2)
+			return false;
+		rdf[nrdf++] = fastrr_dname(&t[i], origin);
+		rdf[nrdf++] = fastrr_rdf_join(LDNS_RDF_TYPE_NSEC, t, i + 1, n, ' ');
+		break;
+	case LDNS_RR_TYPE_NSEC3:
+		if (n - i < 6)
+			return false;
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT8, &t[i]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT8, &t[i + 1]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_INT16, &t[i + 2]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_NSEC3_SALT, &t[i + 3]);
+		rdf[nrdf++] = fastrr_rdf(LDNS_RDF_TYPE_NSEC3_NEXT_OWNER, &t[i + 4]);
+		rdf[nrdf++] = fastrr_rdf_join(LDNS_RDF_TYPE_NSEC, t, i + 5, n, ' ');
+		break;
+	default:
+		return false;
+	}
+	for (k = 0; k < nrdf; k++) {
+		if (rdf[k] == 0) {
+			for (k = 0; k < nrdf; k++)
+				if (rdf[k])
+					ldns_rdf_deep_free(rdf[k]);
+			return false;
+		}
+	}
+	for (k = 0; k < nrdf; k++)
+		ldns_rr_push_rdf(rr, rdf[k]);
+	return true;
+}
+
+/*
+ * fastrr_new_frm_tokens()
+ *
+ * Build an RR from the tokens of one record.  If 'owner' is not NULL the
+ * record had no owner field and 'owner' is used instead.  TTL defaults
+ * are handled as in ldns_rr_new_frm_str().
+ *
+ * Returns false, without touching 'ret', if the record should be given
+ * to ldns instead.
+ */
+bool
+fastrr_new_frm_tokens(ldns_rr **ret, const zscan_token *t, size_t n, const ldns_rdf *owner, uint32_t default_ttl, const ldns_rdf *origin)
+{
+	char buf[FASTRR_TOKEN_MAX];
+	size_t i = 0;
+	uint32_t ttl = default_ttl ? default_ttl : LDNS_DEFAULT_TTL;
+	ldns_rr_class class = LDNS_RR_CLASS_IN;
+	ldns_rr_type type;
+	ldns_rdf *o;
+	ldns_rr *rr;
+
+	for (i = 0; i < n; i++)
+		if (memchr(t[i].str, '\\', t[i].len) || memchr(t[i].str, '"', t[i].len))
+			return false;
+	i = 0;
+	if (owner) {
+		o = ldns_rdf_clone(owner);
+	} else {
+		if (n < 1)
+			return false;
+		o = fastrr_dname(&t[i++], origin);
+		if (o == 0)
+			return false;
+	}
+	if (i < n && isdigit((unsigned char) t[i].str[0])) {
+		const char *end;
+		if (fastrr_tok(&t[i], buf) == 0)
+			goto fallback;
+		ttl = ldns_str2period(buf, &end);
+		if (*end != '\0')
+			goto fallback;
+		i++;
+	}
+	if (i < n && fastrr_tok(&t[i], buf)) {
+		ldns_rr_class c = ldns_get_rr_class_by_name(buf);
+		if (c != 0) {
+			class = c;
+			i++;
+		}
+	}
+	if (i >= n || fastrr_tok(&t[i], buf) == 0)
+		goto fallback;
+	type = ldns_get_rr_type_by_name(buf);
+	if (!fastrr_type_supported(type))
+		goto fallback;
+	i++;
+
+	rr = ldns_rr_new();
+	assert(rr);
+	ldns_rr_set_owner(rr, o);
+	ldns_rr_set_ttl(rr, ttl);
+	ldns_rr_set_class(rr, class);
+	ldns_rr_set_type(rr, type);
+	if (!fastrr_rdata(rr, type, t, i, n, origin)) {
+		ldns_rr_free(rr);
+		return false;
+	}
+	*ret = rr;
+	return true;
+
+fallback:
+	ldns_rdf_deep_free(o);
+	return false;
+}
+
+/*
+ * fastrr_new_frm_str()
+ *
+ * Like ldns_rr_new_frm_str() for a single-line RR with an owner name,
+ * using the fast parsers when possible.
+ */
+ldns_status
+fastrr_new_frm_str(ldns_rr **ret, const char *str, uint32_t default_ttl, const ldns_rdf *origin)
+{
+	zscan_token t[64];
+	size_t n = 0;
+	const char *p = str;
+
+	if (strpbrk(str, "\\\"();") || isspace((unsigned char) *str))
+		return ldns_rr_new_frm_str(ret, str, default_ttl, origin, 0);
+	while (*p) {
+		size_t len = strcspn(p, " \t\r\n");
+		if (len) {
+			if (n == sizeof(t) / sizeof(t[0]))
+				return ldns_rr_new_frm_str(ret, str, default_ttl, origin, 0);
+			t[n].str = p;
+			t[n].len = len;
+			n++;
+		}
+		p += len;
+		p += strspn(p, " \t\r\n");
+	}
+	if (fastrr_new_frm_tokens(ret, t, n, 0, default_ttl, origin))
+		return LDNS_STATUS_OK;
+	return ldns_rr_new_frm_str(ret, str, default_ttl, origin, 0);
+}
@@ -0,0 +1,2 @@
+bool fastrr_new_frm_tokens(ldns_rr **ret, const zscan_token *tokens, size_t ntokens, const ldns_rdf *owner, uint32_t default_ttl, const ldns_rdf *origin);
+ldns_status fastrr_new_frm_str(ldns_rr **ret, const char *str, uint32_t default_ttl, const ldns_rdf *origin);
@@ -45,10 +45,29 @@
 #include <openssl/evp.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ldns-zone-digest.h"
 #include "simple.h"
 #include "merkle.h"
+#include "btree.h"
+#include "validate.h"
+#include "rrhash.h"
+#include "canon.h"
+#include "zscan.h"
+#include "fastrr.h"
+#include "versions.h"
+#include "zio.h"
+#include "blake3.h"
+#include "sha512.h"
+#include "digest.h"
+#include "meta.h"
+#include "cow.h"
+#include "batch.h"
+#include "axfr.h"
 
 int quiet = 0;
 
@@ -57,10 +76,10 @@ static int ldns_knows_about_zonemd = 0;
 const char *RRNAME = "ZONEMD";
 static ldns_rdf *origin = 0;
 ldns_rr *the_soa = 0;
-uint32_t the_soa_serial = 0;
 ldns_output_format_storage ldns_rr_output_fmt_storage;
 ldns_output_format *ldns_rr_output_fmt = 0;
 scheme *the_scheme = 0;
+static int use_zscan = 0;
 
 #define MAX_ZONEMD_COUNT 10
 typedef struct  {
@@ -68,6 +87,71 @@ typedef struct  {
 	uint8_t hashalg;
 } placeholder;
 
+#define MAX_UPDATE_COUNT 64
+#define WRITE_PREFETCH_AHEAD 4
+typedef struct {
+	scheme *s;
+	const char *zsk_fname;
+	char *output_file;
+	pthread_t thread;
+} background_job;
+
+#define MAX_INSERT_THREADS 64
+#define INSERT_MIN_PER_THREAD 4096
+typedef struct {
+	const scheme *s;
+	const ldns_rr_list *rrs;
+	size_t first;
+	size_t last;
+	pthread_t thread;
+} insert_job;
+
+typedef struct {
+	scheme *s;
+	const EVP_MD *md;
+	unsigned char *buf;
+	pthread_t thread;
+} calc_job;
+
+#define MAX_PARSE_THREADS 64
+#define PARSE_MIN_PER_THREAD (1024 * 1024)	/* bytes of update file */
+typedef enum {
+	UPDATE_ADD,
+	UPDATE_DEL,
+	UPDATE_UNPARSEABLE,
+	UPDATE_BAD_COMMAND,
+	UPDATE_BAD_RR
+} update_kind;
+typedef struct {
+	update_kind op;
+	ldns_status status;		/* for UPDATE_BAD_RR */
+	ldns_rr *rr;
+} update_line;
+typedef struct {
+	const char *first;
+	const char *last;
+	update_line *lines;
+	size_t count;
+	pthread_t thread;
+} parse_job;
+
+/*
+ * Digests already calculated, by scheme, algorithm and zone version.
+ * Versions come from one counter shared by all scheme instances, so a
+ * version number always names the same zone contents.
+ */
+#define DIGEST_CACHE_SIZE 16
+typedef struct {
+	uint8_t scheme;
+	const EVP_MD *md;		/* NULL if the slot is unused */
+	uint64_t version;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+} digest_cache_entry;
+static digest_cache_entry digest_cache[DIGEST_CACHE_SIZE];
+static unsigned int digest_cache_next = 0;
+static pthread_mutex_t digest_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t zone_version_counter = 0;
+
 unsigned int
 uimin(unsigned int a, unsigned int b)
 {
@@ -76,6 +160,31 @@ uimin(unsigned int a, unsigned int b)
 	return b;
 }
 
+/*
+ * zonemd_thread_count()
+ *
+ * How many threads to split 'work' over:  one per 'min_per_thread'
+ * units, at most one per online CPU and at most 'max', and at least
+ * one.  The environment variable 'env' replaces 'min_per_thread' and
+ * lifts the CPU limit, so that the tests can run the threaded code on
+ * small inputs and on any host.
+ */
+static unsigned int
+zonemd_thread_count(size_t work, size_t min_per_thread, const char *env, unsigned int max)
+{
+	unsigned int cpus = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+	const char *override = getenv(env);
+	size_t n;
+	if (override && strtoul(override, 0, 10) > 0) {
+		min_per_thread = strtoul(override, 0, 10);
+		cpus = max;
+	}
+	n = work / min_per_thread;
+	n = n < cpus ? n : cpus;
+	n = n < max ? n : max;
+	return n ? (unsigned int) n : 1;
+}
+
 /*
  * zonemd_print_digest()
  *
@@ -155,30 +264,102 @@ zonemd_rr_pack(ldns_rr *rr, uint32_t serial, uint8_t scheme, uint8_t hashalg, vo
 	}
 }
 
+/*
+ * zonemd_apex_bits()
+ *
+ * Return a bitmap with one bit for each RR of 'leaf', in canonical
+ * order, that is at the apex and of 'type' (or, for RRSIG, covers
+ * 'covered').  The metadata columns are the ones kept with the leaf.
+ */
+static uint64_t *
+zonemd_apex_bits(cow_rrlist *leaf, ldns_rr_type type, ldns_rr_type covered)
+{
+	const rr_meta *meta = cow_rrlist_meta(leaf);
+	uint64_t *bits = calloc(rr_meta_bitmap_words(meta) + 1, sizeof(*bits));
+	assert(bits);
+	rr_meta_select(meta, type, covered, true, bits);
+	return bits;
+}
+
+/*
+ * zonemd_apex_select()
+ *
+ * Append the RRs of 'rrlist' whose bits are set to 'ret'.
+ */
+static void
+zonemd_apex_select(const ldns_rr_list *rrlist, const uint64_t *bits, ldns_rr_list *ret)
+{
+	size_t i;
+	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++)
+		if (bits[i / 64] & ((uint64_t) 1 << (i % 64)))
+			ldns_rr_list_push_rr(ret, ldns_rr_list_rr(rrlist, i));
+}
+
 /*
  * zonemd_rr_find()
  *
  * This function searches through the zone data and returns a list of ZONEMD records found.
+ * The apex leaf is only read, so it stays shared with any snapshot and
+ * keeps its cached wire form.
  */
 ldns_rr_list *
-zonemd_rr_find(void)
+zonemd_rr_find(const scheme *s)
 {
-	ldns_rr_list *ret = 0;
-	const ldns_rr_list *rrlist;
-	unsigned int i;
-	ret = ldns_rr_list_new();
+	ldns_rr_list *ret = ldns_rr_list_new();
+	cow_rrlist *leaf = s->leaf_ro(s, the_soa);
+	uint64_t *bits;
 	assert(ret);
-	rrlist = the_scheme->leaf(the_scheme, the_soa);
-	assert(rrlist);
-	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++) {
-		ldns_rr *rr = 0;
-		rr = ldns_rr_list_rr(rrlist, i);
-		if (ldns_rr_get_type(rr) != ZONEMD_RR_TYPE)
-			continue;
-		if (ldns_dname_compare(ldns_rr_owner(rr), origin) != 0)
-			continue;
-		ldns_rr_list_push_rr(ret, rr);
+	if (leaf == 0)
+		return ret;
+	bits = zonemd_apex_bits(leaf, ZONEMD_RR_TYPE, 0);
+	zonemd_apex_select(cow_rrlist_read(leaf), bits, ret);
+	free(bits);
+	return ret;
+}
+
+/*
+ * zonemd_rr_find_write()
+ *
+ * Same as zonemd_rr_find(), for a caller that changes the records in
+ * place.  The records are picked from the sorted leaf, which is then
+ * unshared; that keeps their order.
+ */
+static ldns_rr_list *
+zonemd_rr_find_write(const scheme *s)
+{
+	ldns_rr_list *ret = ldns_rr_list_new();
+	cow_rrlist *leaf = s->leaf_ro(s, the_soa);
+	uint64_t *bits;
+	assert(ret);
+	if (leaf == 0)
+		return ret;
+	bits = zonemd_apex_bits(leaf, ZONEMD_RR_TYPE, 0);
+	zonemd_apex_select(s->leaf(s, the_soa), bits, ret);
+	free(bits);
+	return ret;
+}
+
+/*
+ * zonemd_soa_find()
+ *
+ * Return the apex SOA of 's'.
+ */
+static const ldns_rr *
+zonemd_soa_find(const scheme *s)
+{
+	const ldns_rr *ret = 0;
+	ldns_rr_list *soas = ldns_rr_list_new();
+	cow_rrlist *leaf = s->leaf_ro(s, the_soa);
+	assert(soas);
+	if (leaf) {
+		uint64_t *bits = zonemd_apex_bits(leaf, LDNS_RR_TYPE_SOA, 0);
+		zonemd_apex_select(cow_rrlist_read(leaf), bits, soas);
+		free(bits);
 	}
+	if (ldns_rr_list_rr_count(soas) == 0)
+		errx(1, "%s(%d): zone has no SOA", __FILE__, __LINE__);
+	ret = ldns_rr_list_rr(soas, 0);
+	ldns_rr_list_free(soas);
 	return ret;
 }
 
@@ -254,14 +435,18 @@ zonemd_rr_unpack(ldns_rr *rr, uint32_t *ret_serial, uint8_t *ret_scheme, uint8_t
  * digest value is set to all zeroes.
  */
 void
-zonemd_rr_update_digest(ldns_rr * rr, uint32_t serial, unsigned char *new_digest_buf, unsigned int new_digest_len)
+zonemd_rr_update_digest(const scheme *s, ldns_rr * rr, uint32_t serial, unsigned char *new_digest_buf, unsigned int new_digest_len)
 {
 	uint8_t scheme;
 	uint8_t hashalg;
         unsigned int old_digest_sz = EVP_MAX_MD_SIZE;
 	unsigned char old_digest_buf[EVP_MAX_MD_SIZE];
 	zonemd_rr_unpack(rr, 0, &scheme, &hashalg, old_digest_buf, &old_digest_sz);
+	if (s->dedup)
+		rrhash_remove(s->dedup, rr);
 	zonemd_rr_pack(rr, serial, scheme, hashalg, new_digest_buf, new_digest_len);
+	if (s->dedup)
+		rrhash_insert(s->dedup, rr);
 }
 
 /*
@@ -277,20 +462,173 @@ my_typecovered(ldns_rr *rrsig)
 	return ldns_rdf2native_int16(rdf);
 }
 
+/*
+ * zonemd_rr_digested()
+ *
+ * Returns false for the RRs that are left out of the digest:  ZONEMD
+ * at the apex and signatures over ZONEMD.
+ */
+static bool
+zonemd_rr_digested(const ldns_rr *rr)
+{
+	if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_RRSIG)
+		if (my_typecovered((ldns_rr *) rr) == ZONEMD_RR_TYPE)
+			return false;
+	if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_ZONEMD)
+		if (canon_dname_equal(ldns_rr_owner(rr), origin))
+			return false;
+	return true;
+}
+
+/*
+ * zonemd_version_bump()
+ *
+ * Give 's' a new version number after 'rr' was added or removed.
+ * Changes that cannot affect the digest keep the version, so that
+ * placing ZONEMD records and signing them does not make a digest
+ * calculated just before look stale.
+ */
+static void
+zonemd_version_bump(scheme *s, const ldns_rr *rr)
+{
+	if (!zonemd_rr_digested(rr))
+		return;
+	s->version = __atomic_add_fetch(&zone_version_counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * zonemd_add_rr_accept()
+ *
+ * The bookkeeping half of zonemd_add_rr():  discard (and free) a
+ * duplicate RR, and note the serial of an apex SOA.  Returns false if
+ * 'rr' was a duplicate.
+ */
+static bool
+zonemd_add_rr_accept(scheme *s, ldns_rr *rr)
+{
+	if (s->dedup && !rrhash_insert(s->dedup, rr)) {
+		char *str = ldns_rr2str(rr);
+		assert(str);
+		warnx("%s(%d): Ignoring duplicate RR: %s", __FILE__, __LINE__, str);
+		free(str);
+		ldns_rr_free(rr);
+		return false;
+	}
+	if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_SOA && canon_dname_equal(ldns_rr_owner(rr), origin))
+		s->serial = ldns_rdf2native_int32(ldns_rr_rdf(rr, 2));
+	return true;
+}
+
 /*
  * zonemd_add_rr()
  *
- * Add an RR to the zone data.
+ * Add an RR to the zone data.  Duplicate RRs are discarded (and freed) here,
+ * so that the digest code never sees them.  Snapshots have no duplicate
+ * table; only ZONEMD and its RRSIG are added to those.
  */
 void
-zonemd_add_rr(ldns_rr *rr)
+zonemd_add_rr(scheme *s, ldns_rr *rr)
 {
 	ldns_rr_list *rrlist;
-	rrlist = the_scheme->leaf(the_scheme, rr);
+	if (!zonemd_add_rr_accept(s, rr))
+		return;
+	zonemd_version_bump(s, rr);
+	rrlist = s->leaf(s, rr);
 	assert(rrlist);
 	ldns_rr_list_push_rr(rrlist, rr);
 }
 
+static void *
+zonemd_insert_worker(void *arg)
+{
+	insert_job *job = arg;
+	size_t i;
+	for (i = job->first; i < job->last; i++)
+		job->s->insert(job->s, ldns_rr_list_rr(job->rrs, i));
+	return 0;
+}
+
+/*
+ * zonemd_add_rr_list()
+ *
+ * Add every RR in 'rrs' (which are taken over, the list itself is not).
+ * Duplicates are weeded out first, on this thread; if the scheme can
+ * insert concurrently the rest are then spread over several threads.
+ */
+static void
+zonemd_add_rr_list(scheme *s, ldns_rr_list *rrs)
+{
+	insert_job jobs[MAX_INSERT_THREADS];
+	ldns_rr_list *accepted;
+	unsigned int nthreads;
+	unsigned int i;
+	size_t count;
+	size_t j;
+
+	accepted = ldns_rr_list_new();
+	assert(accepted);
+	for (j = 0; j < ldns_rr_list_rr_count(rrs); j++) {
+		if (!zonemd_add_rr_accept(s, ldns_rr_list_rr(rrs, j)))
+			continue;
+		zonemd_version_bump(s, ldns_rr_list_rr(rrs, j));
+		ldns_rr_list_push_rr(accepted, ldns_rr_list_rr(rrs, j));
+	}
+	count = ldns_rr_list_rr_count(accepted);
+	nthreads = zonemd_thread_count(count, INSERT_MIN_PER_THREAD, "ZONEMD_INSERT_MIN_PER_THREAD", MAX_INSERT_THREADS);
+	if (s->insert == 0 || nthreads < 2) {
+		for (j = 0; j < count; j++) {
+			ldns_rr *rr = ldns_rr_list_rr(accepted, j);
+			ldns_rr_list *rrlist = s->leaf(s, rr);
+			assert(rrlist);
+			ldns_rr_list_push_rr(rrlist, rr);
+		}
+		ldns_rr_list_free(accepted);
+		return;
+	}
+	fdebugf(stderr, "%s(%d): inserting %zu RRs with %u threads\n", __FILE__, __LINE__, count, nthreads);
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].s = s;
+		jobs[i].rrs = accepted;
+		jobs[i].first = count * i / nthreads;
+		jobs[i].last = count * (i + 1) / nthreads;
+		if (pthread_create(&jobs[i].thread, 0, zonemd_insert_worker, &jobs[i]) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(jobs[i].thread, 0);
+	ldns_rr_list_free(accepted);
+}
+
+/*
+ * zonemd_del_rr()
+ *
+ * Remove the RR equal to 'rr' (TTL is not compared) from the zone data.
+ * Returns false if there is no such RR.
+ */
+bool
+zonemd_del_rr(scheme *s, const ldns_rr *rr)
+{
+	unsigned int i;
+	ldns_rr_list *rrlist = s->leaf(s, rr);
+	assert(rrlist);
+	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++) {
+		ldns_rr *old = ldns_rr_list_rr(rrlist, i);
+		ldns_rr *last;
+		if (ldns_rr_compare(old, rr) != 0)
+			continue;
+		last = ldns_rr_list_pop_rr(rrlist);
+		assert(last);
+		if (last != old)
+			ldns_rr_list_set_rr(rrlist, last, i);
+		if (s->dedup)
+			rrhash_remove(s->dedup, old);
+		zonemd_version_bump(s, old);
+		ldns_rr_free(old);
+		return true;
+	}
+	return false;
+}
+
 /*
  * zonemd_remove_rr()
  *
@@ -298,40 +636,52 @@ zonemd_add_rr(ldns_rr *rr)
  * signatures of type 'covered' are removed.
  */
 void
-zonemd_remove_rr(ldns_rr_type type, ldns_rr_type covered)
+zonemd_remove_rr(scheme *s, ldns_rr_type type, ldns_rr_type covered)
 {
-	unsigned int i;
+	size_t i;
+	size_t j;
 	ldns_rr_list *rrlist = 0;
 	ldns_rr_list *tbd = 0;
+	cow_rrlist *leaf;
+	uint64_t *bits;
+	size_t words;
+
+	leaf = s->leaf_ro(s, the_soa);
+	assert(leaf);
+	bits = zonemd_apex_bits(leaf, type, covered);
+	words = rr_meta_bitmap_words(cow_rrlist_meta(leaf));
+	for (i = 0; i < words && bits[i] == 0; i++)
+		(void) 0;
+	if (i == words) {
+		/*
+		 * nothing to remove; leave the leaf shared
+		 */
+		free(bits);
+		return;
+	}
 
 	tbd = ldns_rr_list_new();
 	assert(tbd);
 
-	rrlist = the_scheme->leaf(the_scheme, the_soa);
-	assert(rrlist);
-	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++) {
+	rrlist = s->leaf(s, the_soa);
+	/*
+	 * keep the unselected RRs, in order, at the front of the list
+	 */
+	for (i = 0, j = 0; i < ldns_rr_list_rr_count(rrlist); i++) {
 		ldns_rr *rr = ldns_rr_list_rr(rrlist, i);
-		if (ldns_dname_compare(ldns_rr_owner(rr), origin) != 0) {
-			(void) 0;
-		} else if (ldns_rr_get_type(rr) != type) {
-			(void) 0;
-		} else if (type == LDNS_RR_TYPE_RRSIG && my_typecovered(rr) != covered) {
-			(void) 0;
-		} else {
-			/*
-			 * swap the last RR in the list with the current RR to be removed
-			 */
-			ldns_rr *last = ldns_rr_list_pop_rr(rrlist);
-			assert(last);
+		if (bits[i / 64] & ((uint64_t) 1 << (i % 64)))
 			ldns_rr_list_push_rr(tbd, rr);
-			if (last != rr) {
-				ldns_rr *t = ldns_rr_list_set_rr(rrlist, last, i);
-				assert(t == rr);
-				i--;
-			}
-		}
+		else
+			ldns_rr_list_set_rr(rrlist, rr, j++);
 	}
+	ldns_rr_list_set_rr_count(rrlist, j);
+	free(bits);
 
+	for (i = 0; i < ldns_rr_list_rr_count(tbd); i++) {
+		if (s->dedup)
+			rrhash_remove(s->dedup, ldns_rr_list_rr(tbd, i));
+		zonemd_version_bump(s, ldns_rr_list_rr(tbd, i));
+	}
 	ldns_rr_list_deep_free(tbd);
 }
 
@@ -349,6 +699,8 @@ zonemd_digester(uint8_t hashalg, const char *file, const int line, bool warn_uns
 		name = "sha384";
 	} else if (hashalg == 2) {
 		name = "sha512";
+	} else if (hashalg == ZONEMD_HASHALG_BLAKE3) {
+		return zonemd_blake3();
 	} else {
 		if (warn_unsupported)
 			warnx("%s(%d): Unsupported hash algorithm %u", file, line, hashalg);
@@ -361,51 +713,67 @@ zonemd_digester(uint8_t hashalg, const char *file, const int line, bool warn_uns
 }
 
 /*
+ * zonemd_rrlist_meta()
  *
- * zonemd_rrlist_digest()
+ * The metadata columns of 'rrlist', with the zone apex flagged.
+ */
+rr_meta *
+zonemd_rrlist_meta(const ldns_rr_list *rrlist)
+{
+	return rr_meta_new(rrlist, origin);
+}
+
+/*
+ *
+ * zonemd_rrlist_wire()
  *
- * Loops over an rrlist and calls the digest update function on each RR.
+ * Returns, in a malloc'd buffer, the bytes of an rrlist that go into the
+ * digest.  The list must already be in canonical order (see
+ * cow_rrlist_read()); cow_rrlist_wire() keeps the result with the list.
+ * 'meta' holds the columns of the list (see zonemd_rrlist_meta()), or is
+ * NULL to have them made here and thrown away.
+ *
+ * The sorted list is processed as a sequence of RRsets, found by
+ * comparing the metadata columns of neighbouring RRs (see meta.c).  The
+ * owner, type, class and TTL are encoded once per RRset and copied again
+ * for each RR in it, followed by that RR's RDLENGTH and RDATA.  The bytes are
+ * identical to ldns_rr2wire() output for each RR.
  */
-void
-zonemd_rrlist_digest(ldns_rr_list *rrlist, EVP_MD_CTX *ctx)
+uint8_t *
+zonemd_rrlist_wire(const ldns_rr_list *rrlist, const rr_meta *meta, size_t *ret_len)
 {
 	unsigned int i;
-	ldns_status status;
-	ldns_rr *prev = 0;
+	ldns_buffer *hdr_buf;
+	ldns_buffer *out;
+	bool have_hdr = false;
+	unsigned int hdr = 0;
+	rr_meta *own_meta = 0;
+	uint64_t *skip;
+	uint8_t *data;
+	hdr_buf = ldns_buffer_new(LDNS_MAX_DOMAINLEN + 8);
+	out = ldns_buffer_new(4096);
+	assert(hdr_buf);
+	assert(out);
 	/*
-	 * thankfully ldns_rr_list_sort() already sorts by RRtype for same owner name
+	 * Don't include ZONEMD RRs at apex, or RRSIG over ZONEMD
 	 */
-	ldns_rr_list_sort(rrlist);
+	if (meta == 0)
+		meta = own_meta = zonemd_rrlist_meta(rrlist);
+	skip = calloc(rr_meta_bitmap_words(meta) + 1, sizeof(*skip));
+	assert(skip);
+	rr_meta_select(meta, LDNS_RR_TYPE_RRSIG, ZONEMD_RR_TYPE, false, skip);
+	rr_meta_select(meta, LDNS_RR_TYPE_ZONEMD, 0, true, skip);
 	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++) {
-		uint8_t *wire_buf;
-		size_t sz;
 		ldns_rr *rr = ldns_rr_list_rr(rrlist, i);
 		ldns_rr *rr_copy = 0;
-		if (prev && ldns_rr_compare(rr, prev) == 0) {
-			char *s = ldns_rr2str(rr);
-			assert(s);
-			warnx("%s(%d): Ignoring duplicate RR: %s", __FILE__, __LINE__, s);
-			free(s);
+		size_t rdlen_pos;
+		if (skip[i / 64] & ((uint64_t) 1 << (i % 64)))
 			continue;
-		}
-		prev = rr;
-		/*
-		 * Don't include RRSIG over ZONEMD in the digest
-		 */
-		if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_RRSIG)
-			if (my_typecovered(rr) == ZONEMD_RR_TYPE)
-				continue;
-		/*
-		 * Don't include ZONEMD RRs at apex
-		 */
-		if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_ZONEMD)
-			if (ldns_dname_compare(ldns_rr_owner(rr), origin) == 0)
-				continue;
 #if 0
 		/*
 		 * For ZONEMD RRs at apex, create a copy with digest zeroized
 		 */
-		if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_ZONEMD && ldns_dname_compare(ldns_rr_owner(rr), origin) == 0) {
+		if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_ZONEMD && canon_dname_equal(ldns_rr_owner(rr), origin)) {
 			uint8_t scheme = 0;
 			uint8_t hashalg = 0;
 			unsigned char digest[EVP_MAX_MD_SIZE];
@@ -425,18 +793,45 @@ zonemd_rrlist_digest(ldns_rr_list *rrlist, EVP_MD_CTX *ctx)
 #endif
 #if DEBUG
 		char *s = ldns_rr2str(rr);
-		fdebugf(stderr, "%s(%d): zonemd_rrlist_digest RR#%u: %s", __FILE__, __LINE__, i, s);
+		fdebugf(stderr, "%s(%d): zonemd_rrlist_wire RR#%u: %s", __FILE__, __LINE__, i, s);
 		free(s);
 #endif
-		status = ldns_rr2wire(&wire_buf, rr, LDNS_SECTION_ANSWER, &sz);
-		if (status != LDNS_STATUS_OK)
-			errx(1, "%s(%d): ldns_rr2wire() failed", __FILE__, __LINE__);
-		if (!EVP_DigestUpdate(ctx, wire_buf, sz))
-			errx(1, "%s(%d): Digest update failed", __FILE__, __LINE__);
-		free(wire_buf);
-		if (rr_copy != 0)
+		if (!have_hdr
+		    || meta->owner[hdr] != meta->owner[i]
+		    || meta->type[hdr] != meta->type[i]
+		    || meta->class[hdr] != meta->class[i]
+		    || meta->ttl[hdr] != meta->ttl[i]) {
+			ldns_buffer_clear(hdr_buf);
+			(void) ldns_dname2buffer_wire(hdr_buf, ldns_rr_owner(rr));
+			ldns_buffer_write_u16(hdr_buf, ldns_rr_get_type(rr));
+			ldns_buffer_write_u16(hdr_buf, ldns_rr_get_class(rr));
+			ldns_buffer_write_u32(hdr_buf, ldns_rr_ttl(rr));
+			if (ldns_buffer_status(hdr_buf) != LDNS_STATUS_OK)
+				errx(1, "%s(%d): RR header encoding failed", __FILE__, __LINE__);
+			have_hdr = true;
+			hdr = i;
+		}
+		if (!ldns_buffer_reserve(out, ldns_buffer_position(hdr_buf) + 2))
+			errx(1, "%s(%d): ldns_buffer_reserve() failed", __FILE__, __LINE__);
+		ldns_buffer_write(out, ldns_buffer_begin(hdr_buf), ldns_buffer_position(hdr_buf));
+		rdlen_pos = ldns_buffer_position(out);
+		ldns_buffer_write_u16(out, 0);
+		if (ldns_rr_rdata2buffer_wire(out, rr) != LDNS_STATUS_OK)
+			errx(1, "%s(%d): ldns_rr_rdata2buffer_wire() failed", __FILE__, __LINE__);
+		ldns_buffer_write_u16_at(out, rdlen_pos, ldns_buffer_position(out) - rdlen_pos - 2);
+		if (rr_copy != 0) {
 			ldns_rr_free(rr_copy);
+			have_hdr = false;
+		}
 	}
+	free(skip);
+	if (own_meta)
+		rr_meta_free(own_meta);
+	ldns_buffer_free(hdr_buf);
+	*ret_len = ldns_buffer_position(out);
+	data = ldns_buffer_export(out);
+	ldns_buffer_free(out);
+	return data;
 }
 
 /*
@@ -446,7 +841,7 @@ zonemd_rrlist_digest(ldns_rr_list *rrlist, EVP_MD_CTX *ctx)
  * zone signing key.
  */
 void
-zonemd_resign(ldns_rr_list * rrset, const char *zsk_fname)
+zonemd_resign(scheme *s, ldns_rr_list * rrset, const char *zsk_fname)
 {
 	FILE *fp = 0;
 	ldns_key *zsk = 0;
@@ -471,19 +866,29 @@ zonemd_resign(ldns_rr_list * rrset, const char *zsk_fname)
 	if (rrsig == 0)
 		errx(1, "%s(%d): ldns_sign_public() failed", __FILE__, __LINE__);
 
-	zonemd_remove_rr(LDNS_RR_TYPE_RRSIG, ZONEMD_RR_TYPE);
+	zonemd_remove_rr(s, LDNS_RR_TYPE_RRSIG, ZONEMD_RR_TYPE);
 	for (i = 0; i < ldns_rr_list_rr_count(rrsig); i++)
-		zonemd_add_rr(ldns_rr_list_rr(rrsig, i));
+		zonemd_add_rr(s, ldns_rr_list_rr(rrsig, i));
 	ldns_key_list_free(keys);
 	ldns_rr_list_free(rrsig);
 }
 
-void
-zonemd_write_zone_cb(const ldns_rr *rr, const void *cb_data)
+/*
+ * zonemd_write_zone_span()
+ *
+ * Print a span of RRs.  Formatting an RR chases several pointers, so
+ * the RRs a few places ahead are prefetched.
+ */
+static void
+zonemd_write_zone_span(const ldns_rr *const *rrs, size_t count, const void *cb_data)
 {
 	FILE *fp = (void *) cb_data;
-	if (rr)
-		ldns_rr_print_fmt(fp, ldns_rr_output_fmt, rr);
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if (i + WRITE_PREFETCH_AHEAD < count)
+			__builtin_prefetch(rrs[i + WRITE_PREFETCH_AHEAD]);
+		ldns_rr_print_fmt(fp, ldns_rr_output_fmt, rrs[i]);
+	}
 }
 
 /*
@@ -492,12 +897,12 @@ zonemd_write_zone_cb(const ldns_rr *rr, const void *cb_data)
  * Prints all zone records to output_file
  */
 void
-zonemd_write_zone(const char *output_file)
+zonemd_write_zone(const scheme *s, const char *output_file)
 {
-	FILE *fp = fopen(output_file, "w");
+	FILE *fp = zio_fopen(output_file, "w");
 	if (!fp)
 		err(1, "%s(%d): %s", __FILE__, __LINE__, output_file);
-	the_scheme->iter(the_scheme, zonemd_write_zone_cb, fp);
+	s->span(s, zonemd_write_zone_span, fp);
 	fclose(fp);
 }
 
@@ -505,12 +910,25 @@ void
 usage(const char *p)
 {
 	fprintf(stderr, "usage: %s [options] origin [zonefile]\n", p);
+	fprintf(stderr, "\t-a server\ttransfer the zone from server[#port] instead of reading a zone file\n");
+	fprintf(stderr, "\t-b backend\tSHA-384/512 code: direct (default) or evp\n");
 	fprintf(stderr, "\t-c\t\tcalculate the zone digest\n");
+	fprintf(stderr, "\t-d\t\tvalidate all DNSSEC signatures in the zone\n");
+	fprintf(stderr, "\t-f\t\tread the zone file with the fast built-in scanner\n");
 	fprintf(stderr, "\t-g\t\tprint ZONEMD in RFC 3597 generic format\n");
+	fprintf(stderr, "\t-i file\t\twrite the net changes of the -u files to file, IXFR style\n");
+	fprintf(stderr, "\t-j n\t\tuse n threads for DNSSEC validation\n");
+	fprintf(stderr, "\t-k n\t\tkeep the last n serials in memory\n");
+	fprintf(stderr, "\t-n\t\thash scheme 240 branches in parallel, spread over NUMA nodes\n");
 	fprintf(stderr, "\t-o file\t\twrite zone to output file\n");
-	fprintf(stderr, "\t-u file\t\tfile containing RR updates\n");
-	fprintf(stderr, "\t-p s,h\t\tinsert placeholder record of scheme s and hashalg h\n");
+	fprintf(stderr, "\t-u file\t\tfile containing RR updates (may be repeated)\n");
+	fprintf(stderr, "\t-p s,h\t\tinsert placeholder record of scheme s and hashalg h (1, 2, or 240 for BLAKE3)\n");
+	fprintf(stderr, "\t-r serial\tprint the ZONEMD records of a kept serial\n");
+	fprintf(stderr, "\t-S n\t\tuse up to n threads to sort large RR lists\n");
+	fprintf(stderr, "\t-s scheme\tin-memory data structure: 1 (simple), 240 (merkle), 241 (B+-tree)\n");
+	fprintf(stderr, "\t-t\t\tprint timings, the SHA-512 block function and wire cache use\n");
 	fprintf(stderr, "\t-v\t\tverify the zone digest\n");
+	fprintf(stderr, "\t-x a:b\t\tprint the changes from kept serial a to b\n");
 	fprintf(stderr, "\t-z file\t\tZSK file name\n");
 	fprintf(stderr, "\t-q\t\tquiet mode, show errors only\n");
 	exit(2);
@@ -540,13 +958,13 @@ elapsed_msec(struct timeval *a, struct timeval *b)
  * has a ZONEMD record, it is removed and discarded.
  */
 void
-zonemd_add_placeholders(placeholder placeholders[], unsigned int count)
+zonemd_add_placeholders(scheme *s, placeholder placeholders[], unsigned int count)
 {
 	unsigned int i;
 
 	if (!quiet)
 		fprintf(stderr, "Remove existing ZONEMD RRset\n");
-	zonemd_remove_rr(ZONEMD_RR_TYPE, 0);
+	zonemd_remove_rr(s, ZONEMD_RR_TYPE, 0);
 
 	for (i = 0; i < count; i++) {
 		const EVP_MD *md = 0;
@@ -574,13 +992,13 @@ zonemd_add_placeholders(placeholder placeholders[], unsigned int count)
 		digest_buf = calloc(1, digest_len);
 		assert(digest_buf);
 		zonemd = zonemd_rr_create(ldns_rr_owner(the_soa), ldns_rr_ttl(the_soa));
-		zonemd_rr_pack(zonemd, the_soa_serial, placeholders[i].scheme, placeholders[i].hashalg, digest_buf, digest_len);
+		zonemd_rr_pack(zonemd, s->serial, placeholders[i].scheme, placeholders[i].hashalg, digest_buf, digest_len);
 		free(digest_buf);
 		if (!quiet)
 			fprintf(stderr, "Add placeholder ZONEMD with scheme %u and hash algorithm %u\n",
 				placeholders[i].scheme,
 				placeholders[i].hashalg);
-		zonemd_add_rr(zonemd);
+		zonemd_add_rr(s, zonemd);
 	}
 }
 
@@ -591,13 +1009,13 @@ zonemd_add_placeholders(placeholder placeholders[], unsigned int count)
  *
  */
 void
-zonemd_read_zone(const char *origin_str, FILE * fp, uint32_t ttl, ldns_rr_class class)
+zonemd_read_zone(scheme *s, const char *origin_str, FILE * fp, uint32_t ttl, ldns_rr_class class)
 {
 	ldns_zone *zone;
 	ldns_status status;
 	ldns_rr_list *oldlist;
 	ldns_rr_list *tbflist;
-	ldns_rdf *soa_serial_rdf = 0;
+	ldns_rr_list *addlist;
 	unsigned int i;
 	unsigned int count = 0;
 
@@ -605,24 +1023,35 @@ zonemd_read_zone(const char *origin_str, FILE * fp, uint32_t ttl, ldns_rr_class
 		fprintf(stderr, "Loading Zone...");
 	origin = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, origin_str);
 	assert(origin);
-	status = ldns_zone_new_frm_fp(&zone, fp, origin, ttl, class);
-	if (status != LDNS_STATUS_OK)
-		errx(1, "%s(%d): ldns_zone_new_frm_fp: %s", __FILE__, __LINE__, ldns_get_errorstr_by_id(status));
+	if (use_zscan) {
+		int line_nr = 0;
+		status = zscan_zone_new_frm_fp(&zone, fp, origin, ttl, class, &line_nr);
+		if (status != LDNS_STATUS_OK)
+			errx(1, "%s(%d): zscan_zone_new_frm_fp: line %d: %s", __FILE__, __LINE__, line_nr, ldns_get_errorstr_by_id(status));
+	} else {
+		status = ldns_zone_new_frm_fp(&zone, fp, origin, ttl, class);
+		if (status != LDNS_STATUS_OK)
+			errx(1, "%s(%d): ldns_zone_new_frm_fp: %s", __FILE__, __LINE__, ldns_get_errorstr_by_id(status));
+	}
 	if (!ldns_zone_soa(zone))
 		errx(1, "%s(%d): No SOA record in zone", __FILE__, __LINE__);
+	/*
+	 * the_soa is only used to locate the apex leaf, so it is kept apart
+	 * from the zone data which may be copied and freed by snapshots.
+	 */
 	the_soa = ldns_rr_clone(ldns_zone_soa(zone));
-	zonemd_add_rr(the_soa);
-	soa_serial_rdf = ldns_rr_rdf(the_soa, 2);
-	the_soa_serial = ldns_rdf2native_int32(soa_serial_rdf);
+	zonemd_add_rr(s, ldns_rr_clone(the_soa));
 	count++;
 	/*
 	 * Remove any out-of-zone data
 	 */
 	oldlist = ldns_zone_rrs(zone);
 	tbflist = ldns_rr_list_new();
+	addlist = ldns_rr_list_new();
+	assert(addlist);
 	for (i = 0; i < ldns_rr_list_rr_count(oldlist); i++) {
 		ldns_rr *rr = ldns_rr_list_rr(oldlist, i);
-		if (ldns_dname_compare(ldns_rr_owner(rr), origin) == 0) {
+		if (canon_dname_equal(ldns_rr_owner(rr), origin)) {
 			/* same owner */
 			(void) 0;
 		} else if (ldns_dname_is_subdomain(ldns_rr_owner(rr), origin)) {
@@ -637,9 +1066,11 @@ zonemd_read_zone(const char *origin_str, FILE * fp, uint32_t ttl, ldns_rr_class
 			ldns_rr_list_push_rr(tbflist, rr);
 			continue;
 		}
-		zonemd_add_rr(rr);
+		ldns_rr_list_push_rr(addlist, rr);
 		count++;
 	}
+	zonemd_add_rr_list(s, addlist);
+	ldns_rr_list_free(addlist);
 
 	if (!quiet)
 		fprintf(stderr, "%u records\n", count);
@@ -649,6 +1080,453 @@ zonemd_read_zone(const char *origin_str, FILE * fp, uint32_t ttl, ldns_rr_class
 	ldns_zone_deep_free(zone);
 }
 
+static void *
+zonemd_calc_thread(void *arg)
+{
+	calc_job *job = arg;
+	job->s->calc(job->s, job->md, job->buf);
+	return 0;
+}
+
+/*
+ * zonemd_digest_cache_get()
+ *
+ * Copy a cached digest of this version of the zone into 'buf'.
+ * Returns false if there is none.
+ */
+static bool
+zonemd_digest_cache_get(const scheme *s, const EVP_MD *md, unsigned char *buf)
+{
+	unsigned int i;
+	bool found = false;
+	pthread_mutex_lock(&digest_cache_lock);
+	for (i = 0; i < DIGEST_CACHE_SIZE; i++) {
+		digest_cache_entry *e = &digest_cache[i];
+		if (e->md != md || e->scheme != s->scheme || e->version != s->version)
+			continue;
+		memcpy(buf, e->digest, EVP_MD_size(md));
+		found = true;
+		break;
+	}
+	pthread_mutex_unlock(&digest_cache_lock);
+	return found;
+}
+
+/*
+ * zonemd_digest_cache_put()
+ *
+ * Remember a digest of this version of the zone, replacing the oldest.
+ */
+static void
+zonemd_digest_cache_put(const scheme *s, const EVP_MD *md, const unsigned char *buf)
+{
+	digest_cache_entry *e;
+	pthread_mutex_lock(&digest_cache_lock);
+	e = &digest_cache[digest_cache_next];
+	digest_cache_next = (digest_cache_next + 1) % DIGEST_CACHE_SIZE;
+	e->scheme = s->scheme;
+	e->md = md;
+	e->version = s->version;
+	memcpy(e->digest, buf, EVP_MD_size(md));
+	pthread_mutex_unlock(&digest_cache_lock);
+}
+
+/*
+ * zonemd_calc_digests_uncached()
+ *
+ * Calculate 'n' digests of the zone, one thread per algorithm.  A scheme
+ * with calc_multi does this itself, serializing the zone once or keeping
+ * each algorithm's node digests apart.  Otherwise each extra algorithm
+ * gets its own copy-on-write snapshot, so that the node digests they
+ * cache do not collide.
+ */
+static void
+zonemd_calc_digests_uncached(const scheme *s, unsigned int n, const EVP_MD **mds, unsigned char **bufs)
+{
+	calc_job *jobs;
+	unsigned int i;
+	if (n == 0)
+		return;
+	if (n == 1) {
+		s->calc(s, mds[0], bufs[0]);
+		return;
+	}
+	if (s->calc_multi) {
+		s->calc_multi(s, n, mds, bufs);
+		return;
+	}
+	jobs = calloc(n, sizeof(*jobs));
+	assert(jobs);
+	for (i = 1; i < n; i++) {
+		jobs[i].s = s->snap(s);
+		jobs[i].md = mds[i];
+		jobs[i].buf = bufs[i];
+		if (pthread_create(&jobs[i].thread, 0, zonemd_calc_thread, &jobs[i]) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	}
+	s->calc(s, mds[0], bufs[0]);
+	for (i = 1; i < n; i++) {
+		pthread_join(jobs[i].thread, 0);
+		jobs[i].s->free(jobs[i].s);
+	}
+	free(jobs);
+}
+
+/*
+ * zonemd_calc_digests()
+ *
+ * Calculate 'n' digests of the zone, taking those already known for
+ * this version from the cache.  With -c -v the verify pass then costs
+ * nothing unless the zone changed in between.
+ */
+static void
+zonemd_calc_digests(const scheme *s, unsigned int n, const EVP_MD **mds, unsigned char **bufs)
+{
+	const EVP_MD **miss_mds;
+	unsigned char **miss_bufs;
+	unsigned int nmiss = 0;
+	unsigned int i;
+	miss_mds = calloc(n + 1, sizeof(*miss_mds));
+	miss_bufs = calloc(n + 1, sizeof(*miss_bufs));
+	assert(miss_mds);
+	assert(miss_bufs);
+	for (i = 0; i < n; i++) {
+		if (zonemd_digest_cache_get(s, mds[i], bufs[i])) {
+			fdebugf(stderr, "%s(%d): digest %u of version %lu from cache\n", __FILE__, __LINE__, i, (unsigned long) s->version);
+			continue;
+		}
+		miss_mds[nmiss] = mds[i];
+		miss_bufs[nmiss] = bufs[i];
+		nmiss++;
+	}
+	zonemd_calc_digests_uncached(s, nmiss, miss_mds, miss_bufs);
+	for (i = 0; i < nmiss; i++)
+		zonemd_digest_cache_put(s, miss_mds[i], miss_bufs[i]);
+	free(miss_mds);
+	free(miss_bufs);
+}
+
+/*
+ * While a zone is transferred with -a, the scheme 1 digests are
+ * calculated on the fly for as long as the RRs come in canonical
+ * order.  RRs at the apex, which a transfer starts with the SOA of, are
+ * collected and sorted first.  The first RR below the apex shows which
+ * hash algorithms the ZONEMD records (and -p placeholders) call for;
+ * from there on each in-order RR is serialized, SCHEME_SPAN_MAX at a
+ * time, into a tee whose hashing threads keep up with the network.
+ * The results go into the digest cache for the version that was
+ * loaded.  An RR out of order ends this, and the zone is digested
+ * after loading as usual.
+ */
+typedef struct {
+	scheme *s;
+	const placeholder *placeholders;
+	unsigned int placeholder_cnt;
+	unsigned int count;
+	bool hashing;			/* false once given up */
+	const char *why;		/* it was given up */
+	ldns_rr_list *apex;		/* copies, NULL once hashing started */
+	ldns_rr_list *pending;		/* in order, not hashed yet */
+	const ldns_rr *last;
+	ldns_buffer *scratch;		/* for canon_rr_compare() */
+	unsigned int n;
+	const EVP_MD *mds[MAX_ZONEMD_COUNT];
+	digest_ctx ctx;
+} axfr_load;
+
+static void
+zonemd_axfr_flush(axfr_load *l)
+{
+	uint8_t *wire;
+	size_t len;
+	if (ldns_rr_list_rr_count(l->pending) == 0)
+		return;
+	wire = zonemd_rrlist_wire(l->pending, 0, &len);
+	digest_update(&l->ctx, wire, len);
+	free(wire);
+	ldns_rr_list_set_rr_count(l->pending, 0);
+}
+
+static void
+zonemd_axfr_add_md(axfr_load *l, uint8_t scheme, uint8_t hashalg)
+{
+	const EVP_MD *md;
+	unsigned int i;
+	if (scheme != 1)
+		return;
+	md = zonemd_digester(hashalg, __FILE__, __LINE__, 0);
+	if (md == 0)
+		return;
+	for (i = 0; i < l->n; i++)
+		if (l->mds[i] == md)
+			return;
+	if (l->n < MAX_ZONEMD_COUNT)
+		l->mds[l->n++] = md;
+}
+
+/*
+ * zonemd_axfr_give_up()
+ *
+ * Stop hashing during the transfer, throwing away what was done.
+ */
+static void
+zonemd_axfr_give_up(axfr_load *l, const char *why)
+{
+	unsigned char digests[MAX_ZONEMD_COUNT][EVP_MAX_MD_SIZE];
+	unsigned char *bufs[MAX_ZONEMD_COUNT];
+	unsigned int i;
+	l->why = why;
+	if (l->apex) {
+		ldns_rr_list_deep_free(l->apex);
+		l->apex = 0;
+	} else if (l->n) {
+		for (i = 0; i < l->n; i++)
+			bufs[i] = digests[i];
+		digest_tee_final(&l->ctx, bufs);
+	}
+	l->hashing = false;
+}
+
+/*
+ * zonemd_axfr_start()
+ *
+ * Pick the algorithms and hash the sorted apex RRs.
+ */
+static void
+zonemd_axfr_start(axfr_load *l)
+{
+	unsigned int i;
+	for (i = 0; i < l->placeholder_cnt; i++)
+		zonemd_axfr_add_md(l, l->placeholders[i].scheme, l->placeholders[i].hashalg);
+	if (l->placeholder_cnt == 0) {
+		for (i = 0; i < ldns_rr_list_rr_count(l->apex); i++) {
+			ldns_rr *rr = ldns_rr_list_rr(l->apex, i);
+			uint8_t scheme = 0;
+			uint8_t hashalg = 0;
+			if (ldns_rr_get_type(rr) != ZONEMD_RR_TYPE)
+				continue;
+			zonemd_rr_unpack(rr, 0, &scheme, &hashalg, 0, 0);
+			zonemd_axfr_add_md(l, scheme, hashalg);
+		}
+	}
+	if (l->n == 0) {
+		zonemd_axfr_give_up(l, "no scheme 1 digests");
+		return;
+	}
+	digest_tee_init(&l->ctx, l->n, l->mds);
+	canon_rr_list_sort(l->apex);
+	for (i = 0; i < ldns_rr_list_rr_count(l->apex); i++) {
+		ldns_rr_list_push_rr(l->pending, ldns_rr_list_rr(l->apex, i));
+		if (ldns_rr_list_rr_count(l->pending) == SCHEME_SPAN_MAX)
+			zonemd_axfr_flush(l);
+	}
+	zonemd_axfr_flush(l);
+	ldns_rr_list_deep_free(l->apex);
+	l->apex = 0;
+}
+
+/*
+ * zonemd_axfr_hash()
+ *
+ * Take a new (not duplicate) RR into the running digests.
+ */
+static void
+zonemd_axfr_hash(axfr_load *l, ldns_rr *rr)
+{
+	bool at_apex = canon_dname_equal(ldns_rr_owner(rr), origin);
+	if (l->apex) {
+		if (at_apex) {
+			ldns_rr_list_push_rr(l->apex, ldns_rr_clone(rr));
+			return;
+		}
+		zonemd_axfr_start(l);
+		if (!l->hashing)
+			return;
+	} else if (at_apex) {
+		zonemd_axfr_give_up(l, "apex RR after the apex");
+		return;
+	}
+	if (l->last && canon_rr_compare(l->last, rr, l->scratch) > 0) {
+		zonemd_axfr_give_up(l, "RRs out of canonical order");
+		return;
+	}
+	ldns_rr_list_push_rr(l->pending, rr);
+	l->last = rr;
+	if (ldns_rr_list_rr_count(l->pending) == SCHEME_SPAN_MAX)
+		zonemd_axfr_flush(l);
+}
+
+static void
+zonemd_axfr_rr(ldns_rr *rr, void *data)
+{
+	axfr_load *l = data;
+	scheme *s = l->s;
+	if (the_soa == 0) {
+		if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_SOA || !canon_dname_equal(ldns_rr_owner(rr), origin))
+			errx(1, "%s(%d): AXFR does not start with the zone's SOA", __FILE__, __LINE__);
+		the_soa = ldns_rr_clone(rr);
+	} else if (!canon_dname_equal(ldns_rr_owner(rr), origin) && !ldns_dname_is_subdomain(ldns_rr_owner(rr), origin)) {
+		char *str = ldns_rdf2str(ldns_rr_owner(rr));
+		assert(str);
+		warnx("%s(%d): Ignoring out-of-zone data for '%s'", __FILE__, __LINE__, str);
+		free(str);
+		ldns_rr_free(rr);
+		return;
+	}
+	if (l->hashing && !rrhash_contains(s->dedup, rr))
+		zonemd_axfr_hash(l, rr);
+	zonemd_add_rr(s, rr);
+	l->count++;
+}
+
+/*
+ * zonemd_axfr_read_zone()
+ *
+ * Load the zone with an AXFR from 'server' (host[#port]) instead of a
+ * zone file.  RRs are added as they arrive.  With scheme 1, digests for
+ * the ZONEMD records in the zone, or for the placeholders that will
+ * replace them, are calculated during the transfer if it comes in
+ * canonical order.
+ */
+void
+zonemd_axfr_read_zone(scheme *s, const char *origin_str, const char *server, const placeholder *placeholders, unsigned int placeholder_cnt)
+{
+	unsigned char digests[MAX_ZONEMD_COUNT][EVP_MAX_MD_SIZE];
+	unsigned char *bufs[MAX_ZONEMD_COUNT];
+	axfr_load l;
+	unsigned int i;
+
+	if (!quiet)
+		fprintf(stderr, "Transferring Zone...");
+	origin = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME, origin_str);
+	assert(origin);
+	memset(&l, 0, sizeof(l));
+	l.s = s;
+	l.placeholders = placeholders;
+	l.placeholder_cnt = placeholder_cnt;
+	l.hashing = (s->scheme == 1);
+	l.apex = ldns_rr_list_new();
+	l.pending = ldns_rr_list_new();
+	l.scratch = ldns_buffer_new(LDNS_MAX_PACKETLEN);
+	assert(l.apex);
+	assert(l.pending);
+	assert(l.scratch);
+	axfr_transfer(server, origin, LDNS_RR_CLASS_IN, zonemd_axfr_rr, &l);
+	if (l.hashing && l.apex)
+		zonemd_axfr_start(&l);
+	if (l.hashing) {
+		zonemd_axfr_flush(&l);
+		for (i = 0; i < l.n; i++)
+			bufs[i] = digests[i];
+		digest_tee_final(&l.ctx, bufs);
+		for (i = 0; i < l.n; i++)
+			zonemd_digest_cache_put(s, l.mds[i], bufs[i]);
+		fdebugf(stderr, "%s(%d): %u digests of version %lu calculated during transfer\n", __FILE__, __LINE__, l.n, (unsigned long) s->version);
+	}
+	if (l.apex)
+		ldns_rr_list_deep_free(l.apex);
+	ldns_rr_list_free(l.pending);
+	ldns_buffer_free(l.scratch);
+	if (quiet)
+		return;
+	if (l.hashing)
+		fprintf(stderr, "%u records, digested during transfer\n", l.count);
+	else if (l.why)
+		fprintf(stderr, "%u records, not digested during transfer: %s\n", l.count, l.why);
+	else
+		fprintf(stderr, "%u records\n", l.count);
+}
+
+/*
+ * zonemd_read_fd()
+ *
+ * Read all of 'fd' into memory, for update files that cannot be mapped
+ * (pipes, FIFOs, terminals).  Returns a buffer to free and its length.
+ */
+static char *
+zonemd_read_fd(int fd, const char *file, size_t *ret_len)
+{
+	char *buf = 0;
+	size_t size = 0;
+	size_t len = 0;
+	ssize_t n;
+	for (;;) {
+		if (len == size) {
+			size = size ? size * 2 : 65536;
+			buf = realloc(buf, size);
+			assert(buf);
+		}
+		n = read(fd, buf + len, size - len);
+		if (n < 0)
+			err(1, "%s(%d): %s", __FILE__, __LINE__, file);
+		if (n == 0)
+			break;
+		len += n;
+	}
+	*ret_len = len;
+	return buf;
+}
+
+/*
+ * zonemd_parse_update_line()
+ *
+ * Parse one line of an update file, 'len' bytes at 'p' including the
+ * newline.  Lines of 4096 bytes or more are reported as unparseable.
+ */
+static void
+zonemd_parse_update_line(const char *p, size_t len, update_line *u)
+{
+	char file_buf[4096];
+	char *cmd = 0;
+	char *rr_str = 0;
+	char *save = 0;
+	u->rr = 0;
+	u->op = UPDATE_UNPARSEABLE;
+	if (len >= sizeof(file_buf))
+		return;
+	memcpy(file_buf, p, len);
+	file_buf[len] = 0;
+	cmd = strtok_r(file_buf, " \t", &save);
+	if (cmd == 0)
+		return;
+	rr_str = strtok_r(0, "\r\n", &save);
+	if (rr_str == 0)
+		return;
+	u->status = fastrr_new_frm_str(&u->rr, rr_str, 0, origin);
+	if (u->status != LDNS_STATUS_OK) {
+		u->op = UPDATE_BAD_RR;
+		u->rr = 0;
+	} else if (0 == strcmp(cmd, "add")) {
+		u->op = UPDATE_ADD;
+	} else if (0 == strcmp(cmd, "del")) {
+		u->op = UPDATE_DEL;
+	} else {
+		u->op = UPDATE_BAD_COMMAND;
+		ldns_rr_free(u->rr);
+		u->rr = 0;
+	}
+}
+
+static void *
+zonemd_parse_update_worker(void *arg)
+{
+	parse_job *job = arg;
+	const char *p = job->first;
+	size_t size = 0;
+	while (p < job->last) {
+		const char *nl = memchr(p, '\n', job->last - p);
+		const char *end = nl ? nl + 1 : job->last;
+		if (job->count == size) {
+			size = size ? size * 2 : 1024;
+			job->lines = realloc(job->lines, size * sizeof(*job->lines));
+			assert(job->lines);
+		}
+		zonemd_parse_update_line(p, end - p, &job->lines[job->count++]);
+		p = end;
+	}
+	return 0;
+}
+
 /*
  * zonemd_zone_update()
  *
@@ -658,58 +1536,128 @@ zonemd_read_zone(const char *origin_str, FILE * fp, uint32_t ttl, ldns_rr_class
  * del example. IN A 1.2.3.4
  * add example. IN A 2.3.4.5
  *
+ * The file is mapped into memory (or, if it is not a regular file,
+ * read into it) and cut at line boundaries into chunks that are parsed
+ * on threads of their own.  The parsed lines
+ * are then staged, and any problems reported, in file order.
+ *
+ * The whole file is staged as one batch and only its net changes are
+ * applied, so RRs that are added and deleted again within the file
+ * leave the zone, and the digest state of their leaves, alone.
  */
 void
-zonemd_zone_update(const char *update_file)
+zonemd_zone_update(scheme *s, const char *update_file)
 {
-	ldns_status status;
-	char file_buf[4096];
-	unsigned int n_add = 0;
-	unsigned int n_del = 0;
+	parse_job jobs[MAX_PARSE_THREADS];
+	unsigned int nthreads;
 	unsigned int line = 0;
-	FILE *fp;
+	update_batch *batch;
+	ldns_rr_list *dels;
+	ldns_rr_list *adds;
+	size_t n_del = 0;
+	size_t n_add;
+	size_t cancelled;
+	const char *map = 0;
+	char *buf = 0;
+	size_t size = 0;
+	struct stat sb;
+	size_t i;
+	size_t j;
+	int fd;
 
-	fp = fopen(update_file, "r");
-	if (!fp)
+	fd = open(update_file, O_RDONLY);
+	if (fd < 0)
+		err(1, "%s(%d): %s", __FILE__, __LINE__, update_file);
+	if (fstat(fd, &sb) < 0)
 		err(1, "%s(%d): %s", __FILE__, __LINE__, update_file);
+	if (!S_ISREG(sb.st_mode)) {
+		map = buf = zonemd_read_fd(fd, update_file, &size);
+	} else if (sb.st_size > 0) {
+		size = sb.st_size;
+		map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			err(1, "%s(%d): mmap %s", __FILE__, __LINE__, update_file);
+		madvise((void *) map, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
 
 	if (!quiet)
 		fprintf(stderr, "Updating Zone...");
-	while (fgets(file_buf, sizeof(file_buf), fp)) {
-		line++;
-		char *cmd = 0;
-		char *rr_str = 0;
-		ldns_rr *rr = 0;
-		cmd = strtok(file_buf, " \t");
-		if (cmd == 0) {
-			warnx("%s(%d): zonemd_zone_update: %s line %u unparseable input", __FILE__, __LINE__, update_file, line);
-			continue;
+	nthreads = zonemd_thread_count(size, PARSE_MIN_PER_THREAD, "ZONEMD_PARSE_MIN_PER_THREAD", MAX_PARSE_THREADS);
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < nthreads; i++) {
+		const char *cut = map + size * (i + 1) / nthreads;
+		jobs[i].first = i ? jobs[i - 1].last : map;
+		if (cut < jobs[i].first)
+			cut = jobs[i].first;
+		if (i + 1 < nthreads) {
+			const char *nl = memchr(cut, '\n', map + size - cut);
+			cut = nl ? nl + 1 : map + size;
 		}
-		rr_str = strtok(0, "\r\n");
-		if (rr_str == 0) {
-			warnx("%s(%d): zonemd_zone_update: %s line %u unparseable input", __FILE__, __LINE__, update_file, line);
-			continue;
+		jobs[i].last = cut;
+	}
+	if (nthreads == 1) {
+		zonemd_parse_update_worker(&jobs[0]);
+	} else {
+		fdebugf(stderr, "%s(%d): parsing %s with %u threads\n", __FILE__, __LINE__, update_file, nthreads);
+		for (i = 0; i < nthreads; i++)
+			if (pthread_create(&jobs[i].thread, 0, zonemd_parse_update_worker, &jobs[i]) != 0)
+				errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(jobs[i].thread, 0);
+	}
+	if (buf)
+		free(buf);
+	else if (map)
+		munmap((void *) map, size);
+
+	batch = update_batch_new(s->dedup, update_file);
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; j < jobs[i].count; j++) {
+			update_line *u = &jobs[i].lines[j];
+			line++;
+			switch (u->op) {
+			case UPDATE_ADD:
+				update_batch_stage(batch, true, u->rr, line);
+				break;
+			case UPDATE_DEL:
+				update_batch_stage(batch, false, u->rr, line);
+				break;
+			case UPDATE_UNPARSEABLE:
+				update_batch_warn(batch, line, "unparseable input");
+				break;
+			case UPDATE_BAD_COMMAND:
+				update_batch_warn(batch, line, "expected 'add' or 'del'");
+				break;
+			case UPDATE_BAD_RR:
+				errx(1, "%s(%d): fastrr_new_frm_str: %s", __FILE__, __LINE__, ldns_get_errorstr_by_id(u->status));
+			}
 		}
-		status = ldns_rr_new_frm_str(&rr, rr_str, 0, origin, 0);
-		if (status != LDNS_STATUS_OK)
-			errx(1, "%s(%d): ldns_rr_new_frm_str: %s", __FILE__, __LINE__, ldns_get_errorstr_by_id(status));
-		if (0 == strcmp(cmd, "add")) {
-			zonemd_add_rr(rr);
-			n_add++;
-		} else if (0 == strcmp(cmd, "del")) {
+		free(jobs[i].lines);
+	}
+
+	dels = ldns_rr_list_new();
+	adds = ldns_rr_list_new();
+	assert(dels);
+	assert(adds);
+	cancelled = update_batch_net(batch, dels, adds);
+	update_batch_free(batch);
+	for (i = 0; i < ldns_rr_list_rr_count(dels); i++) {
+		if (zonemd_del_rr(s, ldns_rr_list_rr(dels, i)))
 			n_del++;
-		} else {
-			warnx("%s(%d): zonemd_zone_update: %s line %u expected 'add' or 'del'", __FILE__, __LINE__, update_file, line);
-			continue;
-		}
+		else
+			warnx("%s(%d): zonemd_zone_update: %s RR to delete not found", __FILE__, __LINE__, update_file);
 	}
-	fclose(fp);
+	ldns_rr_list_deep_free(dels);
+	n_add = ldns_rr_list_rr_count(adds);
+	zonemd_add_rr_list(s, adds);
+	ldns_rr_list_free(adds);
 	if (!quiet)
-		fprintf(stderr, "%u additions, %u deletions\n", n_add, n_del);
+		fprintf(stderr, "%zu additions, %zu deletions, %zu cancelled\n", n_add, n_del, cancelled);
 }
 
 bool
-supported_scheme(uint8_t scheme, const char *file, const int line, bool is_fatal)
+supported_scheme(const scheme *s, uint8_t scheme, const char *file, const int line, bool is_fatal)
 {
 	const char *msg = "bug";
 	switch(scheme) {
@@ -718,7 +1666,8 @@ supported_scheme(uint8_t scheme, const char *file, const int line, bool is_fatal
 		break;
 	case 1:
 	case 240:
-		if (the_scheme->scheme == scheme)
+	case 241:
+		if (s->scheme == scheme)
 			return 1;
 		msg = "%s(%d): No in-memory data for scheme %u";
 		break;
@@ -734,45 +1683,77 @@ supported_scheme(uint8_t scheme, const char *file, const int line, bool is_fatal
 }
 
 void
-do_calculate(const char *zsk_fname)
+do_calculate(scheme *s, const char *zsk_fname)
 {
-	ldns_rr_list *zonemd_rr_list = zonemd_rr_find();
+	ldns_rr_list *zonemd_rr_list = zonemd_rr_find(s);
 	unsigned int i;
+	unsigned int n = 0;
+	unsigned int *idx;
+	const EVP_MD **mds;
+	unsigned char **bufs;
 	if (!zonemd_rr_list || 0 == ldns_rr_list_rr_count(zonemd_rr_list))
 		errx(1, "%s(%d): No %s record found at zone apex.  Use -p to add one.", __FILE__, __LINE__, RRNAME);
+	idx = calloc(ldns_rr_list_rr_count(zonemd_rr_list), sizeof(*idx));
+	mds = calloc(ldns_rr_list_rr_count(zonemd_rr_list), sizeof(*mds));
+	bufs = calloc(ldns_rr_list_rr_count(zonemd_rr_list), sizeof(*bufs));
+	assert(idx);
+	assert(mds);
+	assert(bufs);
 	for (i = 0; i < ldns_rr_list_rr_count(zonemd_rr_list); i++) {
 		uint8_t found_scheme = 0;
 		uint8_t found_hashalg = 0;
-		unsigned char *md_buf = 0;
-		unsigned int md_len = 0;
 		const EVP_MD *md = 0;
 		ldns_rr *zonemd_rr = ldns_rr_list_rr(zonemd_rr_list, i);
 		zonemd_rr_unpack(zonemd_rr, 0, &found_scheme, &found_hashalg, 0, 0);
-		if (!supported_scheme(found_scheme, __FILE__, __LINE__, 0))
+		if (!supported_scheme(s, found_scheme, __FILE__, __LINE__, 0))
 			continue;
 		md = zonemd_digester(found_hashalg, __FILE__, __LINE__, 1);
 		if (0 == md)
 			continue;
-		md_len = EVP_MD_size(md);
-		md_buf = calloc(1, md_len);
-		assert(md_buf);
-		the_scheme->calc(the_scheme, md, md_buf);
-		zonemd_rr_update_digest(zonemd_rr, the_soa_serial, md_buf, md_len);
-		free(md_buf);
+		idx[n] = i;
+		mds[n] = md;
+		bufs[n] = calloc(1, EVP_MD_size(md));
+		assert(bufs[n]);
+		n++;
 	}
+	zonemd_calc_digests(s, n, mds, bufs);
+	/*
+	 * Only now take the apex leaf for writing, so that the digests
+	 * above could still use what was cached for it.  Unsharing keeps
+	 * the order of the list, so 'idx' still applies.
+	 */
+	ldns_rr_list_free(zonemd_rr_list);
+	zonemd_rr_list = zonemd_rr_find_write(s);
+	for (i = 0; i < n; i++) {
+		zonemd_rr_update_digest(s, ldns_rr_list_rr(zonemd_rr_list, idx[i]), s->serial, bufs[i], EVP_MD_size(mds[i]));
+		free(bufs[i]);
+	}
+	free(idx);
+	free(mds);
+	free(bufs);
 	if (zsk_fname)
-		zonemd_resign(zonemd_rr_list, zsk_fname);
+		zonemd_resign(s, zonemd_rr_list, zsk_fname);
 	ldns_rr_list_free(zonemd_rr_list);
 }
 
 int
-do_verify(void)
+do_verify(const scheme *s)
 {
 	int rc = 1;
-	ldns_rr_list *zonemd_rr_list = zonemd_rr_find();
+	ldns_rr_list *zonemd_rr_list = zonemd_rr_find(s);
 	unsigned int i;
+	unsigned int n = 0;
+	ldns_rr **rrs;
+	const EVP_MD **mds;
+	unsigned char **bufs;
 	if (!zonemd_rr_list)
 		errx(1, "%s(%d): No %s record found at zone apex, cannot verify.", __FILE__, __LINE__, RRNAME);
+	rrs = calloc(ldns_rr_list_rr_count(zonemd_rr_list) + 1, sizeof(*rrs));
+	mds = calloc(ldns_rr_list_rr_count(zonemd_rr_list) + 1, sizeof(*mds));
+	bufs = calloc(ldns_rr_list_rr_count(zonemd_rr_list) + 1, sizeof(*bufs));
+	assert(rrs);
+	assert(mds);
+	assert(bufs);
 	for (i = 0; i < ldns_rr_list_rr_count(zonemd_rr_list); i++) {
 		uint8_t found_scheme;
 		uint8_t found_hashalg;
@@ -780,19 +1761,17 @@ do_verify(void)
 		unsigned int found_digest_len = EVP_MAX_MD_SIZE;
 		uint32_t found_serial = 0;
 		const EVP_MD *md = 0;
-		unsigned char *md_buf = 0;
-		unsigned int md_len = 0;
 		ldns_rr *zonemd_rr = ldns_rr_list_rr(zonemd_rr_list, i);
 		zonemd_rr_unpack(zonemd_rr, &found_serial, &found_scheme, &found_hashalg, found_digest_buf, &found_digest_len);
 		if (found_digest_len < 12) {
 			fprintf(stderr, "Ignoring digest of size %u, smaller than the minimum length 12\n", found_digest_len);
 			continue;
 		}
-		if (found_serial != the_soa_serial) {
-			fprintf(stderr, "%s(%d): SOA serial (%u) does not match ZONEMD serial (%u)\n", __FILE__, __LINE__, the_soa_serial, found_serial);
+		if (found_serial != s->serial) {
+			fprintf(stderr, "%s(%d): SOA serial (%u) does not match ZONEMD serial (%u)\n", __FILE__, __LINE__, s->serial, found_serial);
 			continue;
 		}
-		if (!supported_scheme(found_scheme, __FILE__, __LINE__, 0))
+		if (!supported_scheme(s, found_scheme, __FILE__, __LINE__, 0))
 			continue;
 		md = zonemd_digester(found_hashalg, __FILE__, __LINE__, 1);
 		if (md == 0) {
@@ -804,25 +1783,183 @@ do_verify(void)
 			continue;
 		}
 		assert(EVP_MD_size(md) <= (int) sizeof(found_digest_buf));
-		md_len = EVP_MD_size(md);
-		md_buf = calloc(1, md_len);
-		assert(md_buf);
-		the_scheme->calc(the_scheme, md, md_buf);
-		if (memcmp(found_digest_buf, md_buf, md_len) != 0) {
+		rrs[n] = zonemd_rr;
+		mds[n] = md;
+		bufs[n] = calloc(1, EVP_MD_size(md));
+		assert(bufs[n]);
+		n++;
+	}
+	zonemd_calc_digests(s, n, mds, bufs);
+	for (i = 0; i < n; i++) {
+		uint8_t found_scheme;
+		uint8_t found_hashalg;
+		unsigned char found_digest_buf[EVP_MAX_MD_SIZE];
+		unsigned int found_digest_len = EVP_MAX_MD_SIZE;
+		unsigned int md_len = EVP_MD_size(mds[i]);
+		zonemd_rr_unpack(rrs[i], 0, &found_scheme, &found_hashalg, found_digest_buf, &found_digest_len);
+		if (memcmp(found_digest_buf, bufs[i], md_len) != 0) {
 			fprintf(stderr, "Found and calculated digests for scheme:hashalg %u:%u do NOT match.\n", found_scheme, found_hashalg);
 			zonemd_print_digest(stderr, "Found     : ", found_digest_buf, md_len, "\n");
-			zonemd_print_digest(stderr, "Calculated: ", md_buf, md_len, "\n");
+			zonemd_print_digest(stderr, "Calculated: ", bufs[i], md_len, "\n");
 		} else {
 			if (!quiet)
 				fprintf(stderr, "Found and calculated digests for scheme:hashalg %u:%u do MATCH.\n", found_scheme, found_hashalg);
 			rc = 0;
 		}
-		free(md_buf);
+		free(bufs[i]);
 	}
+	free(rrs);
+	free(mds);
+	free(bufs);
 	ldns_rr_list_free(zonemd_rr_list);
 	return rc;
 }
 
+/*
+ * zonemd_background()
+ *
+ * Thread body for digesting, signing and writing out a snapshot of
+ * the zone while the main thread applies the next batch of updates.
+ */
+static void *
+zonemd_background(void *arg)
+{
+	background_job *job = arg;
+	do_calculate(job->s, job->zsk_fname);
+	if (job->output_file)
+		zonemd_write_zone(job->s, job->output_file);
+	job->s->free(job->s);
+	job->s = 0;
+	return 0;
+}
+
+/*
+ * do_report()
+ *
+ * Calculate and print the ZONEMD records of a retained serial.  The
+ * retained version itself is left untouched.
+ */
+int
+do_report(uint32_t serial)
+{
+	const scheme *v = zonemd_versions_find(serial);
+	scheme *s;
+	ldns_rr_list *zonemd_rr_list;
+	unsigned int i;
+	if (v == 0) {
+		warnx("%s(%d): Serial %u is not retained (see -k)", __FILE__, __LINE__, serial);
+		return 1;
+	}
+	s = v->snap(v);
+	do_calculate(s, 0);
+	zonemd_rr_list = zonemd_rr_find(s);
+	for (i = 0; i < ldns_rr_list_rr_count(zonemd_rr_list); i++)
+		ldns_rr_print_fmt(stdout, ldns_rr_output_fmt, ldns_rr_list_rr(zonemd_rr_list, i));
+	ldns_rr_list_free(zonemd_rr_list);
+	s->free(s);
+	return 0;
+}
+
+static void
+zonemd_diff_cb(const ldns_rr *rr, bool added, const void *cb_data)
+{
+	FILE *fp = (void *) cb_data;
+	fputs(added ? "add " : "del ", fp);
+	ldns_rr_print_fmt(fp, ldns_rr_output_fmt, rr);
+}
+
+/*
+ * do_diff()
+ *
+ * Print the changes between two retained serials, in the same format
+ * that -u reads.
+ */
+int
+do_diff(uint32_t from, uint32_t to)
+{
+	const scheme *a = zonemd_versions_find(from);
+	const scheme *b = zonemd_versions_find(to);
+	if (a == 0 || b == 0) {
+		warnx("%s(%d): Serial %u is not retained (see -k)", __FILE__, __LINE__, a ? to : from);
+		return 1;
+	}
+	a->diff(a, b, zonemd_diff_cb, stdout);
+	return 0;
+}
+
+typedef struct {
+	ldns_rr_list *dels;
+	ldns_rr_list *adds;
+	const ldns_rr *old_soa;
+	const ldns_rr *new_soa;
+} ixfr_changes;
+
+static void
+zonemd_ixfr_cb(const ldns_rr *rr, bool added, const void *cb_data)
+{
+	ixfr_changes *c = (void *) cb_data;
+	if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_SOA && canon_dname_equal(ldns_rr_owner(rr), origin)) {
+		if (added)
+			c->new_soa = rr;
+		else
+			c->old_soa = rr;
+		return;
+	}
+	ldns_rr_list_push_rr(added ? c->adds : c->dels, (ldns_rr *) rr);
+}
+
+/*
+ * do_ixfr()
+ *
+ * Write the changes from 'from' to 'to' as the answer section of an
+ * IXFR response, in presentation format:  the new SOA, the old SOA
+ * followed by the deleted RRs, the new SOA followed by the added RRs,
+ * and the new SOA again.  If nothing changed only the SOA is written.
+ * A new serial comes with new ZONEMD records (and their signatures),
+ * so those are part of the difference.
+ */
+void
+do_ixfr(const scheme *from, const scheme *to, const char *ixfr_file)
+{
+	const ldns_rr *old_soa;
+	const ldns_rr *new_soa;
+	ixfr_changes c;
+	unsigned int i;
+	FILE *fp;
+
+	fp = zio_fopen(ixfr_file, "w");
+	if (fp == 0)
+		err(1, "%s(%d): %s", __FILE__, __LINE__, ixfr_file);
+	memset(&c, 0, sizeof(c));
+	c.dels = ldns_rr_list_new();
+	c.adds = ldns_rr_list_new();
+	assert(c.dels);
+	assert(c.adds);
+	from->diff(from, to, zonemd_ixfr_cb, &c);
+	/*
+	 * An SOA missing from the difference is the same in both
+	 * versions.
+	 */
+	new_soa = c.new_soa ? c.new_soa : zonemd_soa_find(to);
+	old_soa = c.old_soa ? c.old_soa : new_soa;
+	ldns_rr_print_fmt(fp, ldns_rr_output_fmt, new_soa);
+	if (old_soa != new_soa || ldns_rr_list_rr_count(c.dels) || ldns_rr_list_rr_count(c.adds)) {
+		ldns_rr_print_fmt(fp, ldns_rr_output_fmt, old_soa);
+		for (i = 0; i < ldns_rr_list_rr_count(c.dels); i++)
+			ldns_rr_print_fmt(fp, ldns_rr_output_fmt, ldns_rr_list_rr(c.dels, i));
+		ldns_rr_print_fmt(fp, ldns_rr_output_fmt, new_soa);
+		for (i = 0; i < ldns_rr_list_rr_count(c.adds); i++)
+			ldns_rr_print_fmt(fp, ldns_rr_output_fmt, ldns_rr_list_rr(c.adds, i));
+		ldns_rr_print_fmt(fp, ldns_rr_output_fmt, new_soa);
+	}
+	if (!quiet)
+		fprintf(stderr, "Wrote %u deletions and %u additions to %s\n",
+		    (unsigned int) ldns_rr_list_rr_count(c.dels), (unsigned int) ldns_rr_list_rr_count(c.adds), ixfr_file);
+	ldns_rr_list_free(c.dels);
+	ldns_rr_list_free(c.adds);
+	fclose(fp);
+}
+
 void
 probe_ldns(const char *origin_str)
 {
@@ -846,7 +1983,14 @@ main(int argc, char *argv[])
 	FILE *input = stdin;
 	char *progname = 0;
 	char *output_file = 0;
-	char *update_file = 0;
+	char *ixfr_file = 0;
+	char *axfr_server = 0;
+	scheme *ixfr_base = 0;
+	char *update_files[MAX_UPDATE_COUNT];
+	unsigned int update_cnt = 0;
+	background_job jobs[MAX_UPDATE_COUNT];
+	unsigned int job_cnt = 0;
+	unsigned int i;
 	char *origin_str = 0;
 	char *zsk_fname = 0;
 	uint8_t opt_scheme = 1;
@@ -854,7 +1998,15 @@ main(int argc, char *argv[])
 	unsigned int placeholder_cnt = 0;
 	int calculate = 0;
 	int verify = 0;
+	int validate = 0;
+	unsigned int validate_threads = 0;
 	int print_timings = 0;
+	unsigned int keep_versions = 0;
+	int report = 0;
+	uint32_t report_serial = 0;
+	int diff = 0;
+	uint32_t diff_from = 0;
+	uint32_t diff_to = 0;
 	int rc = 0;
 	struct timeval t0, t1, t2, t3, t4;
 
@@ -862,19 +2014,44 @@ main(int argc, char *argv[])
 	if (0 == progname)
 		progname = argv[0];
 	memset(placeholders, 0, sizeof(placeholders));
+	memset(jobs, 0, sizeof(jobs));
 
 	OpenSSL_add_all_digests();
 
 	ldns_rr_output_fmt = ldns_output_format_init(&ldns_rr_output_fmt_storage);
 
-	while ((ch = getopt(argc, argv, "cgo:p:qs:tu:vz:")) != -1) {
+	while ((ch = getopt(argc, argv, "a:b:cdfgi:j:k:no:p:qr:S:s:tu:vx:z:")) != -1) {
 		switch (ch) {
+		case 'a':
+			axfr_server = strdup(optarg);
+			break;
+		case 'b':
+			digest_use_backend(optarg);
+			break;
 		case 'c':
 			calculate = 1;
 			break;
+		case 'd':
+			validate = 1;
+			break;
+		case 'f':
+			use_zscan = 1;
+			break;
 		case 'g':
 			ldns_output_format_set_type(ldns_rr_output_fmt, ZONEMD_RR_TYPE);
 			break;
+		case 'i':
+			ixfr_file = strdup(optarg);
+			break;
+		case 'j':
+			validate_threads = (unsigned int) strtoul(optarg, 0, 10);
+			break;
+		case 'k':
+			keep_versions = (unsigned int) strtoul(optarg, 0, 10);
+			break;
+		case 'n':
+			merkle_tree_numa = 1;
+			break;
 		case 'o':
 			output_file = strdup(optarg);
 			break;
@@ -899,6 +2076,13 @@ main(int argc, char *argv[])
 		case 'q':
 			quiet = 1;
 			break;
+		case 'r':
+			report = 1;
+			report_serial = (uint32_t) strtoul(optarg, 0, 10);
+			break;
+		case 'S':
+			canon_sort_threads = (unsigned int) strtoul(optarg, 0, 10);
+			break;
 		case 's':
 			opt_scheme = (uint8_t) strtoul(optarg, 0, 10);
 			break;
@@ -906,11 +2090,32 @@ main(int argc, char *argv[])
 			print_timings = 1;
 			break;
 		case 'u':
-			update_file = strdup(optarg);
+			if (update_cnt < MAX_UPDATE_COUNT)
+				update_files[update_cnt++] = strdup(optarg);
+			else
+				warnx("%s(%d): too many -u files, ignoring %s", __FILE__, __LINE__, optarg);
 			break;
 		case 'v':
 			verify = 1;
 			break;
+		case 'x':
+			{
+				char *p;
+				p = strtok(optarg, ":,");
+				if (0 == p) {
+					warnx("%s(%d): bad -x arg", __FILE__, __LINE__);
+					usage(progname);
+				}
+				diff_from = (uint32_t) strtoul(p, 0, 10);
+				p = strtok(0, "");
+				if (0 == p) {
+					warnx("%s(%d): bad -x arg", __FILE__, __LINE__);
+					usage(progname);
+				}
+				diff_to = (uint32_t) strtoul(p, 0, 10);
+				diff = 1;
+			}
+			break;
 		case 'z':
 			zsk_fname = strdup(optarg);
 			break;
@@ -920,11 +2125,15 @@ main(int argc, char *argv[])
 	}
 	argc -= optind;
 	argv += optind;
-	if (argc < 1 || argc > 2)
+	if (argc < 1 || argc > (axfr_server ? 1 : 2))
 		usage(progname);
+	if (ixfr_file && update_cnt == 0) {
+		warnx("%s(%d): -i needs at least one -u file", __FILE__, __LINE__);
+		usage(progname);
+	}
 	origin_str = strdup(argv[0]);
 	if (argc == 2) {
-		input = fopen(argv[1], "r");
+		input = zio_fopen(argv[1], "r");
 		if (0 == input)
 			err(1, "%s(%d): %s", __FILE__, __LINE__, argv[1]);
 	}
@@ -933,8 +2142,6 @@ main(int argc, char *argv[])
 
 	my_getrusage(&t0);
 
-
-
 	switch (opt_scheme) {
 	case 1:
 		the_scheme = scheme_simple_new(opt_scheme);
@@ -942,31 +2149,87 @@ main(int argc, char *argv[])
 	case 240:
 		the_scheme = scheme_merkle_new(opt_scheme);
 		break;
+	case 241:
+		the_scheme = scheme_btree_new(opt_scheme);
+		break;
 	default:
 		errx(1, "%s(%d): Unsupported scheme %u", __FILE__, __LINE__, opt_scheme);
 		break;
 	}
-	zonemd_read_zone(origin_str, input, 0, LDNS_RR_CLASS_IN);
-        fclose(input);
-        input = 0;
+	the_scheme->dedup = rrhash_new();
+	zonemd_versions_init(keep_versions);
+	if (axfr_server) {
+		zonemd_axfr_read_zone(the_scheme, origin_str, axfr_server, placeholders, placeholder_cnt);
+	} else {
+		zonemd_read_zone(the_scheme, origin_str, input, 0, LDNS_RR_CLASS_IN);
+		fclose(input);
+		input = 0;
+	}
 
 	if (placeholder_cnt)
-		zonemd_add_placeholders(placeholders, placeholder_cnt);
+		zonemd_add_placeholders(the_scheme, placeholders, placeholder_cnt);
+	if (merkle_tree_numa && the_scheme->scheme == 240)
+		scheme_merkle_numa_place(the_scheme);
+	zonemd_versions_retain(the_scheme);
 	my_getrusage(&t1);
+	if (validate) {
+		if (validate_threads == 0)
+			validate_threads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+		zonemd_validate_start(the_scheme, origin, (placeholder_cnt || calculate) ? ZONEMD_RR_TYPE : 0, validate_threads);
+	}
 	if (calculate)
-		do_calculate(zsk_fname);
+		do_calculate(the_scheme, zsk_fname);
 	my_getrusage(&t2);
 	if (verify)
-		rc |= do_verify();
+		rc |= do_verify(the_scheme);
+	if (validate)
+		rc |= zonemd_validate_finish();
 	my_getrusage(&t3);
-	if (update_file) {
-		zonemd_zone_update(update_file);
-		if (calculate)
-			do_calculate(zsk_fname);
+	if (ixfr_file && update_cnt)
+		ixfr_base = the_scheme->snap(the_scheme);
+	for (i = 0; i < update_cnt; i++) {
+		zonemd_zone_update(the_scheme, update_files[i]);
+		zonemd_versions_retain(the_scheme);
+		if (!calculate)
+			continue;
+		if (i + 1 == update_cnt) {
+			do_calculate(the_scheme, zsk_fname);
+			continue;
+		}
+		/*
+		 * Intermediate versions are digested (and written to
+		 * output_file.N) on a snapshot while the next batch is
+		 * applied to the live zone.
+		 */
+		background_job *job = &jobs[job_cnt++];
+		job->s = the_scheme->snap(the_scheme);
+		job->zsk_fname = zsk_fname;
+		if (output_file) {
+			size_t len = strlen(output_file) + 12;
+			job->output_file = malloc(len);
+			assert(job->output_file);
+			snprintf(job->output_file, len, "%s.%u", output_file, i + 1);
+		}
+		if (pthread_create(&job->thread, 0, zonemd_background, job) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	}
+	for (i = 0; i < job_cnt; i++) {
+		pthread_join(jobs[i].thread, 0);
+		free(jobs[i].output_file);
+	}
+	if (ixfr_base) {
+		scheme *ixfr_last = the_scheme->snap(the_scheme);
+		do_ixfr(ixfr_base, ixfr_last, ixfr_file);
+		ixfr_last->free(ixfr_last);
+		ixfr_base->free(ixfr_base);
 	}
 	my_getrusage(&t4);
+	if (report)
+		rc |= do_report(report_serial);
+	if (diff)
+		rc |= do_diff(diff_from, diff_to);
 	if (output_file && (placeholder_cnt || calculate)) {
-		zonemd_write_zone(output_file);
+		zonemd_write_zone(the_scheme, output_file);
 	}
 
 	if (zsk_fname)
@@ -975,9 +2238,16 @@ main(int argc, char *argv[])
 		free(origin_str);
 	if (output_file)
 		free(output_file);
-	if (update_file)
-		free(update_file);
+	if (ixfr_file)
+		free(ixfr_file);
+	if (axfr_server)
+		free(axfr_server);
+	for (i = 0; i < update_cnt; i++)
+		free(update_files[i]);
+	zonemd_versions_free();
+	rrhash_free(the_scheme->dedup);
 	the_scheme->free(the_scheme);
+	ldns_rr_free(the_soa);
 
 	if (print_timings)
 		printf("TIMINGS: load %7.2lf calculate %7.2lf verify %7.2lf update %7.2lf\n",
@@ -985,6 +2255,14 @@ main(int argc, char *argv[])
 			elapsed_msec(&t1, &t2),
 			elapsed_msec(&t2, &t3),
 			elapsed_msec(&t3, &t4));
+	if (print_timings)
+		printf("SHA-512 block function: %s\n", sha512_impl_name());
+	if (print_timings) {
+		unsigned long built;
+		unsigned long reused;
+		cow_wire_stats(&built, &reused);
+		printf("Leaf wire forms: %lu built, %lu reused\n", built, reused);
+	}
 
 	return rc;
 }
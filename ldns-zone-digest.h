@@ -7,24 +7,59 @@
 #endif
 
 
-void zonemd_rrlist_digest(ldns_rr_list *rrlist, EVP_MD_CTX *ctx);
+struct _rr_meta *zonemd_rrlist_meta(const ldns_rr_list *rrlist);
+uint8_t *zonemd_rrlist_wire(const ldns_rr_list *rrlist, const struct _rr_meta *meta, size_t *ret_len);
 void zonemd_print_digest(FILE *fp, const char *preamble, const unsigned char *buf, unsigned int len, const char *postamble);
 
 typedef struct _scheme scheme;
 
+#define SCHEME_SPAN_MAX 256
+
 typedef void (*scheme_iterate_cb)(const ldns_rr *, const void *scheme_iterate_data);
+typedef void (*scheme_span_cb)(const ldns_rr *const *rrs, size_t count, const void *scheme_span_data);
+typedef void (*scheme_diff_cb)(const ldns_rr *, bool added, const void *scheme_diff_data);
 
 typedef scheme *(scheme_new)(uint8_t);
 typedef ldns_rr_list *(scheme_get_leaf_rr_list)(const struct _scheme *, const ldns_rr *for_rr);
+typedef struct _cow_rrlist *(scheme_get_leaf_ro)(const struct _scheme *, const ldns_rr *for_rr);
+typedef void (scheme_insert)(const struct _scheme *, ldns_rr *);
 typedef void (scheme_calc_digest)(const struct _scheme *, const EVP_MD * md, unsigned char *buf);
+typedef void (scheme_calc_digests)(const struct _scheme *, unsigned int n, const EVP_MD *const *mds, unsigned char *const *bufs);
 typedef void (scheme_iterate)(const struct _scheme *, scheme_iterate_cb, const void *scheme_iterate_data);
+typedef void (scheme_span)(const struct _scheme *, scheme_span_cb, const void *scheme_span_data);
+typedef scheme *(scheme_snapshot)(const struct _scheme *);
+typedef void (scheme_diff)(const struct _scheme *, const struct _scheme *, scheme_diff_cb, const void *scheme_diff_data);
 typedef void (scheme_free)(struct _scheme *);
 
+/*
+ * A scheme instance holds one version of the zone.  'leaf' returns a
+ * list that the caller may modify; 'leaf_ro' returns the leaf that holds
+ * it, sorted, for reading only (NULL if there is none), without
+ * unsharing it or marking anything dirty; 'insert', if not NULL, adds an
+ * RR and may be called from several threads at once (but not together
+ * with any other callback); 'calc_multi', if not NULL, calculates
+ * several digests in one pass over the data; 'span' visits the same RRs
+ * as 'iter', in the same order, but hands them over as arrays of at most
+ * SCHEME_SPAN_MAX; 'snap' returns a copy-on-write version that can be
+ * digested on another thread while this one is being updated; 'diff'
+ * reports the RRs that differ between two versions of the same scheme,
+ * skipping the leaves they share.  Two instances with the same 'version'
+ * hold the same digested data.
+ */
 struct _scheme {
 	uint8_t scheme;
 	scheme_get_leaf_rr_list *leaf;
+	scheme_get_leaf_ro *leaf_ro;
+	scheme_insert *insert;
 	scheme_calc_digest *calc;
+	scheme_calc_digests *calc_multi;
 	scheme_iterate *iter;
+	scheme_span *span;
+	scheme_snapshot *snap;
+	scheme_diff *diff;
 	scheme_free *free;
 	void *data;
+	uint32_t serial;		/* SOA serial of this version */
+	uint64_t version;		/* changes whenever digested data does */
+	struct _rrhash *dedup;		/* live version only, else NULL */
 };
@@ -1,24 +1,67 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <err.h>
+#include <pthread.h>
 #include <ldns/ldns.h>
 
 #include "ldns-zone-digest.h"
+#include "cow.h"
+#include "sha512.h"
+#include "digest.h"
 #include "merkle.h"
+#include "numa.h"
+
+/*
+ * A node caches its digest for up to MERKLE_DIGEST_SLOTS algorithms.
+ * A slot is valid while its 'gen' equals the node's, which every change
+ * below the node increments.
+ */
+#define MERKLE_DIGEST_SLOTS 4
+typedef struct {
+	const EVP_MD *md;
+	unsigned int gen;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+} merkle_digest;
 
 typedef struct _merkle_tree
 {
 	unsigned int depth;
 	char branch_str[128];
-	ldns_rr_list *rrlist;
+	cow_rrlist *leaf;
+	struct _merkle_pending *pending;	/* leaf RRs not yet merged */
 	struct _merkle_tree *parent;	// not used currently
 	struct _merkle_tree **kids;
-	unsigned char digest[EVP_MAX_MD_SIZE];
-	bool dirty;
+	merkle_digest digests[MERKLE_DIGEST_SLOTS];
+	unsigned int gen;
+	bool dirty;			/* changed since last merged/digested */
 } merkle_tree;
 
+/*
+ * RRs added with scheme_merkle_insert() are pushed onto a lock-free
+ * stack on their leaf and moved into the leaf's list by
+ * merkle_tree_merge_sub() before the tree is otherwise used.
+ */
+typedef struct _merkle_pending {
+	struct _merkle_pending *next;
+	ldns_rr *rr;
+} merkle_pending;
+
 unsigned int merkle_tree_max_width = 13;
 unsigned int merkle_tree_max_depth = 7;
+int merkle_tree_numa = 0;
+
+/*
+ * One hashing thread per top-level branch, used with merkle_tree_numa.
+ */
+typedef struct {
+	const scheme *s;
+	merkle_tree *node;
+	const EVP_MD *md;		/* NULL to place the branch's RRs instead */
+	unsigned int slot;
+	unsigned int numa_node;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	pthread_t thread;
+} merkle_worker;
 
 #if ZONEMD_SAVE_LEAF_COUNTS
 FILE *save_leaf_counts = 0;
@@ -50,39 +93,162 @@ merkle_tree_branch_by_name(unsigned int depth, const char *name)
 	return branch;
 }
 
+static merkle_tree *
+merkle_tree_new_kid(merkle_tree * node, unsigned int branch)
+{
+	merkle_tree *kid = calloc(1, sizeof(*kid));
+	assert(kid);
+	kid->depth = node->depth + 1;
+	kid->parent = node;
+	if (node->depth == 0)
+		snprintf(kid->branch_str, sizeof(kid->branch_str), "%u", branch);
+	else
+		snprintf(kid->branch_str, sizeof(kid->branch_str), "%s %u", node->branch_str, branch);
+	return kid;
+}
+
 /*
  * merkle_tree_get_leaf_by_name()
  *
- * Return the leaf node corresponding to the given name
+ * Return the leaf node corresponding to the given name.  Missing kids
+ * are created with compare-and-swap, so several threads may call this
+ * at once; the loser of a race frees its copy and uses the winner's.
  */
 static merkle_tree *
 merkle_tree_get_leaf_by_name_sub(const scheme *s, merkle_tree * node, const char *name)
 {
-	node->dirty = true;
+	__atomic_store_n(&node->dirty, true, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&node->gen, 1, __ATOMIC_RELAXED);
 	if (merkle_tree_max_depth > node->depth) {
 		unsigned int branch = merkle_tree_branch_by_name(node->depth, name);
-		if (node->kids == 0) {
-			node->kids = calloc(merkle_tree_max_width, sizeof(*node->kids));
-			assert(node->kids);
+		merkle_tree **kids = __atomic_load_n(&node->kids, __ATOMIC_ACQUIRE);
+		merkle_tree *kid;
+		if (kids == 0) {
+			merkle_tree **new_kids = calloc(merkle_tree_max_width, sizeof(*new_kids));
+			assert(new_kids);
+			if (__atomic_compare_exchange_n(&node->kids, &kids, new_kids, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				kids = new_kids;
+			else
+				free(new_kids);
 		}
-		if (node->kids[branch] == 0) {
-			node->kids[branch] = calloc(1, sizeof(**node->kids));
-			assert(node->kids[branch]);
-			node->kids[branch]->depth = node->depth + 1;
-			node->kids[branch]->parent = node;
-			if (node->depth == 0) {
-				snprintf(node->kids[branch]->branch_str, sizeof(node->kids[branch]->branch_str), "%u", branch);
-			} else {
-				char *t = node->branch_str;
-				snprintf(node->kids[branch]->branch_str, sizeof(node->kids[branch]->branch_str), "%s %u", t, branch);
-			}
+		kid = __atomic_load_n(&kids[branch], __ATOMIC_ACQUIRE);
+		if (kid == 0) {
+			merkle_tree *new_kid = merkle_tree_new_kid(node, branch);
+			if (__atomic_compare_exchange_n(&kids[branch], &kid, new_kid, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				kid = new_kid;
+			else
+				free(new_kid);
 		}
-		return merkle_tree_get_leaf_by_name_sub(s, node->kids[branch], name);
+		return merkle_tree_get_leaf_by_name_sub(s, kid, name);
 	}
 	fdebugf(stderr, "%s(%d): merkle_tree_get_leaf '%s' is at %s\n", __FILE__, __LINE__, name, node->branch_str);
 	return node;
 }
 
+/*
+ * merkle_tree_get_leaf_by_rr()
+ *
+ * Return the leaf node for the owner name of 'rr'.
+ */
+static merkle_tree *
+merkle_tree_get_leaf_by_rr(const scheme *s, const ldns_rr * rr)
+{
+	const ldns_rdf *owner;
+	char *name;
+	merkle_tree *leaf;
+	owner = ldns_rr_owner(rr);
+	assert(owner);
+	name = ldns_rdf2str(owner);
+	assert(name);
+	leaf = merkle_tree_get_leaf_by_name_sub(s, s->data, name);
+	assert(leaf);
+	assert(leaf->kids == 0);	/* leaf nodes don't have kids */
+	free(name);
+	return leaf;
+}
+
+/*
+ * merkle_tree_find_leaf_by_rr()
+ *
+ * Like merkle_tree_get_leaf_by_rr(), but only looks:  no node is
+ * created or marked dirty.  Returns NULL if the leaf does not exist.
+ */
+static merkle_tree *
+merkle_tree_find_leaf_by_rr(const scheme *s, const ldns_rr * rr)
+{
+	merkle_tree *node = s->data;
+	char *name = ldns_rdf2str(ldns_rr_owner(rr));
+	assert(name);
+	while (node && merkle_tree_max_depth > node->depth) {
+		merkle_tree **kids = __atomic_load_n(&node->kids, __ATOMIC_ACQUIRE);
+		if (kids == 0)
+			node = 0;
+		else
+			node = __atomic_load_n(&kids[merkle_tree_branch_by_name(node->depth, name)], __ATOMIC_ACQUIRE);
+	}
+	free(name);
+	return node;
+}
+
+/*
+ * merkle_tree_merge_leaf()
+ *
+ * Move the RRs waiting on a leaf's pending stack into its list.  The
+ * list is sorted afterwards so that the result does not depend on the
+ * order in which concurrent inserts happened to land.
+ */
+static void
+merkle_tree_merge_leaf(merkle_tree * node)
+{
+	merkle_pending *p = node->pending;
+	merkle_pending *prev = 0;
+	merkle_pending *next;
+	ldns_rr_list *rrlist;
+	if (p == 0)
+		return;
+	node->pending = 0;
+	while (p) {
+		next = p->next;
+		p->next = prev;
+		prev = p;
+		p = next;
+	}
+	if (node->leaf == 0)
+		node->leaf = cow_rrlist_new();
+	rrlist = cow_rrlist_write(&node->leaf);
+	for (p = prev; p; p = next) {
+		next = p->next;
+		ldns_rr_list_push_rr(rrlist, p->rr);
+		free(p);
+	}
+	(void) cow_rrlist_read(node->leaf);
+}
+
+/*
+ * merkle_tree_merge_sub()
+ *
+ * Merge pending RRs everywhere below 'node', and sort the lists that
+ * changed, so that digesting only reads the tree.  Inserts mark their
+ * path dirty, so clean subtrees are skipped.  Must not run concurrently
+ * with scheme_merkle_insert().
+ */
+static void
+merkle_tree_merge_sub(merkle_tree * node)
+{
+	unsigned int branch;
+	if (node == 0 || !node->dirty)
+		return;
+	if (merkle_tree_max_depth > node->depth) {
+		if (node->kids)
+			for (branch = 0; branch < merkle_tree_max_width; branch++)
+				merkle_tree_merge_sub(node->kids[branch]);
+		return;
+	}
+	merkle_tree_merge_leaf(node);
+	if (node->leaf)
+		(void) cow_rrlist_read(node->leaf);
+}
+
 /*
  * iterate and callback sub
  *
@@ -99,15 +265,35 @@ merkle_tree_iterate_sub(const scheme *s, merkle_tree * node, const scheme_iterat
 			merkle_tree_iterate_sub(s, node->kids[branch], cb, cb_data);
 		return;
 	}
-	for (i = 0; i < ldns_rr_list_rr_count(node->rrlist); i++)
-		cb(ldns_rr_list_rr(node->rrlist, i), cb_data);
+	for (i = 0; i < ldns_rr_list_rr_count(node->leaf->rrlist); i++)
+		cb(ldns_rr_list_rr(node->leaf->rrlist, i), cb_data);
 #if ZONEMD_SAVE_LEAF_COUNTS
 	if (save_leaf_counts) {
-		fprintf(save_leaf_counts, "%zd\n", ldns_rr_list_rr_count(node->rrlist));
+		fprintf(save_leaf_counts, "%zd\n", ldns_rr_list_rr_count(node->leaf->rrlist));
 	}
 #endif
 }
 
+/*
+ * merkle_tree_span_sub()
+ *
+ * Like merkle_tree_iterate_sub(), one leaf at a time.
+ */
+static void
+merkle_tree_span_sub(merkle_tree * node, const scheme_span_cb cb, const void *cb_data)
+{
+	if (node == 0)
+		return;
+	if (merkle_tree_max_depth > node->depth && node->kids) {
+		unsigned int branch;
+		for (branch = 0; branch < merkle_tree_max_width; branch++)
+			merkle_tree_span_sub(node->kids[branch], cb, cb_data);
+		return;
+	}
+	if (node->leaf)
+		cow_rrlist_spans(node->leaf, 0, cb, cb_data);
+}
+
 /*
  * merkle_tree_free_sub()
  *
@@ -126,9 +312,183 @@ merkle_tree_free_sub(scheme *s, merkle_tree * node)
 		}
 		free(node->kids);
 	} else {
-		assert(node->rrlist);
-		ldns_rr_list_deep_free(node->rrlist);
+		assert(node->leaf);
+		cow_rrlist_release(node->leaf);
+	}
+}
+
+/*
+ * merkle_tree_snapshot_sub()
+ *
+ * Copy the interior of the tree.  Leaf RR lists are shared with the
+ * original, copy-on-write, and so are the cached digests of clean nodes.
+ */
+static merkle_tree *
+merkle_tree_snapshot_sub(const merkle_tree * node, merkle_tree * parent)
+{
+	merkle_tree *copy;
+	if (node == 0)
+		return 0;
+	copy = malloc(sizeof(*copy));
+	assert(copy);
+	memcpy(copy, node, sizeof(*copy));
+	copy->parent = parent;
+	if (merkle_tree_max_depth > node->depth && node->kids) {
+		unsigned int branch;
+		copy->kids = calloc(merkle_tree_max_width, sizeof(*copy->kids));
+		assert(copy->kids);
+		for (branch = 0; branch < merkle_tree_max_width; branch++)
+			copy->kids[branch] = merkle_tree_snapshot_sub(node->kids[branch], copy);
+	} else if (node->leaf) {
+		copy->leaf = cow_rrlist_share(node->leaf);
+	}
+	return copy;
+}
+
+/*
+ * merkle_tree_diff_sub()
+ *
+ * Walk two versions of the tree side by side.  Either node may be
+ * missing; only leaves whose lists are not shared are compared.
+ */
+static void
+merkle_tree_diff_sub(const merkle_tree * a, const merkle_tree * b, const scheme_diff_cb cb, const void *cb_data)
+{
+	const merkle_tree *n = a ? a : b;
+	if (n == 0)
+		return;
+	if (merkle_tree_max_depth > n->depth) {
+		unsigned int branch;
+		for (branch = 0; branch < merkle_tree_max_width; branch++)
+			merkle_tree_diff_sub(a && a->kids ? a->kids[branch] : 0, b && b->kids ? b->kids[branch] : 0, cb, cb_data);
+		return;
 	}
+	cow_rrlist_diff(a ? a->leaf : 0, b ? b->leaf : 0, cb, cb_data);
+}
+
+/*
+ * merkle_tree_place_sub()
+ *
+ * Replace each private leaf list, and its cached wire form, with a copy
+ * made by the calling thread, so that its RRs come from that thread's
+ * malloc arena and are first touched on its NUMA node.  Shared leaves are left alone.
+ */
+static void
+merkle_tree_place_sub(merkle_tree * node)
+{
+	if (node == 0)
+		return;
+	if (merkle_tree_max_depth > node->depth && node->kids) {
+		unsigned int branch;
+		for (branch = 0; branch < merkle_tree_max_width; branch++)
+			merkle_tree_place_sub(node->kids[branch]);
+		return;
+	}
+	if (node->leaf && node->leaf->refs == 1) {
+		ldns_rr_list *copy = ldns_rr_list_clone(node->leaf->rrlist);
+		assert(copy);
+		ldns_rr_list_deep_free(node->leaf->rrlist);
+		node->leaf->rrlist = copy;
+		if (node->leaf->wire) {
+			uint8_t *data = malloc(node->leaf->wire->len);
+			assert(data);
+			memcpy(data, node->leaf->wire->data, node->leaf->wire->len);
+			free(node->leaf->wire->data);
+			node->leaf->wire->data = data;
+		}
+	}
+}
+
+static void scheme_merkle_calc_node(const scheme *, merkle_tree *, const EVP_MD *, unsigned int, unsigned char *);
+
+/*
+ * merkle_tree_digest_valid()
+ *
+ * True if 'slot' of 'node' holds a current digest for 'md'.
+ */
+static bool
+merkle_tree_digest_valid(const merkle_tree * node, const EVP_MD * md, unsigned int slot)
+{
+	return node->digests[slot].md == md && node->digests[slot].gen == node->gen;
+}
+
+/*
+ * merkle_tree_pick_slots()
+ *
+ * Choose a different digest slot for each of 'n' algorithms (at most
+ * MERKLE_DIGEST_SLOTS), preferring the slot the root already uses for
+ * it.  The same slot is then used all the way down the tree.
+ */
+static void
+merkle_tree_pick_slots(const merkle_tree * root, unsigned int n, const EVP_MD *const *mds, unsigned int *slots)
+{
+	bool used[MERKLE_DIGEST_SLOTS] = { false };
+	unsigned int i;
+	unsigned int k;
+	assert(n <= MERKLE_DIGEST_SLOTS);
+	for (i = 0; i < n; i++) {
+		slots[i] = MERKLE_DIGEST_SLOTS;
+		for (k = 0; k < MERKLE_DIGEST_SLOTS; k++) {
+			if (used[k] || root->digests[k].md != mds[i])
+				continue;
+			slots[i] = k;
+			used[k] = true;
+			break;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (slots[i] < MERKLE_DIGEST_SLOTS)
+			continue;
+		for (k = 0; used[k]; k++)
+			(void) 0;
+		slots[i] = k;
+		used[k] = true;
+	}
+}
+
+static void *
+merkle_worker_run(void *arg)
+{
+	merkle_worker *w = arg;
+	numa_pin_self(w->numa_node);
+	if (w->md)
+		scheme_merkle_calc_node(w->s, w->node, w->md, w->slot, w->digest);
+	else
+		merkle_tree_place_sub(w->node);
+	return 0;
+}
+
+/*
+ * merkle_tree_run_branches()
+ *
+ * Run a worker for each top-level branch that needs one, in parallel,
+ * each pinned to the NUMA node the branch is assigned to (round robin).
+ * With 'md', digests are left in the branches' digest 'slot'.
+ */
+static void
+merkle_tree_run_branches(const scheme *s, merkle_tree * root, const EVP_MD * md, unsigned int slot)
+{
+	merkle_worker *w;
+	unsigned int branch;
+	unsigned int nodes = numa_node_count();
+	w = calloc(merkle_tree_max_width, sizeof(*w));
+	assert(w);
+	for (branch = 0; branch < merkle_tree_max_width; branch++) {
+		merkle_tree *kid = root->kids[branch];
+		if (kid == 0 || (md && merkle_tree_digest_valid(kid, md, slot)))
+			continue;
+		w[branch].s = s;
+		w[branch].node = kid;
+		w[branch].md = md;
+		w[branch].slot = slot;
+		w[branch].numa_node = branch % nodes;
+		if (pthread_create(&w[branch].thread, 0, merkle_worker_run, &w[branch]) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	}
+	for (branch = 0; branch < merkle_tree_max_width; branch++)
+		if (w[branch].node)
+			pthread_join(w[branch].thread, 0);
+	free(w);
 }
 
 /* ============================================================================== */
@@ -143,8 +503,14 @@ scheme_merkle_new(uint8_t opt_scheme)
 	assert(s);
 	s->scheme = opt_scheme;
 	s->leaf = scheme_merkle_get_leaf_rr_list;
+	s->leaf_ro = scheme_merkle_get_leaf_ro;
+	s->insert = scheme_merkle_insert;
 	s->calc = scheme_merkle_calc_digest;
+	s->calc_multi = scheme_merkle_calc_digests;
 	s->iter = scheme_merkle_iterate;
+	s->span = scheme_merkle_span;
+	s->snap = scheme_merkle_snapshot;
+	s->diff = scheme_merkle_diff;
 	s->free = scheme_merkle_free;
 	s->data = calloc(1, sizeof(merkle_tree));
 	assert(s->data);
@@ -159,22 +525,48 @@ scheme_merkle_new(uint8_t opt_scheme)
 ldns_rr_list *
 scheme_merkle_get_leaf_rr_list(const scheme *s, const ldns_rr * rr)
 {
-	const ldns_rdf *owner;
-	char *name;
+	merkle_tree *leaf = merkle_tree_get_leaf_by_rr(s, rr);
+	merkle_tree_merge_leaf(leaf);
+	if (leaf->leaf == 0)
+		leaf->leaf = cow_rrlist_new();
+	return cow_rrlist_write(&leaf->leaf);
+}
+
+/*
+ * Read-only version of the above.  Like the other readers it first has
+ * merkle_tree_merge_sub() finish the inserts that are still pending;
+ * only leaves that were inserted into are written by that.
+ */
+cow_rrlist *
+scheme_merkle_get_leaf_ro(const scheme *s, const ldns_rr * rr)
+{
 	merkle_tree *leaf;
-	owner = ldns_rr_owner(rr);
-	assert(owner);
-	name = ldns_rdf2str(owner);
-	assert(name);
-	leaf = merkle_tree_get_leaf_by_name_sub(s, s->data, name);
-	assert(leaf);
-	assert(leaf->kids == 0);	/* leaf nodes don't have kids */
-	free(name);
-	if (leaf->rrlist == 0) {
-		leaf->rrlist = ldns_rr_list_new();
-		assert(leaf->rrlist);
-	}
-	return leaf->rrlist;
+	merkle_tree_merge_sub(s->data);
+	leaf = merkle_tree_find_leaf_by_rr(s, rr);
+	if (leaf == 0 || leaf->leaf == 0)
+		return 0;
+	cow_rrlist_read(leaf->leaf);
+	return leaf->leaf;
+}
+
+/*
+ * scheme_merkle_insert()
+ *
+ * Add 'rr' to the tree.  Unlike the 'leaf' callback this may be called
+ * from several threads at once, with no lock:  the RR is pushed onto
+ * its leaf's pending stack, and the stacks are merged by the next
+ * call of any other scheme function.
+ */
+void
+scheme_merkle_insert(const scheme *s, ldns_rr * rr)
+{
+	merkle_tree *leaf = merkle_tree_get_leaf_by_rr(s, rr);
+	merkle_pending *p = malloc(sizeof(*p));
+	assert(p);
+	p->rr = rr;
+	p->next = __atomic_load_n(&leaf->pending, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&leaf->pending, &p->next, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		(void) 0;
 }
 
 /*
@@ -183,47 +575,231 @@ scheme_merkle_get_leaf_rr_list(const scheme *s, const ldns_rr * rr)
 void
 scheme_merkle_iterate(const scheme *s, const scheme_iterate_cb cb, const void *cb_data)
 {
+	merkle_tree_merge_sub(s->data);
 	merkle_tree_iterate_sub(s, s->data, cb, cb_data);
 }
 
+/*
+ * Iterate over ALL RRs in the zone, a leaf at a time.
+ */
+void
+scheme_merkle_span(const scheme *s, const scheme_span_cb cb, const void *cb_data)
+{
+	merkle_tree_merge_sub(s->data);
+	merkle_tree_span_sub(s->data, cb, cb_data);
+}
+
+/*
+ * scheme_merkle_calc_digest_sub()
+ *
+ * Each node keeps its own digests, so clean subtrees (including those
+ * copied into a snapshot) are reused for every algorithm that still has
+ * its slot.  Only 'slot' is written, so several algorithms can be
+ * calculated over the same tree at once.
+ */
 static void
-scheme_merkle_calc_digest_sub(const scheme *s, merkle_tree *node, const EVP_MD * md, unsigned char *buf)
+scheme_merkle_calc_digest_sub(const scheme *s, merkle_tree *node, const EVP_MD * md, unsigned int slot, unsigned char *buf)
 {
-	EVP_MD_CTX *ctx;
+	merkle_digest *d = &node->digests[slot];
+	digest_ctx ctx;
 	//fdebugf(stderr, "%s(%d): scheme_calc_digest depth %u branch %u\n", __FILE__, __LINE__, node->depth,
 	//	node->branch);
 	fdebugf(stderr, "%s(%d): scheme_calc_digest at %s\n", __FILE__, __LINE__, node->branch_str);
-	if (!node->dirty)
+	if (merkle_tree_digest_valid(node, md, slot)) {
+		memcpy(buf, d->digest, EVP_MD_size(md));
 		return;
-	ctx = EVP_MD_CTX_create();
-	assert(ctx);
-	if (!EVP_DigestInit(ctx, md))
-		errx(1, "%s(%d): Digest init failed", __FILE__, __LINE__);
+	}
+	digest_init(&ctx, md);
 	if (merkle_tree_max_depth > node->depth) {
 		unsigned int branch;
+		unsigned char kid_digest[EVP_MAX_MD_SIZE];
 		assert(node->kids);
 		for (branch = 0; branch < merkle_tree_max_width; branch++) {
 			if (node->kids[branch] == 0)
 				continue;
-			scheme_merkle_calc_digest_sub(s, node->kids[branch], md, (unsigned char *) node->digest);
-			if (!EVP_DigestUpdate(ctx, node->digest, EVP_MD_size(md)))
-				errx(1, "%s(%d): Digest update failed", __FILE__, __LINE__);
+			scheme_merkle_calc_digest_sub(s, node->kids[branch], md, slot, kid_digest);
+			digest_update(&ctx, kid_digest, EVP_MD_size(md));
 		}
 	} else {
-		assert(node->rrlist);
-		ldns_rr_list_sort(node->rrlist);
-		zonemd_rrlist_digest(node->rrlist, ctx);
+		size_t len;
+		const uint8_t *wire;
+		assert(node->leaf);
+		wire = cow_rrlist_wire(node->leaf, &len);
+		digest_update(&ctx, wire, len);
+	}
+	digest_final(&ctx, d->digest);
+	memcpy(buf, d->digest, EVP_MD_size(md));
+	d->md = md;
+	d->gen = node->gen;
+	__atomic_store_n(&node->dirty, false, __ATOMIC_RELAXED);
+}
+
+/*
+ * MERKLE_CALC_KERNEL()
+ *
+ * Define scheme_merkle_calc_<name>(), which does what
+ * scheme_merkle_calc_digest_sub() does for one algorithm of the SHA-512
+ * family:  the hash is called directly, with its context on the stack,
+ * and the digest length is a constant.
+ */
+#define MERKLE_CALC_KERNEL(name, LEN) \
+static void \
+scheme_merkle_calc_##name(merkle_tree *node, const EVP_MD * md, unsigned int slot, unsigned char *buf) \
+{ \
+	merkle_digest *d = &node->digests[slot]; \
+	sha512_ctx ctx; \
+	if (merkle_tree_digest_valid(node, md, slot)) { \
+		memcpy(buf, d->digest, LEN); \
+		return; \
+	} \
+	sha512_init(&ctx, LEN); \
+	if (merkle_tree_max_depth > node->depth) { \
+		unsigned int branch; \
+		unsigned char kid_digest[LEN]; \
+		assert(node->kids); \
+		for (branch = 0; branch < merkle_tree_max_width; branch++) { \
+			if (node->kids[branch] == 0) \
+				continue; \
+			scheme_merkle_calc_##name(node->kids[branch], md, slot, kid_digest); \
+			sha512_update(&ctx, kid_digest, LEN); \
+		} \
+	} else { \
+		size_t len; \
+		const uint8_t *wire; \
+		assert(node->leaf); \
+		wire = cow_rrlist_wire(node->leaf, &len); \
+		sha512_update(&ctx, wire, len); \
+	} \
+	sha512_final(&ctx, d->digest); \
+	memcpy(buf, d->digest, LEN); \
+	d->md = md; \
+	d->gen = node->gen; \
+	__atomic_store_n(&node->dirty, false, __ATOMIC_RELAXED); \
+}
+
+MERKLE_CALC_KERNEL(sha384, SHA384_DIGEST_LEN)
+MERKLE_CALC_KERNEL(sha512, SHA512_DIGEST_LEN)
+
+/*
+ * scheme_merkle_calc_node()
+ *
+ * Digest 'node' with the kernel for 'md', or the generic code.
+ */
+static void
+scheme_merkle_calc_node(const scheme *s, merkle_tree *node, const EVP_MD * md, unsigned int slot, unsigned char *buf)
+{
+	switch (digest_kernel_for(md)) {
+	case DIGEST_KERNEL_SHA384:
+		scheme_merkle_calc_sha384(node, md, slot, buf);
+		break;
+	case DIGEST_KERNEL_SHA512:
+		scheme_merkle_calc_sha512(node, md, slot, buf);
+		break;
+	default:
+		scheme_merkle_calc_digest_sub(s, node, md, slot, buf);
+		break;
 	}
-	if (!EVP_DigestFinal_ex(ctx, buf, 0))
-		errx(1, "%s(%d): Digest final failed", __FILE__, __LINE__);
-	EVP_MD_CTX_destroy(ctx);
-	node->dirty = false;
+}
+
+static void
+scheme_merkle_calc_digest_slot(const scheme *s, const EVP_MD * md, unsigned int slot, unsigned char *buf)
+{
+	merkle_tree *root = s->data;
+	if (merkle_tree_numa && root->kids && !merkle_tree_digest_valid(root, md, slot))
+		merkle_tree_run_branches(s, root, md, slot);
+	scheme_merkle_calc_node(s, root, md, slot, buf);
 }
 
 void
 scheme_merkle_calc_digest(const scheme *s, const EVP_MD * md, unsigned char *buf)
 {
-	scheme_merkle_calc_digest_sub(s, s->data, md, buf);
+	unsigned int slot;
+	merkle_tree_merge_sub(s->data);
+	merkle_tree_pick_slots(s->data, 1, &md, &slot);
+	scheme_merkle_calc_digest_slot(s, md, slot, buf);
+}
+
+static void *
+scheme_merkle_calc_thread(void *arg)
+{
+	merkle_worker *w = arg;
+	scheme_merkle_calc_digest_slot(w->s, w->md, w->slot, w->digest);
+	return 0;
+}
+
+/*
+ * scheme_merkle_calc_digests()
+ *
+ * Calculate several digests over the live tree, one thread per
+ * algorithm, each in its own digest slot.  Unlike digesting snapshots,
+ * this leaves every algorithm's node digests behind for the next call.
+ */
+void
+scheme_merkle_calc_digests(const scheme *s, unsigned int n, const EVP_MD *const *mds, unsigned char *const *bufs)
+{
+	merkle_worker w[MERKLE_DIGEST_SLOTS];
+	unsigned int slots[MERKLE_DIGEST_SLOTS];
+	unsigned int first;
+	unsigned int i;
+	merkle_tree_merge_sub(s->data);
+	for (first = 0; first < n; first += MERKLE_DIGEST_SLOTS) {
+		unsigned int batch = n - first < MERKLE_DIGEST_SLOTS ? n - first : MERKLE_DIGEST_SLOTS;
+		merkle_tree_pick_slots(s->data, batch, mds + first, slots);
+		memset(w, 0, sizeof(w));
+		for (i = 0; i < batch; i++) {
+			w[i].s = s;
+			w[i].md = mds[first + i];
+			w[i].slot = slots[i];
+			if (pthread_create(&w[i].thread, 0, scheme_merkle_calc_thread, &w[i]) != 0)
+				errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+		}
+		for (i = 0; i < batch; i++) {
+			pthread_join(w[i].thread, 0);
+			memcpy(bufs[first + i], w[i].digest, EVP_MD_size(w[i].md));
+		}
+	}
+}
+
+/*
+ * scheme_merkle_snapshot()
+ *
+ * Return an independent version of the zone that shares all leaf RR
+ * lists with this one until either side modifies them.
+ */
+scheme *
+scheme_merkle_snapshot(const scheme *s)
+{
+	scheme *copy = calloc(1, sizeof(*copy));
+	assert(copy);
+	merkle_tree_merge_sub(s->data);
+	memcpy(copy, s, sizeof(*copy));
+	copy->data = merkle_tree_snapshot_sub(s->data, 0);
+	copy->dedup = 0;
+	return copy;
+}
+
+void
+scheme_merkle_diff(const scheme *a, const scheme *b, const scheme_diff_cb cb, const void *cb_data)
+{
+	merkle_tree_merge_sub(a->data);
+	merkle_tree_merge_sub(b->data);
+	merkle_tree_diff_sub(a->data, b->data, cb, cb_data);
+}
+
+/*
+ * scheme_merkle_numa_place()
+ *
+ * Move the RRs of each top-level branch to the NUMA node its hashing
+ * thread will run on.  RR pointers change, so this must be called
+ * before anyone else holds on to them (i.e. right after loading).
+ */
+void
+scheme_merkle_numa_place(const scheme *s)
+{
+	merkle_tree *root = s->data;
+	merkle_tree_merge_sub(root);
+	if (root->kids)
+		merkle_tree_run_branches(s, root, 0, 0);
 }
 
 void
@@ -234,7 +810,8 @@ scheme_merkle_free(scheme *s)
 	free(s->data);
 	free(s);
 #if ZONEMD_SAVE_LEAF_COUNTS
-	fclose(save_leaf_counts);
+	if (save_leaf_counts)
+		fclose(save_leaf_counts);
 	save_leaf_counts = 0;
 #endif
 }
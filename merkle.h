@@ -1,5 +1,13 @@
 scheme_new scheme_merkle_new;
 scheme_get_leaf_rr_list scheme_merkle_get_leaf_rr_list;
+scheme_get_leaf_ro scheme_merkle_get_leaf_ro;
+scheme_insert scheme_merkle_insert;
 scheme_calc_digest scheme_merkle_calc_digest;
+scheme_calc_digests scheme_merkle_calc_digests;
 scheme_iterate scheme_merkle_iterate;
+scheme_span scheme_merkle_span;
+scheme_snapshot scheme_merkle_snapshot;
+scheme_diff scheme_merkle_diff;
 scheme_free scheme_merkle_free;
+extern int merkle_tree_numa;
+void scheme_merkle_numa_place(const scheme *);
@@ -0,0 +1,152 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <assert.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "canon.h"
+#include "meta.h"
+
+/*
+ * Per-RR metadata of a list, stored column by column (type, class, TTL,
+ * owner and RRSIG type covered each in an array of their own) so that
+ * filters can scan them RR_META_LANES at a time with GCC vector
+ * extensions instead of calling into ldns and branching for every RR.
+ *
+ * Owners are numbered by the index of the first RR in a run of RRs
+ * with byte-for-byte identical owner names, so in a canonically sorted
+ * list equal owners have equal numbers.  Every RR whose owner equals
+ * the apex (ignoring case) is flagged in 'apex', wherever its run is:
+ * lists straight from the 'leaf' callback are in insertion order.
+ *
+ * Filters set one bit per matching RR in a caller-supplied bitmap of
+ * rr_meta_bitmap_words() 64-bit words.
+ */
+
+#define RR_META_LANES 16
+
+typedef uint16_t u16xN __attribute__ ((vector_size(2 * RR_META_LANES)));
+typedef uint8_t u8xN __attribute__ ((vector_size(RR_META_LANES)));
+typedef int16_t m16xN __attribute__ ((vector_size(2 * RR_META_LANES)));
+
+static bool
+rr_meta_same_owner(const ldns_rdf *a, const ldns_rdf *b)
+{
+	if (a == b)
+		return true;
+	if (ldns_rdf_size(a) != ldns_rdf_size(b))
+		return false;
+	return memcmp(ldns_rdf_data(a), ldns_rdf_data(b), ldns_rdf_size(a)) == 0;
+}
+
+/*
+ * rr_meta_new()
+ *
+ * Extract the columns of 'rrlist'.  All of them live in one allocation.
+ */
+rr_meta *
+rr_meta_new(const ldns_rr_list *rrlist, const ldns_rdf *apex)
+{
+	size_t count = ldns_rr_list_rr_count(rrlist);
+	size_t i;
+	const ldns_rdf *prev_owner = 0;
+	bool at_apex = false;
+	rr_meta *m;
+	uint8_t *p;
+	m = malloc(sizeof(*m) + count * (3 * sizeof(uint16_t) + 2 * sizeof(uint32_t) + sizeof(uint8_t)));
+	assert(m);
+	p = (uint8_t *) (m + 1);
+	m->count = count;
+	m->ttl = (uint32_t *) p;
+	p += count * sizeof(uint32_t);
+	m->owner = (uint32_t *) p;
+	p += count * sizeof(uint32_t);
+	m->type = (uint16_t *) p;
+	p += count * sizeof(uint16_t);
+	m->class = (uint16_t *) p;
+	p += count * sizeof(uint16_t);
+	m->covered = (uint16_t *) p;
+	p += count * sizeof(uint16_t);
+	m->apex = p;
+	m->any_apex = false;
+	for (i = 0; i < count; i++) {
+		const ldns_rr *rr = ldns_rr_list_rr(rrlist, i);
+		const ldns_rdf *owner = ldns_rr_owner(rr);
+		m->type[i] = ldns_rr_get_type(rr);
+		m->class[i] = ldns_rr_get_class(rr);
+		m->ttl[i] = ldns_rr_ttl(rr);
+		m->covered[i] = 0;
+		if (m->type[i] == LDNS_RR_TYPE_RRSIG && ldns_rr_rrsig_typecovered(rr))
+			m->covered[i] = ldns_rdf2native_int16(ldns_rr_rrsig_typecovered(rr));
+		if (prev_owner && rr_meta_same_owner(prev_owner, owner)) {
+			m->owner[i] = m->owner[i - 1];
+		} else {
+			m->owner[i] = i;
+			prev_owner = owner;
+			at_apex = apex && canon_dname_equal(owner, apex);
+			m->any_apex |= at_apex;
+		}
+		m->apex[i] = at_apex;
+	}
+	return m;
+}
+
+void
+rr_meta_free(rr_meta *m)
+{
+	free(m);
+}
+
+size_t
+rr_meta_bitmap_words(const rr_meta *m)
+{
+	return (m->count + 63) / 64;
+}
+
+/*
+ * rr_meta_select()
+ *
+ * Set the bit of every RR of 'type' (and, for RRSIG, covering
+ * 'covered'), only at the apex if 'apex_only'.  Other bits are left
+ * alone, so several selections can be or-ed into one bitmap.
+ */
+void
+rr_meta_select(const rr_meta *m, uint16_t type, uint16_t covered, bool apex_only, uint64_t *bits)
+{
+	const bool check_covered = type == LDNS_RR_TYPE_RRSIG;
+	size_t i;
+	unsigned int l;
+	if (apex_only && !m->any_apex)
+		return;
+	for (i = 0; i + RR_META_LANES <= m->count; i += RR_META_LANES) {
+		u16xN t;
+		m16xN hit;
+		uint64_t mask = 0;
+		memcpy(&t, m->type + i, sizeof(t));
+		hit = (m16xN) (t == type);
+		if (check_covered) {
+			u16xN c;
+			memcpy(&c, m->covered + i, sizeof(c));
+			hit &= (m16xN) (c == covered);
+		}
+		if (apex_only) {
+			u8xN a;
+			memcpy(&a, m->apex + i, sizeof(a));
+			hit &= __builtin_convertvector(a != 0, m16xN);
+		}
+		for (l = 0; l < RR_META_LANES; l++)
+			mask |= (uint64_t) (hit[l] & 1) << l;
+		bits[i / 64] |= mask << (i % 64);
+	}
+	for (; i < m->count; i++) {
+		if (m->type[i] != type)
+			continue;
+		if (check_covered && m->covered[i] != covered)
+			continue;
+		if (apex_only && !m->apex[i])
+			continue;
+		bits[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+}
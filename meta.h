@@ -0,0 +1,15 @@
+typedef struct _rr_meta {
+	size_t count;
+	uint16_t *type;
+	uint16_t *class;
+	uint32_t *ttl;
+	uint32_t *owner;		/* index of the first RR of the owner run */
+	uint16_t *covered;		/* type covered by an RRSIG, else 0 */
+	uint8_t *apex;			/* 1 if the owner is the zone apex */
+	bool any_apex;
+} rr_meta;
+
+rr_meta *rr_meta_new(const ldns_rr_list *, const ldns_rdf *apex);
+void rr_meta_free(rr_meta *);
+size_t rr_meta_bitmap_words(const rr_meta *);
+void rr_meta_select(const rr_meta *, uint16_t type, uint16_t covered, bool apex_only, uint64_t *bits);
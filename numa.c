@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include "numa.h"
+
+/*
+ * Minimal NUMA topology, read from sysfs so that no extra library is
+ * needed.  Memory placement relies on the kernel's first-touch policy
+ * and on glibc giving each thread its own malloc arena:  data allocated
+ * by a thread pinned to a node ends up on that node.
+ */
+
+static cpu_set_t *numa_cpus = 0;
+static unsigned int numa_nodes = 0;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+static void
+numa_parse_cpulist(FILE *fp, cpu_set_t *set)
+{
+	unsigned int lo;
+	unsigned int hi;
+	int c;
+	CPU_ZERO(set);
+	while (fscanf(fp, "%u", &lo) == 1) {
+		hi = lo;
+		c = fgetc(fp);
+		if (c == '-') {
+			if (fscanf(fp, "%u", &hi) != 1)
+				break;
+			c = fgetc(fp);
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (c != ',')
+			break;
+	}
+}
+
+static int
+numa_id_compare(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * numa_init()
+ *
+ * Node IDs need not be contiguous, and some nodes have memory but no
+ * CPUs, so every nodeN entry of the sysfs directory is looked at (in ID
+ * order) and only nodes with CPUs are counted.
+ */
+static void
+numa_init(void)
+{
+	const char *dir = "/sys/devices/system/node";
+	unsigned int *ids = 0;
+	unsigned int nids = 0;
+	unsigned int i;
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	while (d && (de = readdir(d)) != 0) {
+		unsigned int id;
+		char junk;
+		if (sscanf(de->d_name, "node%u%c", &id, &junk) != 1)
+			continue;
+		ids = realloc(ids, (nids + 1) * sizeof(*ids));
+		assert(ids);
+		ids[nids++] = id;
+	}
+	if (d)
+		closedir(d);
+	qsort(ids, nids, sizeof(*ids), numa_id_compare);
+	for (i = 0; i < nids; i++) {
+		char path[64];
+		FILE *fp;
+		snprintf(path, sizeof(path), "%s/node%u/cpulist", dir, ids[i]);
+		fp = fopen(path, "r");
+		if (fp == 0)
+			continue;
+		numa_cpus = realloc(numa_cpus, (numa_nodes + 1) * sizeof(*numa_cpus));
+		assert(numa_cpus);
+		numa_parse_cpulist(fp, &numa_cpus[numa_nodes]);
+		fclose(fp);
+		if (CPU_COUNT(&numa_cpus[numa_nodes]) > 0)
+			numa_nodes++;
+	}
+	free(ids);
+	if (numa_nodes == 0) {
+		numa_cpus = realloc(numa_cpus, sizeof(*numa_cpus));
+		assert(numa_cpus);
+		if (sched_getaffinity(0, sizeof(*numa_cpus), numa_cpus) != 0)
+			CPU_ZERO(numa_cpus);
+		numa_nodes = 1;
+	}
+}
+
+/*
+ * numa_node_count()
+ *
+ * Number of NUMA nodes with CPUs; 1 if the topology is not known.
+ */
+unsigned int
+numa_node_count(void)
+{
+	pthread_once(&numa_once, numa_init);
+	return numa_nodes;
+}
+
+/*
+ * numa_pin_self()
+ *
+ * Restrict the calling thread to the CPUs of 'node' (modulo the node count).
+ */
+void
+numa_pin_self(unsigned int node)
+{
+	cpu_set_t *set;
+	pthread_once(&numa_once, numa_init);
+	set = &numa_cpus[node % numa_nodes];
+	if (CPU_COUNT(set) == 0)
+		return;
+	if (pthread_setaffinity_np(pthread_self(), sizeof(*set), set) != 0)
+		warnx("%s(%d): pthread_setaffinity_np failed for node %u", __FILE__, __LINE__, node % numa_nodes);
+}
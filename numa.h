@@ -0,0 +1,2 @@
+unsigned int numa_node_count(void);
+void numa_pin_self(unsigned int node);
@@ -0,0 +1,206 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <err.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "rrhash.h"
+
+/*
+ * A hash set of RRs, keyed by canonical wire format with the TTL left
+ * out.  Two RRs have the same key exactly when ldns_rr_compare() says
+ * they are equal, so the set is used to drop duplicates as they are
+ * added to the zone rather than each time the zone is digested.
+ *
+ * The set holds copies of the keys, not the RRs themselves.
+ */
+
+typedef struct _rrhash_entry {
+	struct _rrhash_entry *next;
+	uint64_t hash;
+	size_t len;
+	uint8_t key[];
+} rrhash_entry;
+
+struct _rrhash {
+	rrhash_entry **buckets;
+	size_t nbuckets;
+	size_t count;
+	ldns_buffer *buf;
+};
+
+#define RRHASH_INITIAL_BUCKETS 1024
+
+rrhash *
+rrhash_new(void)
+{
+	rrhash *h = calloc(1, sizeof(*h));
+	assert(h);
+	h->nbuckets = RRHASH_INITIAL_BUCKETS;
+	h->buckets = calloc(h->nbuckets, sizeof(*h->buckets));
+	assert(h->buckets);
+	h->buf = ldns_buffer_new(LDNS_MAX_PACKETLEN);
+	assert(h->buf);
+	return h;
+}
+
+/*
+ * rrhash_key()
+ *
+ * Render the key for 'rr' into the scratch buffer and return a pointer
+ * to it.  The four TTL octets that follow owner, type and class are
+ * squeezed out.
+ */
+static const uint8_t *
+rrhash_key(rrhash *h, const ldns_rr *rr, size_t *ret_len)
+{
+	uint8_t *p;
+	size_t len;
+	size_t ttl_off;
+	ldns_buffer_clear(h->buf);
+	if (ldns_rr2buffer_wire_canonical(h->buf, rr, LDNS_SECTION_ANY) != LDNS_STATUS_OK)
+		errx(1, "%s(%d): ldns_rr2buffer_wire_canonical() failed", __FILE__, __LINE__);
+	p = ldns_buffer_begin(h->buf);
+	len = ldns_buffer_position(h->buf);
+	ttl_off = ldns_rdf_size(ldns_rr_owner(rr)) + 4;
+	assert(len >= ttl_off + 4);
+	memmove(p + ttl_off, p + ttl_off + 4, len - ttl_off - 4);
+	*ret_len = len - 4;
+	return p;
+}
+
+/*
+ * FNV-1a
+ */
+static uint64_t
+rrhash_hash(const uint8_t *p, size_t len)
+{
+	uint64_t x = 0xcbf29ce484222325ULL;
+	while (len--) {
+		x ^= *p++;
+		x *= 0x100000001b3ULL;
+	}
+	return x;
+}
+
+static rrhash_entry **
+rrhash_lookup(rrhash *h, const uint8_t *key, size_t len, uint64_t hash)
+{
+	rrhash_entry **e;
+	for (e = &h->buckets[hash % h->nbuckets]; *e; e = &(*e)->next)
+		if ((*e)->hash == hash && (*e)->len == len && memcmp((*e)->key, key, len) == 0)
+			break;
+	return e;
+}
+
+static void
+rrhash_grow(rrhash *h)
+{
+	size_t i;
+	size_t nbuckets = h->nbuckets * 2;
+	rrhash_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+	assert(buckets);
+	for (i = 0; i < h->nbuckets; i++) {
+		rrhash_entry *e = h->buckets[i];
+		while (e) {
+			rrhash_entry *next = e->next;
+			e->next = buckets[e->hash % nbuckets];
+			buckets[e->hash % nbuckets] = e;
+			e = next;
+		}
+	}
+	free(h->buckets);
+	h->buckets = buckets;
+	h->nbuckets = nbuckets;
+}
+
+/*
+ * rrhash_insert()
+ *
+ * Add 'rr' to the set.  Returns false if an equal RR is already there.
+ */
+bool
+rrhash_insert(rrhash *h, const ldns_rr *rr)
+{
+	size_t len;
+	const uint8_t *key = rrhash_key(h, rr, &len);
+	uint64_t hash = rrhash_hash(key, len);
+	rrhash_entry **e = rrhash_lookup(h, key, len, hash);
+	if (*e)
+		return false;
+	*e = malloc(sizeof(**e) + len);
+	assert(*e);
+	(*e)->next = 0;
+	(*e)->hash = hash;
+	(*e)->len = len;
+	memcpy((*e)->key, key, len);
+	if (++h->count > h->nbuckets)
+		rrhash_grow(h);
+	return true;
+}
+
+/*
+ * rrhash_contains()
+ *
+ * Returns true if an RR equal to 'rr' is in the set.
+ */
+bool
+rrhash_contains(rrhash *h, const ldns_rr *rr)
+{
+	size_t len;
+	const uint8_t *key = rrhash_key(h, rr, &len);
+	return *rrhash_lookup(h, key, len, rrhash_hash(key, len)) != 0;
+}
+
+/*
+ * rrhash_key_copy()
+ *
+ * Return a malloc'd copy of the key for 'rr'.  Keys of equal RRs are
+ * byte-for-byte equal, and no key is a prefix of another.
+ */
+uint8_t *
+rrhash_key_copy(rrhash *h, const ldns_rr *rr, size_t *ret_len)
+{
+	const uint8_t *key = rrhash_key(h, rr, ret_len);
+	uint8_t *copy = malloc(*ret_len);
+	assert(copy);
+	memcpy(copy, key, *ret_len);
+	return copy;
+}
+
+/*
+ * rrhash_remove()
+ *
+ * Remove 'rr' from the set.  Returns false if it was not there.
+ */
+bool
+rrhash_remove(rrhash *h, const ldns_rr *rr)
+{
+	size_t len;
+	const uint8_t *key = rrhash_key(h, rr, &len);
+	rrhash_entry **e = rrhash_lookup(h, key, len, rrhash_hash(key, len));
+	rrhash_entry *t = *e;
+	if (t == 0)
+		return false;
+	*e = t->next;
+	free(t);
+	h->count--;
+	return true;
+}
+
+void
+rrhash_free(rrhash *h)
+{
+	size_t i;
+	for (i = 0; i < h->nbuckets; i++) {
+		rrhash_entry *e = h->buckets[i];
+		while (e) {
+			rrhash_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+	free(h->buckets);
+	ldns_buffer_free(h->buf);
+	free(h);
+}
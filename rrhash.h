@@ -0,0 +1,8 @@
+typedef struct _rrhash rrhash;
+
+rrhash *rrhash_new(void);
+bool rrhash_insert(rrhash *, const ldns_rr *);
+bool rrhash_remove(rrhash *, const ldns_rr *);
+bool rrhash_contains(rrhash *, const ldns_rr *);
+uint8_t *rrhash_key_copy(rrhash *, const ldns_rr *, size_t *ret_len);
+void rrhash_free(rrhash *);
@@ -0,0 +1,257 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#define OPENSSL_SUPPRESS_DEPRECATED 1
+#include <openssl/sha.h>
+
+#include "sha512.h"
+
+/*
+ * SHA-512 and SHA-384 (FIPS 180-4) with the state on the caller's stack,
+ * for the direct digest backend.
+ *
+ * Only the block function is borrowed.  libcrypto's SHA512_Transform()
+ * is its assembler code, which makes its own choice between SHA-512
+ * extensions, AVX2/BMI2, AVX and SSSE3 by CPUID, and is used when the
+ * library still exports it.  Otherwise the C block function below is
+ * used, compiled once for the baseline target and once for AVX2 with
+ * BMI2 (RORX rotates), and CPUID picks between those.  The second is
+ * the same scalar code, not a vectorized kernel; SHA-512 extensions are
+ * only reached through libcrypto.  ZONEMD_SHA512_PORTABLE in the
+ * environment skips libcrypto, and set to "generic" also skips CPUID.
+ * The choice is made the first time a context is initialized.
+ */
+
+static const uint64_t K[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t IV512[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint64_t IV384[8] = {
+	0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+	0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static inline uint64_t
+load64be(const uint8_t *p)
+{
+	return (uint64_t) p[0] << 56 | (uint64_t) p[1] << 48 | (uint64_t) p[2] << 40 | (uint64_t) p[3] << 32
+	    | (uint64_t) p[4] << 24 | (uint64_t) p[5] << 16 | (uint64_t) p[6] << 8 | (uint64_t) p[7];
+}
+
+static inline void
+store64be(uint8_t *p, uint64_t w)
+{
+	unsigned int i;
+	for (i = 0; i < 8; i++)
+		p[i] = (uint8_t) (w >> (56 - 8 * i));
+}
+
+/*
+ * Eight rounds per step with the working variables renamed rather than
+ * shifted, and the message schedule kept in a 16-word ring.
+ */
+#define S0(x) (ROTR64(x, 28) ^ ROTR64(x, 34) ^ ROTR64(x, 39))
+#define S1(x) (ROTR64(x, 14) ^ ROTR64(x, 18) ^ ROTR64(x, 41))
+#define s0(x) (ROTR64(x, 1) ^ ROTR64(x, 8) ^ ((x) >> 7))
+#define s1(x) (ROTR64(x, 19) ^ ROTR64(x, 61) ^ ((x) >> 6))
+#define W(t) w[(t) & 15]
+#define SCHED(t) (W(t) += s1(W((t) - 2)) + W((t) - 7) + s0(W((t) - 15)))
+#define ROUND(a, b, c, d, e, f, g, h, t, x) do { \
+	uint64_t t1 = h + S1(e) + ((e & f) ^ (~e & g)) + K[t] + (x); \
+	d += t1; \
+	h = t1 + S0(a) + ((a & b) ^ (a & c) ^ (b & c)); \
+} while (0)
+#define ROUND8(t, x) do { \
+	ROUND(a, b, c, d, e, f, g, h, (t) + 0, x((t) + 0)); \
+	ROUND(h, a, b, c, d, e, f, g, (t) + 1, x((t) + 1)); \
+	ROUND(g, h, a, b, c, d, e, f, (t) + 2, x((t) + 2)); \
+	ROUND(f, g, h, a, b, c, d, e, (t) + 3, x((t) + 3)); \
+	ROUND(e, f, g, h, a, b, c, d, (t) + 4, x((t) + 4)); \
+	ROUND(d, e, f, g, h, a, b, c, (t) + 5, x((t) + 5)); \
+	ROUND(c, d, e, f, g, h, a, b, (t) + 6, x((t) + 6)); \
+	ROUND(b, c, d, e, f, g, h, a, (t) + 7, x((t) + 7)); \
+} while (0)
+
+static inline __attribute__ ((always_inline)) void
+sha512_blocks_body(uint64_t H[8], const uint8_t *p, size_t nblocks)
+{
+	uint64_t w[16];
+	unsigned int t;
+	while (nblocks--) {
+		uint64_t a = H[0], b = H[1], c = H[2], d = H[3];
+		uint64_t e = H[4], f = H[5], g = H[6], h = H[7];
+		for (t = 0; t < 16; t++)
+			w[t] = load64be(p + 8 * t);
+		ROUND8(0, W);
+		ROUND8(8, W);
+		for (t = 16; t < 80; t += 16) {
+			ROUND8(t, SCHED);
+			ROUND8(t + 8, SCHED);
+		}
+		H[0] += a;
+		H[1] += b;
+		H[2] += c;
+		H[3] += d;
+		H[4] += e;
+		H[5] += f;
+		H[6] += g;
+		H[7] += h;
+		p += SHA512_BLOCK_LEN;
+	}
+}
+
+static void
+sha512_blocks_generic(uint64_t h[8], const uint8_t *p, size_t nblocks)
+{
+	sha512_blocks_body(h, p, nblocks);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__ ((target("avx2,bmi2")))
+static void
+sha512_blocks_avx2(uint64_t h[8], const uint8_t *p, size_t nblocks)
+{
+	sha512_blocks_body(h, p, nblocks);
+}
+#endif
+
+#ifndef OPENSSL_NO_DEPRECATED_3_0
+static void
+sha512_blocks_libcrypto(uint64_t h[8], const uint8_t *p, size_t nblocks)
+{
+	SHA512_CTX c;
+	memcpy(c.h, h, sizeof(c.h));
+	while (nblocks--) {
+		SHA512_Transform(&c, p);
+		p += SHA512_BLOCK_LEN;
+	}
+	memcpy(h, c.h, sizeof(c.h));
+}
+#endif
+
+static void (*sha512_blocks) (uint64_t h[8], const uint8_t *p, size_t nblocks) = sha512_blocks_generic;
+static const char *sha512_impl = "c-generic";
+static pthread_once_t sha512_once = PTHREAD_ONCE_INIT;
+
+static void
+sha512_select(void)
+{
+	const char *portable = getenv("ZONEMD_SHA512_PORTABLE");
+#ifndef OPENSSL_NO_DEPRECATED_3_0
+	if (portable == 0) {
+		sha512_blocks = sha512_blocks_libcrypto;
+		sha512_impl = "libcrypto";
+		return;
+	}
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (portable && strcmp(portable, "generic") == 0)
+		return;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+		sha512_blocks = sha512_blocks_avx2;
+		sha512_impl = "c-avx2";
+	}
+#endif
+}
+
+/*
+ * sha512_impl_name()
+ *
+ * Which block function was selected, for -t.
+ */
+const char *
+sha512_impl_name(void)
+{
+	pthread_once(&sha512_once, sha512_select);
+	return sha512_impl;
+}
+
+/*
+ * sha512_init()
+ *
+ * 'out_len' is SHA384_DIGEST_LEN or SHA512_DIGEST_LEN and selects the
+ * variant.
+ */
+void
+sha512_init(sha512_ctx *c, unsigned int out_len)
+{
+	pthread_once(&sha512_once, sha512_select);
+	memcpy(c->h, out_len == SHA384_DIGEST_LEN ? IV384 : IV512, sizeof(c->h));
+	c->buf_len = 0;
+	c->total = 0;
+	c->out_len = out_len;
+}
+
+void
+sha512_update(sha512_ctx *c, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	c->total += len;
+	if (c->buf_len) {
+		size_t n = SHA512_BLOCK_LEN - c->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(c->buf + c->buf_len, p, n);
+		c->buf_len += n;
+		p += n;
+		len -= n;
+		if (c->buf_len < SHA512_BLOCK_LEN)
+			return;
+		sha512_blocks(c->h, c->buf, 1);
+		c->buf_len = 0;
+	}
+	if (len >= SHA512_BLOCK_LEN) {
+		sha512_blocks(c->h, p, len / SHA512_BLOCK_LEN);
+		p += len - len % SHA512_BLOCK_LEN;
+		len %= SHA512_BLOCK_LEN;
+	}
+	memcpy(c->buf, p, len);
+	c->buf_len = len;
+}
+
+void
+sha512_final(sha512_ctx *c, unsigned char *out)
+{
+	unsigned int i;
+	c->buf[c->buf_len++] = 0x80;
+	if (c->buf_len > SHA512_BLOCK_LEN - 16) {
+		memset(c->buf + c->buf_len, 0, SHA512_BLOCK_LEN - c->buf_len);
+		sha512_blocks(c->h, c->buf, 1);
+		c->buf_len = 0;
+	}
+	memset(c->buf + c->buf_len, 0, SHA512_BLOCK_LEN - 16 - c->buf_len);
+	store64be(c->buf + SHA512_BLOCK_LEN - 16, c->total >> 61);
+	store64be(c->buf + SHA512_BLOCK_LEN - 8, c->total << 3);
+	sha512_blocks(c->h, c->buf, 1);
+	for (i = 0; i < c->out_len / 8; i++)
+		store64be(out + 8 * i, c->h[i]);
+}
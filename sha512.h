@@ -0,0 +1,16 @@
+#define SHA512_BLOCK_LEN 128
+#define SHA384_DIGEST_LEN 48
+#define SHA512_DIGEST_LEN 64
+
+typedef struct {
+	uint64_t h[8];
+	uint8_t buf[SHA512_BLOCK_LEN];
+	size_t buf_len;
+	uint64_t total;			/* octets hashed so far */
+	unsigned int out_len;
+} sha512_ctx;
+
+void sha512_init(sha512_ctx *, unsigned int out_len);
+void sha512_update(sha512_ctx *, const void *, size_t);
+void sha512_final(sha512_ctx *, unsigned char *);
+const char *sha512_impl_name(void);
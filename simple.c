@@ -4,35 +4,237 @@
 #include <ldns/ldns.h>
 
 #include "ldns-zone-digest.h"
+#include "canon.h"
+#include "cow.h"
+#include "sha512.h"
+#include "digest.h"
 #include "simple.h"
 
+/*
+ * Scheme 1 digests the whole zone as one stream, but keeps it as a run
+ * of segments:  copy-on-write lists of consecutive owner names, in
+ * canonical order, of about SIMPLE_SEGMENT_RRS RRs each.  All RRs of
+ * one owner name are in the same segment.  A snapshot shares every
+ * segment, and a version that is updated unshares, re-sorts and
+ * re-serializes only the segments it touches; the digest streams the
+ * cached wire forms of the segments one after the other.
+ *
+ * As in scheme 241, the leaf callback cannot know what the caller does
+ * with the list it returns, so segments handed out are marked unsettled
+ * and simple_settle() splits the ones that grew too big, and drops the
+ * empty ones, before the zone is digested, iterated, copied or compared.
+ *
+ * ZONEMD_SEGMENT_RRS in the environment replaces SIMPLE_SEGMENT_RRS,
+ * so that the tests can cut a small zone into many segments.
+ */
+
+#define SCHEME_SIMPLE_WINDOW 128
+#define SIMPLE_SEGMENT_RRS 1024
+
+typedef struct {
+	cow_rrlist *rrs;
+	ldns_rdf *bound;		/* last owner name it may hold, NULL for the last segment */
+	bool unsettled;
+} simple_segment;
+
+typedef struct {
+	simple_segment *seg;
+	size_t nseg;
+	size_t segment_rrs;
+} simple_zone;
+
+/*
+ * simple_route()
+ *
+ * Index of the segment whose range covers 'owner'.
+ */
+static size_t
+simple_route(const simple_zone *z, const ldns_rdf *owner)
+{
+	size_t lo = 0;
+	size_t hi = z->nseg - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (ldns_dname_compare(owner, z->seg[mid].bound) <= 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/*
+ * simple_same_owner()
+ *
+ * True if RRs 'i' and 'i' + 1 of a sorted list have the same owner.
+ */
+static bool
+simple_same_owner(const ldns_rr_list *list, size_t i)
+{
+	return canon_dname_equal(ldns_rr_owner(ldns_rr_list_rr(list, i)), ldns_rr_owner(ldns_rr_list_rr(list, i + 1)));
+}
+
+/*
+ * simple_split()
+ *
+ * Cut segment 'i' into pieces of about z->segment_rrs RRs, each ending
+ * with the last RR of an owner name, if it has grown to more than twice
+ * that.  Returns the number of segments it became.
+ */
+static size_t
+simple_split(simple_zone *z, size_t i)
+{
+	const ldns_rr_list *sorted = cow_rrlist_read(z->seg[i].rrs);
+	ldns_rr_list *list;
+	size_t count = ldns_rr_list_rr_count(sorted);
+	size_t *cut = 0;		/* first RR of each piece after the first */
+	size_t ncut = 0;
+	size_t start = 0;
+	size_t j;
+	size_t k;
+
+	while (count - start > 2 * z->segment_rrs) {
+		size_t end = start + z->segment_rrs;
+		while (end < count && simple_same_owner(sorted, end - 1))
+			end++;
+		if (end == count)
+			break;
+		cut = realloc(cut, (ncut + 1) * sizeof(*cut));
+		assert(cut);
+		cut[ncut++] = end;
+		start = end;
+	}
+	if (ncut == 0)
+		return 1;
+	list = cow_rrlist_write(&z->seg[i].rrs);
+	z->seg = realloc(z->seg, (z->nseg + ncut) * sizeof(*z->seg));
+	assert(z->seg);
+	memmove(&z->seg[i + 1 + ncut], &z->seg[i + 1], (z->nseg - i - 1) * sizeof(*z->seg));
+	z->nseg += ncut;
+	for (k = 1; k <= ncut; k++) {
+		simple_segment *piece = &z->seg[i + k];
+		size_t end = k < ncut ? cut[k] : count;
+		ldns_rr_list *rlist;
+		piece->rrs = cow_rrlist_new();
+		piece->bound = 0;
+		piece->unsettled = false;
+		rlist = cow_rrlist_write(&piece->rrs);
+		for (j = cut[k - 1]; j < end; j++)
+			ldns_rr_list_push_rr(rlist, ldns_rr_list_rr(list, j));
+		piece->rrs->sorted = true;
+	}
+	z->seg[i + ncut].bound = z->seg[i].bound;
+	for (k = 0; k < ncut; k++) {
+		z->seg[i + k].bound = ldns_rdf_clone(ldns_rr_owner(ldns_rr_list_rr(list, cut[k] - 1)));
+		assert(z->seg[i + k].bound);
+	}
+	ldns_rr_list_set_rr_count(list, cut[0]);
+	z->seg[i].rrs->sorted = true;
+	free(cut);
+	return ncut + 1;
+}
+
+/*
+ * simple_drop()
+ *
+ * Remove segment 'i', which is empty.  Its range goes to the next
+ * segment, or, if it was the last, to the one before.
+ */
+static void
+simple_drop(simple_zone *z, size_t i)
+{
+	assert(z->nseg > 1);
+	if (i + 1 == z->nseg) {
+		ldns_rdf_deep_free(z->seg[i - 1].bound);
+		z->seg[i - 1].bound = 0;
+	} else {
+		ldns_rdf_deep_free(z->seg[i].bound);
+	}
+	cow_rrlist_release(z->seg[i].rrs);
+	z->nseg--;
+	memmove(&z->seg[i], &z->seg[i + 1], (z->nseg - i) * sizeof(*z->seg));
+}
+
+/*
+ * simple_settle()
+ *
+ * Sort every segment handed out since the last call, split it if it
+ * grew too big and drop it if it is empty.
+ */
+static void
+simple_settle(simple_zone *z)
+{
+	size_t i = 0;
+	while (i < z->nseg) {
+		if (!z->seg[i].unsettled) {
+			i++;
+			continue;
+		}
+		z->seg[i].unsettled = false;
+		if (ldns_rr_list_rr_count(cow_rrlist_read(z->seg[i].rrs)) == 0 && z->nseg > 1) {
+			simple_drop(z, i);
+			continue;
+		}
+		i += simple_split(z, i);
+	}
+}
+
+/* ============================================================================== */
 
 scheme *
 scheme_simple_new(uint8_t opt_scheme)
 {
 	scheme *s;
+	simple_zone *z;
+	const char *env = getenv("ZONEMD_SEGMENT_RRS");
 	assert(1 == opt_scheme);
 	s = calloc(1, sizeof(*s));
 	assert(s);
 	s->scheme = opt_scheme;
 	s->leaf = scheme_simple_get_leaf_rr_list;
+	s->leaf_ro = scheme_simple_get_leaf_ro;
 	s->calc = scheme_simple_calc_digest;
+	s->calc_multi = scheme_simple_calc_digests;
 	s->iter = scheme_simple_iterate;
+	s->span = scheme_simple_span;
+	s->snap = scheme_simple_snapshot;
+	s->diff = scheme_simple_diff;
 	s->free = scheme_simple_free;
-	s->data = ldns_rr_list_new();
-	assert(s->data);
+	z = calloc(1, sizeof(*z));
+	assert(z);
+	z->segment_rrs = SIMPLE_SEGMENT_RRS;
+	if (env && strtoul(env, 0, 10) > 0)
+		z->segment_rrs = strtoul(env, 0, 10);
+	z->seg = calloc(1, sizeof(*z->seg));
+	assert(z->seg);
+	z->seg[0].rrs = cow_rrlist_new();
+	z->nseg = 1;
+	s->data = z;
 	return s;
 }
 
 /*
- * Return the ldns_rr_list where arg RR belongs.
- * 
- * In the case of the simple data structure, there is just one list.
+ * Return the list of the segment whose range covers the owner of 'rr'.
  */
 ldns_rr_list *
-scheme_simple_get_leaf_rr_list(const scheme *s, const ldns_rr * rr_unused)
+scheme_simple_get_leaf_rr_list(const scheme *s, const ldns_rr * rr)
 {
-	return s->data;
+	simple_zone *z = s->data;
+	simple_segment *seg = &z->seg[simple_route(z, ldns_rr_owner(rr))];
+	seg->unsettled = true;
+	return cow_rrlist_write(&seg->rrs);
+}
+
+/*
+ * Read-only version of the above.
+ */
+cow_rrlist *
+scheme_simple_get_leaf_ro(const scheme *s, const ldns_rr * rr)
+{
+	simple_zone *z = s->data;
+	cow_rrlist *seg = z->seg[simple_route(z, ldns_rr_owner(rr))].rrs;
+	cow_rrlist_read(seg);
+	return seg;
 }
 
 /*
@@ -41,14 +243,31 @@ scheme_simple_get_leaf_rr_list(const scheme *s, const ldns_rr * rr_unused)
 void
 scheme_simple_iterate(const scheme *s, const scheme_iterate_cb cb, const void *cb_data)
 {
-	unsigned int i;
-	ldns_rr_list *rrlist = s->data;
-	ldns_rr_list_sort(rrlist);
-	for (i = 0; i < ldns_rr_list_rr_count(rrlist); i++) {
-		cb(ldns_rr_list_rr(rrlist, i), cb_data);
+	simple_zone *z = s->data;
+	size_t i;
+	size_t j;
+	simple_settle(z);
+	for (i = 0; i < z->nseg; i++) {
+		const ldns_rr_list *rrlist = cow_rrlist_read(z->seg[i].rrs);
+		for (j = 0; j < ldns_rr_list_rr_count(rrlist); j++)
+			cb(ldns_rr_list_rr(rrlist, j), cb_data);
 	}
 }
 
+/*
+ * Iterate over ALL RRs in the zone, SCHEME_SIMPLE_WINDOW at a time
+ * (fewer at the end of a segment).
+ */
+void
+scheme_simple_span(const scheme *s, const scheme_span_cb cb, const void *cb_data)
+{
+	simple_zone *z = s->data;
+	size_t i;
+	simple_settle(z);
+	for (i = 0; i < z->nseg; i++)
+		cow_rrlist_spans(z->seg[i].rrs, SCHEME_SIMPLE_WINDOW, cb, cb_data);
+}
+
 /*
  * scheme_calc_digest()
  *
@@ -57,15 +276,99 @@ scheme_simple_iterate(const scheme *s, const scheme_iterate_cb cb, const void *c
 void
 scheme_simple_calc_digest(const scheme *s, const EVP_MD * md, unsigned char *buf)
 {
-	EVP_MD_CTX *ctx;
-	ctx = EVP_MD_CTX_create();
-	assert(ctx);
-	if (!EVP_DigestInit(ctx, md))
-		errx(1, "%s(%d): Digest init failed", __FILE__, __LINE__);
-	zonemd_rrlist_digest(s->data, ctx);
-	if (!EVP_DigestFinal_ex(ctx, buf, 0))
-		errx(1, "%s(%d): Digest final failed", __FILE__, __LINE__);
-	EVP_MD_CTX_destroy(ctx);
+	simple_zone *z = s->data;
+	digest_ctx ctx;
+	size_t i;
+	simple_settle(z);
+	digest_init(&ctx, md);
+	for (i = 0; i < z->nseg; i++) {
+		size_t len;
+		const uint8_t *wire = cow_rrlist_wire(z->seg[i].rrs, &len);
+		digest_update(&ctx, wire, len);
+	}
+	digest_final(&ctx, buf);
+}
+
+/*
+ * scheme_simple_calc_digests()
+ *
+ * Calculate several digests over the zone.  The zone is serialized
+ * once and each algorithm hashes the stream on its own thread.
+ */
+void
+scheme_simple_calc_digests(const scheme *s, unsigned int n, const EVP_MD *const *mds, unsigned char *const *bufs)
+{
+	simple_zone *z = s->data;
+	digest_ctx ctx;
+	size_t i;
+	simple_settle(z);
+	digest_tee_init(&ctx, n, mds);
+	for (i = 0; i < z->nseg; i++) {
+		size_t len;
+		const uint8_t *wire = cow_rrlist_wire(z->seg[i].rrs, &len);
+		digest_update(&ctx, wire, len);
+	}
+	digest_tee_final(&ctx, bufs);
+}
+
+/*
+ * Return an independent version of the zone that shares every segment
+ * copy-on-write.
+ */
+scheme *
+scheme_simple_snapshot(const scheme *s)
+{
+	simple_zone *z = s->data;
+	simple_zone *copy_z;
+	scheme *copy = calloc(1, sizeof(*copy));
+	size_t i;
+	assert(copy);
+	memcpy(copy, s, sizeof(*copy));
+	simple_settle(z);
+	copy_z = calloc(1, sizeof(*copy_z));
+	assert(copy_z);
+	copy_z->segment_rrs = z->segment_rrs;
+	copy_z->nseg = z->nseg;
+	copy_z->seg = calloc(z->nseg, sizeof(*copy_z->seg));
+	assert(copy_z->seg);
+	for (i = 0; i < z->nseg; i++) {
+		copy_z->seg[i].rrs = cow_rrlist_share(z->seg[i].rrs);
+		if (z->seg[i].bound) {
+			copy_z->seg[i].bound = ldns_rdf_clone(z->seg[i].bound);
+			assert(copy_z->seg[i].bound);
+		}
+	}
+	copy->data = copy_z;
+	copy->dedup = 0;
+	return copy;
+}
+
+static cow_rrlist **
+simple_leaves(simple_zone *z)
+{
+	cow_rrlist **leaves = calloc(z->nseg, sizeof(*leaves));
+	size_t i;
+	assert(leaves);
+	simple_settle(z);
+	for (i = 0; i < z->nseg; i++)
+		leaves[i] = z->seg[i].rrs;
+	return leaves;
+}
+
+/*
+ * Report RRs removed in 'b' relative to 'a', and added.  Segments that
+ * both versions share are skipped.
+ */
+void
+scheme_simple_diff(const scheme *a, const scheme *b, const scheme_diff_cb cb, const void *cb_data)
+{
+	simple_zone *za = a->data;
+	simple_zone *zb = b->data;
+	cow_rrlist **la = simple_leaves(za);
+	cow_rrlist **lb = simple_leaves(zb);
+	cow_rrlist_diff_seq(la, za->nseg, lb, zb->nseg, cb, cb_data);
+	free(la);
+	free(lb);
 }
 
 /*
@@ -74,8 +377,16 @@ scheme_simple_calc_digest(const scheme *s, const EVP_MD * md, unsigned char *buf
 void
 scheme_simple_free(scheme *s)
 {
-	assert(s->data);
-	ldns_rr_list_deep_free(s->data);
+	simple_zone *z = s->data;
+	size_t i;
+	assert(z);
+	for (i = 0; i < z->nseg; i++) {
+		cow_rrlist_release(z->seg[i].rrs);
+		if (z->seg[i].bound)
+			ldns_rdf_deep_free(z->seg[i].bound);
+	}
+	free(z->seg);
+	free(z);
 	memset(s, 0, sizeof(*s));
 	free(s);
 }
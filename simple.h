@@ -1,5 +1,10 @@
 scheme_new scheme_simple_new;
 scheme_get_leaf_rr_list scheme_simple_get_leaf_rr_list;
+scheme_get_leaf_ro scheme_simple_get_leaf_ro;
 scheme_calc_digest scheme_simple_calc_digest;
+scheme_calc_digests scheme_simple_calc_digests;
 scheme_iterate scheme_simple_iterate;
+scheme_span scheme_simple_span;
+scheme_snapshot scheme_simple_snapshot;
+scheme_diff scheme_simple_diff;
 scheme_free scheme_simple_free;
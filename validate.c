@@ -0,0 +1,220 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <err.h>
+#include <pthread.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "validate.h"
+#include "canon.h"
+
+extern int quiet;
+
+/*
+ * One unit of work for the validation threads:  an RRset and the
+ * RRSIGs that cover it.  The lists are shallow and point at RRs
+ * owned by the scheme.
+ */
+typedef struct {
+	ldns_rr_list *rrset;
+	ldns_rr_list *rrsigs;
+} validate_job;
+
+static struct {
+	validate_job *jobs;
+	unsigned int njobs;
+	unsigned int next;
+	ldns_rr_list *all;
+	ldns_rr_list *keys;
+	pthread_t *threads;
+	unsigned int nthreads;
+	pthread_mutex_t lock;
+	unsigned int n_good;
+	unsigned int n_bad;
+} V;
+
+static void
+validate_collect_span(const ldns_rr *const *rrs, size_t count, const void *cb_data)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		ldns_rr_list_push_rr((ldns_rr_list *) cb_data, rrs[i]);
+}
+
+static validate_job *
+validate_job_new(void)
+{
+	validate_job *j;
+	V.jobs = realloc(V.jobs, (V.njobs + 1) * sizeof(*V.jobs));
+	assert(V.jobs);
+	j = &V.jobs[V.njobs++];
+	j->rrset = ldns_rr_list_new();
+	j->rrsigs = ldns_rr_list_new();
+	assert(j->rrset);
+	assert(j->rrsigs);
+	return j;
+}
+
+/*
+ * validate_group_owner()
+ *
+ * Group the RRs of a single owner name (all[first..last-1], sorted
+ * canonically, so types are consecutive) into RRsets and attach
+ * each RRSIG to the RRset of its type covered.
+ */
+static void
+validate_group_owner(unsigned int first, unsigned int last, const ldns_rdf *origin, ldns_rr_type skip_type)
+{
+	unsigned int i;
+	unsigned int j;
+	unsigned int first_job = V.njobs;
+	validate_job *job = 0;
+	ldns_rr *prev = 0;
+
+	for (i = first; i < last; i++) {
+		ldns_rr *rr = ldns_rr_list_rr(V.all, i);
+		ldns_rr_type type = ldns_rr_get_type(rr);
+		if (type == LDNS_RR_TYPE_RRSIG)
+			continue;
+		if (type == skip_type)
+			continue;
+		if (type == LDNS_RR_TYPE_DNSKEY && canon_dname_equal(ldns_rr_owner(rr), origin))
+			ldns_rr_list_push_rr(V.keys, rr);
+		if (!prev || ldns_rr_get_type(prev) != type || ldns_rr_get_class(prev) != ldns_rr_get_class(rr))
+			job = validate_job_new();
+		ldns_rr_list_push_rr(job->rrset, rr);
+		prev = rr;
+	}
+	for (i = first; i < last; i++) {
+		ldns_rr *rr = ldns_rr_list_rr(V.all, i);
+		ldns_rr_type covered;
+		if (ldns_rr_get_type(rr) != LDNS_RR_TYPE_RRSIG)
+			continue;
+		covered = ldns_rdf2native_int16(ldns_rr_rrsig_typecovered(rr));
+		if (covered == skip_type)
+			continue;
+		for (j = first_job; j < V.njobs; j++)
+			if (ldns_rr_get_type(ldns_rr_list_rr(V.jobs[j].rrset, 0)) == covered)
+				break;
+		if (j == V.njobs) {
+			char *s = ldns_rr2str(rr);
+			assert(s);
+			warnx("%s(%d): RRSIG without a covered RRset: %s", __FILE__, __LINE__, s);
+			free(s);
+			V.n_bad++;
+			continue;
+		}
+		ldns_rr_list_push_rr(V.jobs[j].rrsigs, rr);
+	}
+}
+
+/*
+ * validate_worker()
+ *
+ * Thread body.  Jobs are handed out one at a time from a shared
+ * index, so a thread that gets a cheap RRset simply takes another.
+ */
+static void *
+validate_worker(void *unused)
+{
+	for (;;) {
+		validate_job *job;
+		unsigned int i;
+		unsigned int good = 0;
+		unsigned int bad = 0;
+		pthread_mutex_lock(&V.lock);
+		job = V.next < V.njobs ? &V.jobs[V.next++] : 0;
+		pthread_mutex_unlock(&V.lock);
+		if (job == 0)
+			break;
+		for (i = 0; i < ldns_rr_list_rr_count(job->rrsigs); i++) {
+			ldns_rr *rrsig = ldns_rr_list_rr(job->rrsigs, i);
+			ldns_status status = ldns_verify_rrsig_keylist(job->rrset, rrsig, V.keys, 0);
+			if (status == LDNS_STATUS_OK) {
+				good++;
+			} else {
+				char *s = ldns_rr2str(rrsig);
+				assert(s);
+				warnx("%s(%d): %s: %s", __FILE__, __LINE__, ldns_get_errorstr_by_id(status), s);
+				free(s);
+				bad++;
+			}
+		}
+		pthread_mutex_lock(&V.lock);
+		V.n_good += good;
+		V.n_bad += bad;
+		pthread_mutex_unlock(&V.lock);
+	}
+	return 0;
+}
+
+/*
+ * zonemd_validate_start()
+ *
+ * Group the zone into RRsets and start 'nthreads' threads verifying
+ * every RRSIG against the apex DNSKEY RRset.  RRsets without
+ * signatures (delegations, glue) are not checked.  RRsets of
+ * 'skip_type', and RRSIGs covering it, are left out so that the
+ * caller may rewrite them (i.e. ZONEMD) while validation runs.
+ *
+ * Returns immediately; the zone data must not be otherwise modified
+ * until zonemd_validate_finish() has been called.
+ */
+void
+zonemd_validate_start(const scheme *s, const ldns_rdf *origin, ldns_rr_type skip_type, unsigned int nthreads)
+{
+	unsigned int i;
+	unsigned int first = 0;
+
+	memset(&V, 0, sizeof(V));
+	pthread_mutex_init(&V.lock, 0);
+	V.all = ldns_rr_list_new();
+	V.keys = ldns_rr_list_new();
+	assert(V.all);
+	assert(V.keys);
+	s->span(s, validate_collect_span, V.all);
+	canon_rr_list_sort(V.all);
+	for (i = 1; i <= ldns_rr_list_rr_count(V.all); i++) {
+		if (i < ldns_rr_list_rr_count(V.all))
+			if (canon_dname_equal(ldns_rr_owner(ldns_rr_list_rr(V.all, first)), ldns_rr_owner(ldns_rr_list_rr(V.all, i))))
+				continue;
+		validate_group_owner(first, i, origin, skip_type);
+		first = i;
+	}
+	if (ldns_rr_list_rr_count(V.keys) == 0)
+		warnx("%s(%d): No DNSKEY RRset at zone apex, signatures cannot be validated", __FILE__, __LINE__);
+	if (nthreads < 1)
+		nthreads = 1;
+	V.threads = calloc(nthreads, sizeof(*V.threads));
+	assert(V.threads);
+	for (V.nthreads = 0; V.nthreads < nthreads; V.nthreads++)
+		if (pthread_create(&V.threads[V.nthreads], 0, validate_worker, 0) != 0)
+			errx(1, "%s(%d): pthread_create failed", __FILE__, __LINE__);
+	fdebugf(stderr, "%s(%d): validating %u RRsets with %u threads\n", __FILE__, __LINE__, V.njobs, V.nthreads);
+}
+
+/*
+ * zonemd_validate_finish()
+ *
+ * Wait for the validation threads and release the RRset grouping.
+ * Returns non-zero if any signature failed to validate.
+ */
+int
+zonemd_validate_finish(void)
+{
+	unsigned int i;
+	for (i = 0; i < V.nthreads; i++)
+		pthread_join(V.threads[i], 0);
+	for (i = 0; i < V.njobs; i++) {
+		ldns_rr_list_free(V.jobs[i].rrset);
+		ldns_rr_list_free(V.jobs[i].rrsigs);
+	}
+	if (!quiet || V.n_bad)
+		fprintf(stderr, "Validated %u RRSIGs, %u failed\n", V.n_good + V.n_bad, V.n_bad);
+	free(V.jobs);
+	free(V.threads);
+	ldns_rr_list_free(V.all);
+	ldns_rr_list_free(V.keys);
+	pthread_mutex_destroy(&V.lock);
+	return V.n_bad ? 1 : 0;
+}
@@ -0,0 +1,2 @@
+void zonemd_validate_start(const scheme *s, const ldns_rdf *origin, ldns_rr_type skip_type, unsigned int nthreads);
+int zonemd_validate_finish(void);
@@ -0,0 +1,102 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <err.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "versions.h"
+
+extern int quiet;
+
+/*
+ * Retained versions of the zone, oldest first, keyed by SOA serial.
+ * Each one is a snapshot of the live zone, so unchanged leaves are
+ * shared between all of them and with the live version.
+ */
+typedef struct {
+	uint32_t serial;
+	scheme *s;
+} zone_version;
+
+static struct {
+	zone_version *v;
+	unsigned int count;
+	unsigned int max;
+} Versions;
+
+static void
+zonemd_versions_drop(unsigned int i)
+{
+	Versions.v[i].s->free(Versions.v[i].s);
+	Versions.count--;
+	memmove(&Versions.v[i], &Versions.v[i + 1], (Versions.count - i) * sizeof(*Versions.v));
+}
+
+/*
+ * zonemd_versions_init()
+ *
+ * Keep up to 'max' serials.  Zero disables retention.
+ */
+void
+zonemd_versions_init(unsigned int max)
+{
+	memset(&Versions, 0, sizeof(Versions));
+	Versions.max = max;
+	if (max == 0)
+		return;
+	Versions.v = calloc(max, sizeof(*Versions.v));
+	assert(Versions.v);
+}
+
+/*
+ * zonemd_versions_retain()
+ *
+ * Snapshot the live zone under its current serial.  A version already
+ * retained under the same serial is replaced, and the oldest one is
+ * dropped once more than 'max' are held.
+ */
+void
+zonemd_versions_retain(const scheme *live)
+{
+	unsigned int i;
+	if (Versions.max == 0)
+		return;
+	for (i = 0; i < Versions.count; i++) {
+		if (Versions.v[i].serial == live->serial) {
+			zonemd_versions_drop(i);
+			break;
+		}
+	}
+	if (Versions.count == Versions.max)
+		zonemd_versions_drop(0);
+	Versions.v[Versions.count].serial = live->serial;
+	Versions.v[Versions.count].s = live->snap(live);
+	Versions.count++;
+	if (!quiet)
+		fprintf(stderr, "Retained serial %u (%u of %u)\n", live->serial, Versions.count, Versions.max);
+}
+
+/*
+ * zonemd_versions_find()
+ *
+ * Return the retained version with the given serial, or NULL.  The
+ * result must not be modified; take a snapshot of it instead.
+ */
+const scheme *
+zonemd_versions_find(uint32_t serial)
+{
+	unsigned int i;
+	for (i = 0; i < Versions.count; i++)
+		if (Versions.v[i].serial == serial)
+			return Versions.v[i].s;
+	return 0;
+}
+
+void
+zonemd_versions_free(void)
+{
+	while (Versions.count)
+		zonemd_versions_drop(Versions.count - 1);
+	free(Versions.v);
+	memset(&Versions, 0, sizeof(Versions));
+}
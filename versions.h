@@ -0,0 +1,4 @@
+void zonemd_versions_init(unsigned int max);
+void zonemd_versions_retain(const scheme *live);
+const scheme *zonemd_versions_find(uint32_t serial);
+void zonemd_versions_free(void);
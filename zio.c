@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "zio.h"
+
+/*
+ * Zone file input and output through io_uring.
+ *
+ * zio_fopen() returns an ordinary stdio stream (via fopencookie()) so
+ * that ldns_zone_new_frm_fp(), the scanner and ldns_rr_print_fmt() need
+ * no changes.  Behind it, a reader keeps ZIO_DEPTH reads of ZIO_CHUNK
+ * bytes in flight ahead of the parser, and a writer keeps up to
+ * ZIO_DEPTH full buffers queued behind the formatter.
+ *
+ * The ring is driven with the raw system calls, so there is no liburing
+ * dependency.  When io_uring is not available (old kernel, seccomp, not
+ * Linux), the path is not a regular file, or ZONEMD_NO_URING is set in
+ * the environment, zio_fopen() is just fopen().
+ */
+
+#define ZIO_DEPTH 4
+#define ZIO_CHUNK (1 << 20)
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ZIO_URING 1
+#endif
+#endif
+
+#if ZIO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_sz;
+	void *cq_ptr;
+	size_t cq_sz;
+	size_t sqes_sz;
+} zio_ring;
+
+typedef struct {
+	char *data;
+	size_t len;			/* requested (read) or filled (write) */
+	size_t done;			/* bytes completed (read) or consumed */
+	off_t offset;
+	bool busy;			/* submitted and not yet completed */
+} zio_buf;
+
+typedef struct {
+	zio_ring ring;
+	int fd;
+	bool writing;
+	off_t size;			/* reader: file size */
+	off_t next;			/* next offset to submit */
+	unsigned int head;		/* reader: buffer being consumed; writer: being filled */
+	zio_buf buf[ZIO_DEPTH];
+} zio_file;
+
+static int
+zio_ring_init(zio_ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ptr = mmap(0, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ptr = mmap(0, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(0, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->sq_ptr != MAP_FAILED)
+			munmap(r->sq_ptr, r->sq_sz);
+		if (r->cq_ptr != MAP_FAILED)
+			munmap(r->cq_ptr, r->cq_sz);
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_sz);
+		close(r->fd);
+		return -1;
+	}
+	r->sq_head = (unsigned int *) ((char *) r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned int *) ((char *) r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned int *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *) ((char *) r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned int *) ((char *) r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned int *) ((char *) r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned int *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+static void
+zio_ring_free(zio_ring *r)
+{
+	munmap(r->sqes, r->sqes_sz);
+	munmap(r->cq_ptr, r->cq_sz);
+	munmap(r->sq_ptr, r->sq_sz);
+	close(r->fd);
+}
+
+/*
+ * zio_submit()
+ *
+ * Queue one read or write of buffer 'i' and hand it to the kernel.
+ */
+static void
+zio_submit(zio_file *f, unsigned int i)
+{
+	zio_ring *r = &f->ring;
+	zio_buf *b = &f->buf[i];
+	unsigned int tail = *r->sq_tail;
+	unsigned int idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = f->writing ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = f->fd;
+	sqe->addr = (unsigned long) b->data;
+	sqe->len = (unsigned int) b->len;
+	sqe->off = (unsigned long long) b->offset;
+	sqe->user_data = i;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	b->busy = true;
+	while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, 0, 0) < 0)
+		if (errno != EINTR)
+			err(1, "%s(%d): io_uring_enter", __FILE__, __LINE__);
+}
+
+/*
+ * zio_complete()
+ *
+ * Wait for one completion and account for it.  Short transfers are
+ * finished off synchronously so that buffers always complete whole.
+ */
+static void
+zio_complete(zio_file *f)
+{
+	zio_ring *r = &f->ring;
+	unsigned int head = *r->cq_head;
+	struct io_uring_cqe cqe;
+	zio_buf *b;
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR)
+			err(1, "%s(%d): io_uring_enter", __FILE__, __LINE__);
+		head = *r->cq_head;
+	}
+	cqe = r->cqes[head & *r->cq_mask];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	assert(cqe.user_data < ZIO_DEPTH);
+	b = &f->buf[cqe.user_data];
+	b->busy = false;
+	if (cqe.res < 0)
+		errx(1, "%s(%d): io_uring %s: %s", __FILE__, __LINE__, f->writing ? "write" : "read", strerror(-cqe.res));
+	while ((size_t) cqe.res < b->len) {
+		ssize_t n;
+		if (f->writing)
+			n = pwrite(f->fd, b->data + cqe.res, b->len - cqe.res, b->offset + cqe.res);
+		else
+			n = pread(f->fd, b->data + cqe.res, b->len - cqe.res, b->offset + cqe.res);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			err(1, "%s(%d): %s", __FILE__, __LINE__, f->writing ? "pwrite" : "pread");
+		if (n == 0)
+			break;
+		cqe.res += n;
+	}
+	if (!f->writing)
+		b->len = cqe.res;
+	b->done = 0;
+}
+
+static void
+zio_read_ahead(zio_file *f, unsigned int i)
+{
+	zio_buf *b = &f->buf[i];
+	b->offset = f->next;
+	b->len = f->size - f->next < ZIO_CHUNK ? (size_t) (f->size - f->next) : ZIO_CHUNK;
+	b->done = 0;
+	if (b->len == 0)
+		return;
+	f->next += b->len;
+	zio_submit(f, i);
+}
+
+static ssize_t
+zio_cookie_read(void *cookie, char *out, size_t size)
+{
+	zio_file *f = cookie;
+	size_t copied = 0;
+	while (copied < size) {
+		zio_buf *b = &f->buf[f->head];
+		size_t n;
+		while (b->busy)
+			zio_complete(f);
+		if (b->len == 0)
+			break;		/* EOF */
+		n = b->len - b->done;
+		if (n > size - copied)
+			n = size - copied;
+		memcpy(out + copied, b->data + b->done, n);
+		b->done += n;
+		copied += n;
+		if (b->done == b->len) {
+			zio_read_ahead(f, f->head);
+			f->head = (f->head + 1) % ZIO_DEPTH;
+		}
+	}
+	return (ssize_t) copied;
+}
+
+/*
+ * zio_flush_head()
+ *
+ * Queue the buffer being filled and move on to the next, waiting for it
+ * if it is still being written.
+ */
+static void
+zio_flush_head(zio_file *f)
+{
+	zio_buf *b = &f->buf[f->head];
+	if (b->len == 0)
+		return;
+	b->offset = f->next;
+	f->next += b->len;
+	zio_submit(f, f->head);
+	f->head = (f->head + 1) % ZIO_DEPTH;
+	b = &f->buf[f->head];
+	while (b->busy)
+		zio_complete(f);
+	b->len = 0;
+}
+
+static ssize_t
+zio_cookie_write(void *cookie, const char *in, size_t size)
+{
+	zio_file *f = cookie;
+	size_t copied = 0;
+	while (copied < size) {
+		zio_buf *b = &f->buf[f->head];
+		size_t n = ZIO_CHUNK - b->len;
+		if (n > size - copied)
+			n = size - copied;
+		memcpy(b->data + b->len, in + copied, n);
+		b->len += n;
+		copied += n;
+		if (b->len == ZIO_CHUNK)
+			zio_flush_head(f);
+	}
+	return (ssize_t) copied;
+}
+
+static int
+zio_cookie_close(void *cookie)
+{
+	zio_file *f = cookie;
+	unsigned int i;
+	if (f->writing)
+		zio_flush_head(f);
+	for (i = 0; i < ZIO_DEPTH; i++) {
+		while (f->buf[i].busy)
+			zio_complete(f);
+		free(f->buf[i].data);
+	}
+	zio_ring_free(&f->ring);
+	i = close(f->fd);
+	free(f);
+	return (int) i;
+}
+
+static FILE *
+zio_uring_fopen(const char *path, bool writing)
+{
+	cookie_io_functions_t io;
+	struct stat sb;
+	zio_file *f;
+	unsigned int i;
+	int fd;
+	FILE *fp;
+
+	/*
+	 * Look before opening:  opening and closing a FIFO or device
+	 * here, before fopen() opens it again, would end the stream for
+	 * whoever is on the other side.
+	 */
+	if (stat(path, &sb) == 0 && !S_ISREG(sb.st_mode))
+		return 0;
+	fd = writing ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	f = calloc(1, sizeof(*f));
+	assert(f);
+	if (zio_ring_init(&f->ring, ZIO_DEPTH) < 0) {
+		close(fd);
+		free(f);
+		return 0;
+	}
+	f->fd = fd;
+	f->writing = writing;
+	f->size = sb.st_size;
+	for (i = 0; i < ZIO_DEPTH; i++) {
+		f->buf[i].data = malloc(ZIO_CHUNK);
+		assert(f->buf[i].data);
+	}
+	memset(&io, 0, sizeof(io));
+	if (writing) {
+		io.write = zio_cookie_write;
+	} else {
+		io.read = zio_cookie_read;
+		for (i = 0; i < ZIO_DEPTH; i++)
+			zio_read_ahead(f, i);
+	}
+	io.close = zio_cookie_close;
+	fp = fopencookie(f, writing ? "w" : "r", io);
+	assert(fp);
+	/*
+	 * The cookie does its own buffering in ZIO_CHUNK pieces.
+	 */
+	setvbuf(fp, 0, _IOFBF, 64 * 1024);
+	return fp;
+}
+#endif
+
+/*
+ * zio_fopen()
+ *
+ * Open 'path' for reading ("r") or writing ("w").  Returns NULL, with
+ * errno set, on failure, like fopen().
+ */
+FILE *
+zio_fopen(const char *path, const char *mode)
+{
+#if ZIO_URING
+	static int disabled = -1;
+	if (__atomic_load_n(&disabled, __ATOMIC_RELAXED) < 0)
+		__atomic_store_n(&disabled, getenv("ZONEMD_NO_URING") != 0, __ATOMIC_RELAXED);
+	if (!__atomic_load_n(&disabled, __ATOMIC_RELAXED) && (mode[0] == 'r' || mode[0] == 'w')) {
+		FILE *fp = zio_uring_fopen(path, mode[0] == 'w');
+		if (fp)
+			return fp;
+		if (errno == ENOSYS || errno == EPERM)
+			__atomic_store_n(&disabled, 1, __ATOMIC_RELAXED);
+	}
+#endif
+	return fopen(path, mode);
+}
@@ -0,0 +1 @@
+FILE *zio_fopen(const char *path, const char *mode);
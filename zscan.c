@@ -0,0 +1,524 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <err.h>
+#include <pthread.h>
+#include <ldns/ldns.h>
+
+#include "ldns-zone-digest.h"
+#include "zscan.h"
+#include "fastrr.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ZSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * A master file scanner in two stages, after the structure of simdjson.
+ *
+ * Stage 1 classifies the input 64 bytes at a time into whitespace and
+ * "special" characters (newline, quote, parentheses, semicolon and
+ * backslash), and records the index of every position where a special
+ * character, a run of whitespace or a run of other characters begins.
+ *
+ * Stage 2 walks only those indexes.  It handles comments, quoting,
+ * escapes, parentheses and directives, and gives the tokens of each
+ * record to the RR builder.
+ */
+
+#define ZSCAN_BLOCK 64
+
+typedef void (zscan_classify_fn)(const uint8_t *, uint64_t *ret_ws, uint64_t *ret_sp);
+
+static zscan_classify_fn *zscan_classify_impl = 0;
+static pthread_once_t zscan_once = PTHREAD_ONCE_INIT;
+
+static void
+zscan_classify_scalar(const uint8_t *p, uint64_t *ret_ws, uint64_t *ret_sp)
+{
+	unsigned int i;
+	uint64_t ws = 0;
+	uint64_t sp = 0;
+	for (i = 0; i < ZSCAN_BLOCK; i++) {
+		switch (p[i]) {
+		case ' ':
+		case '\t':
+		case '\r':
+			ws |= 1ULL << i;
+			break;
+		case '\n':
+		case '"':
+		case '(':
+		case ')':
+		case ';':
+		case '\\':
+			sp |= 1ULL << i;
+			break;
+		}
+	}
+	*ret_ws = ws;
+	*ret_sp = sp;
+}
+
+#if ZSCAN_X86
+__attribute__((target("sse2")))
+static void
+zscan_classify_sse2(const uint8_t *p, uint64_t *ret_ws, uint64_t *ret_sp)
+{
+	unsigned int i;
+	uint64_t ws = 0;
+	uint64_t sp = 0;
+	for (i = 0; i < ZSCAN_BLOCK; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+		__m128i w = _mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+		__m128i s = _mm_or_si128(_mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))), _mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(')')))), _mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+		ws |= (uint64_t) (unsigned int) _mm_movemask_epi8(w) << i;
+		sp |= (uint64_t) (unsigned int) _mm_movemask_epi8(s) << i;
+	}
+	*ret_ws = ws;
+	*ret_sp = sp;
+}
+
+__attribute__((target("avx2")))
+static void
+zscan_classify_avx2(const uint8_t *p, uint64_t *ret_ws, uint64_t *ret_sp)
+{
+	unsigned int i;
+	uint64_t ws = 0;
+	uint64_t sp = 0;
+	for (i = 0; i < ZSCAN_BLOCK; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+		__m256i w = _mm256_or_si256(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+		__m256i s = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))), _mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')))), _mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+		ws |= (uint64_t) (unsigned int) _mm256_movemask_epi8(w) << i;
+		sp |= (uint64_t) (unsigned int) _mm256_movemask_epi8(s) << i;
+	}
+	*ret_ws = ws;
+	*ret_sp = sp;
+}
+#endif
+
+static void
+zscan_init(void)
+{
+	zscan_classify_impl = zscan_classify_scalar;
+#if ZSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		zscan_classify_impl = zscan_classify_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		zscan_classify_impl = zscan_classify_sse2;
+#endif
+}
+
+/*
+ * zscan_index()
+ *
+ * Stage 1.  'buf' must be followed by ZSCAN_BLOCK bytes of padding.
+ * Returns the array of boundary indexes and its length in 'ret_n'.
+ */
+static uint32_t *
+zscan_index(const char *buf, size_t len, size_t *ret_n)
+{
+	size_t base;
+	size_t n = 0;
+	size_t cap = len / 4 + ZSCAN_BLOCK;
+	uint64_t prev_ws = 0;
+	uint64_t prev_sp = 1;	/* as if the input were preceded by a newline */
+	uint32_t *idx;
+
+	pthread_once(&zscan_once, zscan_init);
+	idx = malloc(cap * sizeof(*idx));
+	assert(idx);
+	for (base = 0; base < len; base += ZSCAN_BLOCK) {
+		uint64_t ws;
+		uint64_t sp;
+		uint64_t b;
+		zscan_classify_impl((const uint8_t *) buf + base, &ws, &sp);
+		if (len - base < ZSCAN_BLOCK) {
+			uint64_t valid = (1ULL << (len - base)) - 1;
+			ws &= valid;
+			sp &= valid;
+		}
+		b = sp | (sp << 1 | prev_sp) | (ws ^ (ws << 1 | prev_ws));
+		if (len - base < ZSCAN_BLOCK)
+			b &= (1ULL << (len - base)) - 1;
+		prev_sp = sp >> 63;
+		prev_ws = ws >> 63;
+		if (cap - n < ZSCAN_BLOCK) {
+			cap *= 2;
+			idx = realloc(idx, cap * sizeof(*idx));
+			assert(idx);
+		}
+		while (b) {
+			idx[n++] = (uint32_t) (base + __builtin_ctzll(b));
+			b &= b - 1;
+		}
+	}
+	*ret_n = n;
+	return idx;
+}
+
+typedef struct {
+	const char *buf;
+	zscan_token *tokens;
+	size_t ntokens;
+	size_t maxtokens;
+	bool tok_open;
+	const char *tok_end;
+	char *line;
+	size_t linesz;
+	ldns_rdf *origin;
+	ldns_rdf *prev;
+	char *prev_str;
+	uint32_t ttl;
+	ldns_zone *zone;
+	bool soa_seen;
+} zscan_state;
+
+static void
+zscan_token_add(zscan_state *st, size_t p, size_t q)
+{
+	if (st->tok_open && st->tok_end == st->buf + p) {
+		st->tokens[st->ntokens - 1].len += q - p;
+	} else {
+		if (st->ntokens == st->maxtokens) {
+			st->maxtokens = st->maxtokens ? st->maxtokens * 2 : 64;
+			st->tokens = realloc(st->tokens, st->maxtokens * sizeof(*st->tokens));
+			assert(st->tokens);
+		}
+		st->tokens[st->ntokens].str = st->buf + p;
+		st->tokens[st->ntokens].len = q - p;
+		st->ntokens++;
+	}
+	st->tok_open = true;
+	st->tok_end = st->buf + q;
+}
+
+static bool
+zscan_token_is(const zscan_token *t, const char *s)
+{
+	return t->len == strlen(s) && strncasecmp(t->str, s, t->len) == 0;
+}
+
+static char *
+zscan_token_dup(const zscan_token *t)
+{
+	char *s = strndup(t->str, t->len);
+	assert(s);
+	return s;
+}
+
+static ldns_status
+zscan_directive(zscan_state *st)
+{
+	ldns_status status = LDNS_STATUS_OK;
+	char *arg;
+	if (zscan_token_is(&st->tokens[0], "$INCLUDE"))
+		return LDNS_STATUS_SYNTAX_INCLUDE_ERR_NOTIMPL;
+	if (st->ntokens < 2)
+		return LDNS_STATUS_SYNTAX_ERR;
+	arg = zscan_token_dup(&st->tokens[1]);
+	if (zscan_token_is(&st->tokens[0], "$ORIGIN")) {
+		ldns_rdf *o = ldns_dname_new_frm_str(arg);
+		if (o == 0) {
+			status = LDNS_STATUS_SYNTAX_ORIGIN;
+		} else {
+			if (!ldns_dname_str_absolute(arg) && st->origin)
+				ldns_dname_cat(o, st->origin);
+			if (st->origin)
+				ldns_rdf_deep_free(st->origin);
+			st->origin = o;
+		}
+	} else if (zscan_token_is(&st->tokens[0], "$TTL")) {
+		const char *end = 0;
+		st->ttl = ldns_str2period(arg, &end);
+		if (end == arg || *end != '\0')
+			status = LDNS_STATUS_SYNTAX_TTL;
+	} else {
+		status = LDNS_STATUS_SYNTAX_ERR;
+	}
+	free(arg);
+	return status;
+}
+
+/*
+ * zscan_rr()
+ *
+ * The RR builder.  Common types are built straight from the tokens by
+ * fastrr_new_frm_tokens().  Otherwise the tokens are joined into a single
+ * line, with the previous owner name substituted when the record has
+ * none, and given to ldns.
+ */
+static ldns_status
+zscan_rr(zscan_state *st, bool blank_owner)
+{
+	ldns_status status;
+	ldns_rr *rr = 0;
+	size_t need = 1;
+	size_t pos = 0;
+	size_t i;
+	const char *owner_str = 0;
+
+	if (blank_owner && st->prev == 0 && st->origin == 0)
+		return LDNS_STATUS_SYNTAX_ERR;
+	if (fastrr_new_frm_tokens(&rr, st->tokens, st->ntokens, blank_owner ? (st->prev ? st->prev : st->origin) : 0, st->ttl, st->origin))
+		goto parsed;
+
+	if (blank_owner) {
+		if (st->prev_str == 0) {
+			st->prev_str = ldns_rdf2str(st->prev ? st->prev : st->origin);
+			assert(st->prev_str);
+		}
+		owner_str = st->prev_str;
+		need += strlen(owner_str) + 1;
+	}
+	for (i = 0; i < st->ntokens; i++)
+		need += st->tokens[i].len + 1;
+	if (need > st->linesz) {
+		st->linesz = need * 2;
+		st->line = realloc(st->line, st->linesz);
+		assert(st->line);
+	}
+	if (owner_str) {
+		pos = strlen(owner_str);
+		memcpy(st->line, owner_str, pos);
+	}
+	for (i = 0; i < st->ntokens; i++) {
+		if (pos)
+			st->line[pos++] = ' ';
+		memcpy(st->line + pos, st->tokens[i].str, st->tokens[i].len);
+		pos += st->tokens[i].len;
+	}
+	st->line[pos] = '\0';
+
+	status = ldns_rr_new_frm_str(&rr, st->line, st->ttl, st->origin, 0);
+	if (status != LDNS_STATUS_OK)
+		return status;
+parsed:
+	if (!blank_owner) {
+		if (st->prev)
+			ldns_rdf_deep_free(st->prev);
+		st->prev = ldns_rdf_clone(ldns_rr_owner(rr));
+		free(st->prev_str);
+		st->prev_str = 0;
+	}
+	if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_SOA) {
+		if (st->soa_seen) {
+			/* like ldns, silently ignore a second SOA */
+			ldns_rr_free(rr);
+			return LDNS_STATUS_OK;
+		}
+		st->soa_seen = true;
+		ldns_zone_set_soa(st->zone, rr);
+		return LDNS_STATUS_OK;
+	}
+	ldns_zone_push_rr(st->zone, rr);
+	return LDNS_STATUS_OK;
+}
+
+static ldns_status
+zscan_record(zscan_state *st, bool blank_owner)
+{
+	ldns_status status = LDNS_STATUS_OK;
+	if (st->ntokens == 0)
+		return status;
+	if (!blank_owner && st->tokens[0].str[0] == '$')
+		status = zscan_directive(st);
+	else
+		status = zscan_rr(st, blank_owner);
+	st->ntokens = 0;
+	st->tok_open = false;
+	return status;
+}
+
+/*
+ * zscan_parse()
+ *
+ * Stage 2.
+ */
+static ldns_status
+zscan_parse(zscan_state *st, size_t len, const uint32_t *idx, size_t nidx, int *line_nr)
+{
+	ldns_status status;
+	size_t k;
+	unsigned int depth = 0;
+	bool in_quote = false;
+	bool in_comment = false;
+	bool escape = false;
+	bool at_line_start = true;
+	bool blank_owner = false;
+
+	for (k = 0; k < nidx; k++) {
+		size_t p = idx[k];
+		size_t q = k + 1 < nidx ? idx[k + 1] : len;
+		bool line_start = at_line_start;
+		char c;
+		at_line_start = false;
+		if (escape) {
+			zscan_token_add(st, p, p + 1);
+			escape = false;
+			if (st->buf[p] == '\n')
+				(*line_nr)++;
+			if (++p == q)
+				continue;
+		}
+		c = st->buf[p];
+		if (in_comment) {
+			if (c != '\n')
+				continue;
+			in_comment = false;
+		}
+		if (in_quote) {
+			if (c == '\\')
+				escape = true;
+			else if (c == '"')
+				in_quote = false;
+			else if (c == '\n')
+				(*line_nr)++;
+			zscan_token_add(st, p, q);
+			continue;
+		}
+		switch (c) {
+		case ' ':
+		case '\t':
+		case '\r':
+			if (line_start && st->ntokens == 0)
+				blank_owner = true;
+			st->tok_open = false;
+			break;
+		case '\n':
+			(*line_nr)++;
+			st->tok_open = false;
+			if (depth == 0) {
+				status = zscan_record(st, blank_owner);
+				if (status != LDNS_STATUS_OK)
+					return status;
+				blank_owner = false;
+				at_line_start = true;
+			}
+			break;
+		case '"':
+			zscan_token_add(st, p, q);
+			in_quote = true;
+			break;
+		case '\\':
+			zscan_token_add(st, p, q);
+			escape = true;
+			break;
+		case '(':
+			st->tok_open = false;
+			depth++;
+			break;
+		case ')':
+			st->tok_open = false;
+			if (depth == 0)
+				return LDNS_STATUS_SYNTAX_ERR;
+			depth--;
+			break;
+		case ';':
+			st->tok_open = false;
+			in_comment = true;
+			break;
+		default:
+			zscan_token_add(st, p, q);
+			break;
+		}
+	}
+	if (in_quote || depth != 0 || escape)
+		return LDNS_STATUS_SYNTAX_ERR;
+	return zscan_record(st, blank_owner);
+}
+
+static char *
+zscan_slurp(FILE *fp, size_t *ret_len)
+{
+	size_t cap = 1 << 20;
+	size_t len = 0;
+	size_t n;
+	char *buf = malloc(cap + ZSCAN_BLOCK);
+	assert(buf);
+	while ((n = fread(buf + len, 1, cap - len, fp)) > 0) {
+		len += n;
+		if (len == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap + ZSCAN_BLOCK);
+			assert(buf);
+		}
+	}
+	if (ferror(fp)) {
+		free(buf);
+		return 0;
+	}
+	memset(buf + len, 0, ZSCAN_BLOCK);
+	*ret_len = len;
+	return buf;
+}
+
+/*
+ * zscan_zone_new_frm_fp()
+ *
+ * Drop-in replacement for ldns_zone_new_frm_fp(), reading the whole file
+ * into memory and parsing it with the scanner above.  On error, the line
+ * number is returned in 'line_nr'.
+ */
+ldns_status
+zscan_zone_new_frm_fp(ldns_zone **z, FILE *fp, const ldns_rdf *origin, uint32_t ttl, ldns_rr_class c_unused, int *line_nr)
+{
+	ldns_status status;
+	zscan_state st;
+	size_t len;
+	size_t nidx;
+	uint32_t *idx;
+	char *buf;
+
+	*line_nr = 1;
+	buf = zscan_slurp(fp, &len);
+	if (buf == 0)
+		return LDNS_STATUS_ERR;
+	if (len >= UINT32_MAX) {
+		free(buf);
+		return LDNS_STATUS_MEM_ERR;
+	}
+	idx = zscan_index(buf, len, &nidx);
+	memset(&st, 0, sizeof(st));
+	st.buf = buf;
+	st.ttl = ttl;
+	st.origin = origin ? ldns_rdf_clone(origin) : 0;
+	st.zone = ldns_zone_new();
+	assert(st.zone);
+	status = zscan_parse(&st, len, idx, nidx, line_nr);
+	if (status == LDNS_STATUS_OK)
+		*z = st.zone;
+	else
+		ldns_zone_deep_free(st.zone);
+	if (st.origin)
+		ldns_rdf_deep_free(st.origin);
+	if (st.prev)
+		ldns_rdf_deep_free(st.prev);
+	free(st.prev_str);
+	free(st.tokens);
+	free(st.line);
+	free(idx);
+	free(buf);
+	return status;
+}
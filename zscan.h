@@ -0,0 +1,6 @@
+typedef struct {
+	const char *str;
+	size_t len;
+} zscan_token;
+
+ldns_status zscan_zone_new_frm_fp(ldns_zone **z, FILE *fp, const ldns_rdf *origin, uint32_t ttl, ldns_rr_class c, int *line_nr);